@@ -0,0 +1,149 @@
+
+#include "fs.h"
+#include "fs_internal.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+// Block allocation throughput as writer threads are added. Each run starts
+// from a freshly mounted filesystem on a RAM disk, so only the allocator is
+// measured, and every thread allocates through its own shard until the disk
+// is full.
+#define ALLOC_BENCH_BLOCKS (1 << 20)
+#define ALLOC_BENCH_THREADS 16
+
+struct alloc_worker
+{
+    pthread_t thread;
+    struct fs_ctx *fs;
+    pthread_barrier_t *start;
+    int shard;
+    long blocks;
+};
+
+static void *alloc_worker_run(void *arg)
+{
+    struct alloc_worker *worker = arg;
+
+    bind_alloc_shard(worker->shard);
+    pthread_barrier_wait(worker->start);
+
+    while (allocate_new_block(worker->fs))
+    {
+        worker->blocks++;
+    }
+
+    return 0;
+}
+
+// Returns the blocks allocated per second, or 0 if the run went wrong
+static double run(struct fs_ctx *fs, int nthreads, long *blocks)
+{
+    struct alloc_worker workers[ALLOC_BENCH_THREADS];
+    struct fs_statfs before, after;
+    pthread_barrier_t start;
+    double seconds;
+
+    if (!fs_mount(fs) || !fs_statfs(fs, &before))
+    {
+        printf("mount failed!\n");
+        return 0;
+    }
+
+    *blocks = 0;
+    pthread_barrier_init(&start, 0, nthreads + 1);
+
+    for (int i = 0; i < nthreads; i++)
+    {
+        workers[i].fs = fs;
+        workers[i].start = &start;
+        workers[i].shard = i;
+        workers[i].blocks = 0;
+
+        if (pthread_create(&workers[i].thread, 0, alloc_worker_run, &workers[i]))
+        {
+            printf("couldn't start thread %d\n", i);
+            exit(1);
+        }
+    }
+
+    seconds = stats_seconds();
+    pthread_barrier_wait(&start);
+
+    for (int i = 0; i < nthreads; i++)
+    {
+        pthread_join(workers[i].thread, 0);
+        *blocks += workers[i].blocks;
+    }
+
+    seconds = stats_seconds() - seconds;
+    pthread_barrier_destroy(&start);
+
+    // Every free block handed out exactly once leaves none free and none over
+    fs_statfs(fs, &after);
+    if (*blocks != before.free_blocks || after.free_blocks)
+    {
+        printf("%d threads allocated %ld blocks of %d free, leaving %d\n", nthreads, *blocks, before.free_blocks,
+               after.free_blocks);
+        return 0;
+    }
+
+    return seconds > 0 ? *blocks / seconds : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int nblocks = argc > 1 ? atoi(argv[1]) : ALLOC_BENCH_BLOCKS;
+    int max_threads = argc > 2 ? atoi(argv[2]) : ALLOC_BENCH_THREADS;
+    double base = 0;
+
+    if (argc > 3 || nblocks <= 0 || max_threads <= 0 || max_threads > ALLOC_BENCH_THREADS)
+    {
+        printf("use: %s [nblocks] [threads up to %d]\n", argv[0], ALLOC_BENCH_THREADS);
+        return 1;
+    }
+
+    struct disk *disk = disk_init_ram(0, nblocks);
+    if (!disk)
+    {
+        printf("couldn't create a RAM disk of %d blocks: %s\n", nblocks, strerror(errno));
+        return 1;
+    }
+
+    struct fs_ctx *fs = fs_ctx_init(disk);
+    if (!fs || !fs_format(fs))
+    {
+        printf("format failed!\n");
+        fs_ctx_free(fs);
+        disk_close(disk);
+        return 1;
+    }
+
+    printf("%8s %12s %14s %8s\n", "threads", "blocks", "blocks/s", "speedup");
+
+    for (int nthreads = 1; nthreads <= max_threads; nthreads *= 2)
+    {
+        long blocks;
+        double rate = run(fs, nthreads, &blocks);
+
+        if (!rate)
+        {
+            break;
+        }
+
+        if (!base)
+        {
+            base = rate;
+        }
+
+        printf("%8d %12ld %14.0f %7.2fx\n", nthreads, blocks, rate, rate / base);
+    }
+
+    fs_ctx_free(fs);
+    disk_close(disk);
+    return 0;
+}
@@ -0,0 +1,825 @@
+
+#include "fs.h"
+#include "disk.h"
+#include "crc32c.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BENCH_IMAGE "bench.img"
+#define BENCH_INPUT "bench_in.txt"
+#define BENCH_COPY "bench_out.txt"
+#define BENCH_OUTPUT "bench_output.txt"
+
+// Copies move a whole block of the largest size per call, so no block size
+// has to read back part of a block it is writing
+#define COPY_CHUNK DISK_MAX_BLOCK_SIZE
+#define MAX_SAMPLES 4096
+
+#define READ_BUFFER_SIZE COPY_CHUNK
+
+// Scatter/gather calls move the whole file at once, in buffers of the I/O
+// size that start at odd offsets, as a producer's fragments might
+#define VECTOR_SLACK 24
+
+#define FORMAT_ITERATIONS 5
+#define MOUNT_ITERATIONS 5
+#define CREATE_ITERATIONS 64
+#define RANDOM_ITERATIONS 256
+#define COPY_ITERATIONS 8
+#define SCRUB_ITERATIONS 4
+
+// The checksum kernels are timed over a buffer this big, a block at a time
+#define CRC_BUFFER_SIZE (16 * 1024 * 1024)
+#define CRC_PASSES 4
+
+struct bench_image
+{
+    const char *name;
+    const char *source;
+    int nblocks;
+};
+
+static struct bench_image images[] = {
+    {"image.5", "image.5", 5},
+    {"image.20", "image.20", 20},
+    {"image.200", "image.200", 200},
+    {"generated.2000", 0, 2000},
+    {"generated.20000", 0, 20000},
+};
+
+static const int io_sizes[] = {4096, 8192};
+static const int copy_sizes[] = {0, 65536, 1048576};
+
+// Large sequential copies repeated at each block size
+static const int block_sizes[] = {4096, 16384, 65536};
+static const int media_sizes[] = {1048576, 8388608};
+
+static const int crc_sizes[] = {4096, 65536};
+
+static FILE *output;
+static struct disk *disk;
+static struct fs_ctx *fs;
+static const char *current_image;
+static int current_blocks;
+
+// With -m every step runs on a RAM disk loaded from the scratch image and
+// saved back to it afterwards, so the host's storage stays out of the numbers
+static int use_ram;
+
+static char read_buffer[READ_BUFFER_SIZE];
+static double samples[MAX_SAMPLES];
+static int nsamples;
+static int phase_reads;
+static int phase_writes;
+
+static int compare_samples(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void phase_begin()
+{
+    nsamples = 0;
+    phase_reads = disk_read_count(disk);
+    phase_writes = disk_write_count(disk);
+}
+
+static void phase_sample(double start)
+{
+    if (nsamples < MAX_SAMPLES)
+    {
+        samples[nsamples++] = stats_seconds() - start;
+    }
+}
+
+static double percentile(double p)
+{
+    if (!nsamples)
+    {
+        return 0;
+    }
+
+    int index = (int)(p * (nsamples - 1) + 0.5);
+    return samples[index];
+}
+
+// Emit one result line for the phase that was started with phase_begin(). Rates
+// are taken over the sampled operations only, not the untimed setup between them.
+static void phase_end(const char *op, int size, long bytes)
+{
+    double seconds = 0;
+    int reads = disk_read_count(disk) - phase_reads;
+    int writes = disk_write_count(disk) - phase_writes;
+
+    for (int i = 0; i < nsamples; i++)
+    {
+        seconds += samples[i];
+    }
+
+    qsort(samples, nsamples, sizeof(double), compare_samples);
+
+    fprintf(output, "{\"image\": \"%s\", \"backend\": \"%s\", \"nblocks\": %d, \"block_size\": %d, \"op\": \"%s\", \"size\": %d, "
+                    "\"count\": %d, \"bytes\": %ld, \"seconds\": %.6f, \"ops_per_s\": %.1f, "
+                    "\"mb_per_s\": %.3f, \"p50_us\": %.2f, \"p99_us\": %.2f, "
+                    "\"block_reads\": %d, \"block_writes\": %d}\n",
+            current_image, disk_backend_name(disk), current_blocks, disk_block_size(disk), op, size, nsamples, bytes, seconds,
+            seconds > 0 ? nsamples / seconds : 0,
+            seconds > 0 ? bytes / seconds / (1024 * 1024) : 0,
+            percentile(0.50) * 1e6, percentile(0.99) * 1e6, reads, writes);
+
+    printf("%-16s %5dK %-12s %8d bytes %6d ops %10.1f ops/s %9.3f MB/s\n", current_image,
+           disk_block_size(disk) / 1024, op, size, nsamples, seconds > 0 ? nsamples / seconds : 0,
+           seconds > 0 ? bytes / seconds / (1024 * 1024) : 0);
+}
+
+static int copy_file(const char *from, const char *to)
+{
+    FILE *in, *out;
+    char buffer[16384];
+    int result;
+
+    in = fopen(from, "r");
+    if (!in)
+    {
+        printf("couldn't open %s: %s\n", from, strerror(errno));
+        return 0;
+    }
+
+    out = fopen(to, "w");
+    if (!out)
+    {
+        printf("couldn't open %s: %s\n", to, strerror(errno));
+        fclose(in);
+        return 0;
+    }
+
+    // Runs of zeroes are skipped rather than written, so a sparse image stays sparse
+    while ((result = fread(buffer, 1, sizeof(buffer), in)) > 0)
+    {
+        if (result == sizeof(buffer) && !buffer[0] && !memcmp(buffer, buffer + 1, sizeof(buffer) - 1))
+        {
+            fseek(out, result, SEEK_CUR);
+        }
+        else
+        {
+            fwrite(buffer, 1, result, out);
+        }
+    }
+
+    // A trailing hole needs the size set explicitly
+    fflush(out);
+    ftruncate(fileno(out), ftell(out));
+
+    fclose(in);
+    fclose(out);
+    return 1;
+}
+
+// Build a text input of the given size by repeating c_long.txt; size 0 means c_long.txt itself
+static int make_input(int size)
+{
+    if (!size)
+    {
+        return copy_file("c_long.txt", BENCH_INPUT) ? 11760 : 0;
+    }
+
+    FILE *in = fopen("c_long.txt", "r");
+    FILE *out = fopen(BENCH_INPUT, "w");
+    char buffer[16384];
+    int result, written = 0;
+
+    if (!in || !out)
+    {
+        printf("couldn't create %s: %s\n", BENCH_INPUT, strerror(errno));
+        if (in)
+            fclose(in);
+        if (out)
+            fclose(out);
+        return 0;
+    }
+
+    while (written < size)
+    {
+        result = fread(buffer, 1, sizeof(buffer), in);
+        if (result <= 0)
+        {
+            rewind(in);
+            continue;
+        }
+        if (result > size - written)
+        {
+            result = size - written;
+        }
+        fwrite(buffer, 1, result, out);
+        written += result;
+    }
+
+    fclose(in);
+    fclose(out);
+    return written;
+}
+
+// Fill a buffer with printable bytes, so a file left in an image reads as text
+static void fill_text(char *buffer, int length)
+{
+    for (int i = 0; i < length; i++)
+    {
+        buffer[i] = 'a' + i % 26;
+    }
+    buffer[length] = 0;
+}
+
+// Bytes of file data the mounted image can hold, leaving room for the indirect block
+static long data_capacity()
+{
+    long blocks = disk_size(disk) - disk_size(disk) / 10 - 3;
+    long max_blocks = disk_block_size(disk) / sizeof(int);
+
+    if (blocks > max_blocks)
+    {
+        blocks = max_blocks;
+    }
+
+    return blocks > 0 ? blocks * disk_block_size(disk) : 0;
+}
+
+// Start the next phase from a fresh mount, so the allocator state one phase
+// leaves behind doesn't shape where the next one's blocks go
+static void remount()
+{
+    fs_mount(fs);
+}
+
+static void bench_mount()
+{
+    phase_begin();
+    for (int i = 0; i < MOUNT_ITERATIONS; i++)
+    {
+        double start = stats_seconds();
+        if (!fs_mount(fs))
+        {
+            printf("mount failed!\n");
+            return;
+        }
+        phase_sample(start);
+    }
+    phase_end("mount", 0, 0);
+}
+
+static void bench_format()
+{
+    phase_begin();
+    for (int i = 0; i < FORMAT_ITERATIONS; i++)
+    {
+        double start = stats_seconds();
+        fs_format(fs);
+        phase_sample(start);
+    }
+    phase_end("format", 0, 0);
+
+    // The same with every inode block rewritten, as format did before epochs
+    phase_begin();
+    for (int i = 0; i < FORMAT_ITERATIONS; i++)
+    {
+        double start = stats_seconds();
+        fs_format_with(fs, DISK_BLOCK_SIZE, 0, 1);
+        phase_sample(start);
+    }
+    phase_end("format_full", 0, 0);
+}
+
+static void bench_create_delete()
+{
+    int inumbers[CREATE_ITERATIONS];
+    int created = 0;
+
+    phase_begin();
+    for (int i = 0; i < CREATE_ITERATIONS; i++)
+    {
+        double start = stats_seconds();
+        inumbers[created] = fs_create(fs);
+        phase_sample(start);
+
+        if (inumbers[created] > 0)
+        {
+            created++;
+        }
+    }
+    phase_end("create", 0, 0);
+
+    phase_begin();
+    for (int i = 0; i < created; i++)
+    {
+        double start = stats_seconds();
+        fs_delete(fs, inumbers[i]);
+        phase_sample(start);
+    }
+    phase_end("delete", 0, 0);
+
+    remount();
+}
+
+static void bench_vector(int inumber, int chunks, int size)
+{
+    struct iovec *iov = malloc(chunks * sizeof(struct iovec));
+    char *buffer = malloc((long)chunks * (size + VECTOR_SLACK));
+    long bytes;
+
+    if (!iov || !buffer)
+    {
+        free(iov);
+        free(buffer);
+        return;
+    }
+
+    fill_text(buffer, (long)chunks * (size + VECTOR_SLACK) - 1);
+    for (int i = 0; i < chunks; i++)
+    {
+        iov[i].iov_base = buffer + (long)i * (size + VECTOR_SLACK) + i % VECTOR_SLACK;
+        iov[i].iov_len = size;
+    }
+
+    bytes = 0;
+    phase_begin();
+    for (int i = 0; i < COPY_ITERATIONS; i++)
+    {
+        double start = stats_seconds();
+        bytes += fs_writev(fs, inumber, iov, chunks, 0);
+        phase_sample(start);
+    }
+    phase_end("writev", size, bytes);
+
+    bytes = 0;
+    phase_begin();
+    for (int i = 0; i < COPY_ITERATIONS; i++)
+    {
+        double start = stats_seconds();
+        bytes += fs_readv(fs, inumber, iov, chunks, 0);
+        phase_sample(start);
+    }
+    phase_end("readv", size, bytes);
+
+    free(iov);
+    free(buffer);
+}
+
+// Check every block in use against its checksum, which on these images is
+// mostly the file bench_io wrote. Images without checksums are skipped.
+static void bench_scrub(int size)
+{
+    struct fs_scrub_report report;
+    long bytes = 0;
+
+    phase_begin();
+    for (int i = 0; i < SCRUB_ITERATIONS; i++)
+    {
+        double start = stats_seconds();
+        if (!fs_scrub(fs, 0, 0, &report, 0))
+        {
+            return;
+        }
+        bytes += report.bytes;
+        phase_sample(start);
+    }
+    phase_end("scrub", size, bytes);
+}
+
+static void bench_io(int size)
+{
+    char *data = malloc(size + 1);
+    long file_size = data_capacity() / size * size;
+    long bytes;
+    int inumber, chunks;
+
+    if (!data || file_size < size)
+    {
+        free(data);
+        return;
+    }
+
+    chunks = file_size / size;
+    fill_text(data, size);
+
+    inumber = fs_create(fs);
+    if (inumber <= 0)
+    {
+        free(data);
+        return;
+    }
+
+    bytes = 0;
+    phase_begin();
+    for (int i = 0; i < chunks; i++)
+    {
+        double start = stats_seconds();
+        bytes += fs_write(fs, inumber, data, size, i * size);
+        phase_sample(start);
+    }
+    phase_end("seq_write", size, bytes);
+
+    bytes = 0;
+    phase_begin();
+    for (int i = 0; i < chunks; i++)
+    {
+        double start = stats_seconds();
+        bytes += fs_read(fs, inumber, read_buffer, size, i * size);
+        phase_sample(start);
+    }
+    phase_end("seq_read", size, bytes);
+
+    bytes = 0;
+    phase_begin();
+    for (int i = 0; i < RANDOM_ITERATIONS; i++)
+    {
+        double start = stats_seconds();
+        bytes += fs_read(fs, inumber, read_buffer, size, (rand() % chunks) * size);
+        phase_sample(start);
+    }
+    phase_end("rand_read", size, bytes);
+
+    // fs_write drops the file past each write, so random overwrites keep to
+    // as many as there are chunks
+    int iterations = chunks < RANDOM_ITERATIONS ? chunks : RANDOM_ITERATIONS;
+
+    bytes = 0;
+    phase_begin();
+    for (int i = 0; i < iterations; i++)
+    {
+        double start = stats_seconds();
+        bytes += fs_write(fs, inumber, data, size, (rand() % chunks) * size);
+        phase_sample(start);
+    }
+    phase_end("rand_write", size, bytes);
+
+    bench_vector(inumber, chunks, size);
+    bench_scrub(size);
+
+    fs_delete(fs, inumber);
+    remount();
+    free(data);
+}
+
+// copyin and copyout stream through an open file handle in COPY_CHUNK
+// pieces, the same way the shell does
+static int copyin(const char *filename, int inumber)
+{
+    FILE *file = fopen(filename, "r");
+    struct fs_file *handle = fs_open(fs, inumber);
+    char buffer[COPY_CHUNK];
+    int offset = 0, result, actual;
+
+    if (!file || !handle)
+    {
+        if (file)
+            fclose(file);
+        if (handle)
+            fs_close(handle);
+        return 0;
+    }
+
+    fs_truncate_h(handle, 0);
+
+    while ((result = fread(buffer, 1, COPY_CHUNK, file)) > 0)
+    {
+        actual = fs_write_h(handle, buffer, result);
+        if (actual <= 0)
+        {
+            break;
+        }
+        offset += actual;
+        if (actual != result)
+        {
+            break;
+        }
+    }
+
+    fs_close(handle);
+    fclose(file);
+    return offset;
+}
+
+static int copyout(int inumber, const char *filename)
+{
+    FILE *file = fopen(filename, "w");
+    struct fs_file *handle = fs_open(fs, inumber);
+    int offset = 0, result;
+
+    if (!file || !handle)
+    {
+        if (file)
+            fclose(file);
+        if (handle)
+            fs_close(handle);
+        return 0;
+    }
+
+    while ((result = fs_read_h(handle, read_buffer, COPY_CHUNK)) > 0)
+    {
+        fwrite(read_buffer, 1, result, file);
+        offset += result;
+    }
+
+    fs_close(handle);
+    fclose(file);
+    return offset;
+}
+
+// Touch every byte, so a lazily mapped file is read in full; the sum only
+// keeps the loop from being optimised away
+static volatile unsigned char scan_sum;
+
+static long scan(const char *data, long length)
+{
+    unsigned char total = 0;
+
+    for (long i = 0; i < length; i++)
+    {
+        total += data[i];
+    }
+
+    scan_sum = total;
+    return length;
+}
+
+static void bench_copy(int size)
+{
+    int inumbers[COPY_ITERATIONS];
+    long bytes;
+
+    size = make_input(size);
+    if (!size || size > data_capacity())
+    {
+        return;
+    }
+
+    bytes = 0;
+    phase_begin();
+    for (int i = 0; i < COPY_ITERATIONS; i++)
+    {
+        inumbers[i] = fs_create(fs);
+
+        double start = stats_seconds();
+        bytes += copyin(BENCH_INPUT, inumbers[i]);
+        phase_sample(start);
+
+        // Keep only one copy on disk at a time so small images don't fill up
+        if (i < COPY_ITERATIONS - 1)
+        {
+            fs_delete(fs, inumbers[i]);
+            remount();
+        }
+    }
+    phase_end("copyin", size, bytes);
+
+    int inumber = inumbers[COPY_ITERATIONS - 1];
+
+    bytes = 0;
+    phase_begin();
+    for (int i = 0; i < COPY_ITERATIONS; i++)
+    {
+        double start = stats_seconds();
+        bytes += copyout(inumber, BENCH_COPY);
+        phase_sample(start);
+    }
+    phase_end("copyout", size, bytes);
+
+    // Scanning a mapped file, as a parser would, without copying it out first
+    bytes = 0;
+    phase_begin();
+    for (int i = 0; i < COPY_ITERATIONS; i++)
+    {
+        double start = stats_seconds();
+        long length;
+        const char *data = fs_mmap(fs, inumber, &length);
+
+        if (data)
+        {
+            bytes += scan(data, length);
+            fs_munmap(fs, data, length);
+        }
+        phase_sample(start);
+    }
+    phase_end("mmap", size, bytes);
+
+    fs_delete(fs, inumber);
+    remount();
+}
+
+// Keeps the checksum loops from being optimised away
+static volatile uint32_t crc_sum;
+
+// Checksum throughput on its own, for the kernel this CPU runs and for the
+// portable one, without any disk in the way
+static void bench_crc32c()
+{
+    char *buffer = malloc(CRC_BUFFER_SIZE);
+
+    if (!buffer)
+    {
+        return;
+    }
+
+    fill_text(buffer, CRC_BUFFER_SIZE - 1);
+
+    for (int kind = 0; kind < 2; kind++)
+    {
+        const char *kernel = kind ? "portable" : crc32c_kernel();
+        uint32_t (*function)(uint32_t, const void *, long) = kind ? crc32c_portable : crc32c;
+
+        for (int i = 0; i < sizeof(crc_sizes) / sizeof(crc_sizes[0]); i++)
+        {
+            uint32_t crc = 0;
+            long bytes = (long)CRC_PASSES * CRC_BUFFER_SIZE;
+            double start = stats_seconds();
+
+            for (int pass = 0; pass < CRC_PASSES; pass++)
+            {
+                for (long offset = 0; offset < CRC_BUFFER_SIZE; offset += crc_sizes[i])
+                {
+                    crc ^= function(0, buffer + offset, crc_sizes[i]);
+                }
+            }
+
+            double seconds = stats_seconds() - start;
+            crc_sum = crc;
+
+            fprintf(output, "{\"op\": \"crc32c\", \"kernel\": \"%s\", \"size\": %d, \"bytes\": %ld, "
+                            "\"seconds\": %.6f, \"gb_per_s\": %.3f}\n",
+                    kernel, crc_sizes[i], bytes, seconds, seconds > 0 ? bytes / seconds / 1e9 : 0);
+
+            printf("%-16s %5dK %-12s %-10s %9.3f GB/s\n", "crc32c", crc_sizes[i] / 1024, "checksum", kernel,
+                   seconds > 0 ? bytes / seconds / 1e9 : 0);
+        }
+    }
+
+    free(buffer);
+}
+
+// Run one benchmark step against a fresh disk handle and filesystem context
+static void run_step(struct bench_image *image, void (*step)(struct bench_image *))
+{
+    current_image = image->name;
+    current_blocks = image->nblocks;
+    srand(image->nblocks);
+
+    disk = use_ram ? disk_init_ram(BENCH_IMAGE, image->nblocks) : disk_init(BENCH_IMAGE, image->nblocks);
+    if (!disk)
+    {
+        printf("couldn't initialize %s: %s\n", BENCH_IMAGE, strerror(errno));
+        return;
+    }
+
+    fs = fs_ctx_init(disk);
+    if (!fs)
+    {
+        printf("couldn't allocate filesystem context\n");
+        disk_close(disk);
+        return;
+    }
+
+    step(image);
+
+    fs_ctx_free(fs);
+
+    // The next step picks up where this one left off
+    if (use_ram && !disk_save(disk, BENCH_IMAGE))
+    {
+        printf("couldn't save %s: %s\n", BENCH_IMAGE, strerror(errno));
+    }
+
+    disk_close(disk);
+}
+
+static void step_prepare(struct bench_image *image)
+{
+    if (!image->source)
+    {
+        fs_format(fs);
+    }
+}
+
+static void step_mount(struct bench_image *image)
+{
+    bench_mount();
+}
+
+static void step_format(struct bench_image *image)
+{
+    bench_format();
+}
+
+static void step_workload(struct bench_image *image)
+{
+    fs_format(fs);
+    if (!fs_mount(fs))
+    {
+        printf("mount failed!\n");
+        return;
+    }
+
+    bench_create_delete();
+
+    for (int i = 0; i < sizeof(io_sizes) / sizeof(io_sizes[0]); i++)
+    {
+        bench_io(io_sizes[i]);
+    }
+
+    for (int i = 0; i < sizeof(copy_sizes) / sizeof(copy_sizes[0]); i++)
+    {
+        bench_copy(copy_sizes[i]);
+    }
+}
+
+// Bigger blocks mean fewer pointers and fewer I/Os for the same bytes
+static void step_block_sizes(struct bench_image *image)
+{
+    for (int i = 0; i < sizeof(block_sizes) / sizeof(block_sizes[0]); i++)
+    {
+        if (!fs_format_with(fs, block_sizes[i], 0, 1) || !fs_mount(fs))
+        {
+            printf("format with %d byte blocks failed!\n", block_sizes[i]);
+            continue;
+        }
+
+        for (int j = 0; j < sizeof(media_sizes) / sizeof(media_sizes[0]); j++)
+        {
+            bench_copy(media_sizes[j]);
+        }
+
+        fs_ctx_free(fs);
+        fs = fs_ctx_init(disk);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filename = BENCH_OUTPUT;
+
+    const char *name = argv[0];
+
+    if (argc > 1 && !strcmp(argv[1], "-m"))
+    {
+        use_ram = 1;
+        argv++;
+        argc--;
+    }
+
+    if (argc > 2)
+    {
+        printf("use: %s [-m] [outputfile]\n", name);
+        return 1;
+    }
+
+    if (argc == 2)
+    {
+        filename = argv[1];
+    }
+
+    output = fopen(filename, "w");
+    if (!output)
+    {
+        printf("couldn't open %s: %s\n", filename, strerror(errno));
+        return 1;
+    }
+
+    bench_crc32c();
+
+    for (int i = 0; i < sizeof(images) / sizeof(images[0]); i++)
+    {
+        struct bench_image *image = &images[i];
+
+        // Work on a scratch copy so the shipped images are never modified
+        unlink(BENCH_IMAGE);
+        if (image->source && !copy_file(image->source, BENCH_IMAGE))
+        {
+            continue;
+        }
+
+        run_step(image, step_prepare);
+        run_step(image, step_mount);
+        run_step(image, step_format);
+        run_step(image, step_workload);
+
+        if (!image->source)
+        {
+            run_step(image, step_block_sizes);
+        }
+    }
+
+    unlink(BENCH_IMAGE);
+    unlink(BENCH_INPUT);
+    unlink(BENCH_COPY);
+
+    fclose(output);
+    printf("results written to %s\n", filename);
+
+    return 0;
+}
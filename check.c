@@ -0,0 +1,512 @@
+
+#include "fs.h"
+#include "fs_internal.h"
+#include "pool.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#define PROBLEM_RANGE 0
+#define PROBLEM_DOUBLE 1
+#define PROBLEM_SIZE 2
+
+// Pointer slots within an inode: the direct pointers, then the indirect
+// pointer itself, then the entries of the indirect block
+#define SLOT_INDIRECT POINTERS_PER_INODE
+
+struct fsck_problem
+{
+    int type;
+    int inumber;
+    int slot;
+    int blocknum;
+    int owner;
+};
+
+// State shared by every worker; each block's claim counts, lowest claiming
+// inumber and clone family are updated atomically. A block claimed from more
+// than one family has FAMILY_MIXED. Each inode's family is kept by inumber.
+#define FAMILY_MIXED -1
+
+struct fsck_state
+{
+    struct fs_ctx *fs;
+    int repair;
+    int *claims;
+    int *indirects;
+    int *owner;
+    int *family;
+    int *families;
+};
+
+// One worker checks a contiguous range of inode blocks. Problems are kept
+// per worker and printed in inode order once all of them have finished.
+struct fsck_worker
+{
+    struct fsck_state *state;
+    int first;
+    int last;
+    int pass;
+
+    // Clone family of the inode being checked
+    int family;
+
+    union fs_block *block;
+    union fs_block *indirect;
+
+    struct fsck_problem *problems;
+    int nproblems;
+    int capacity;
+
+    int inodes;
+    int directories;
+    int reads[STATS_NUM_BLOCK_TYPES];
+    int writes[STATS_NUM_BLOCK_TYPES];
+};
+
+static void add_problem(struct fsck_worker *worker, int type, int inumber, int slot, int blocknum, int owner)
+{
+    if (worker->nproblems == worker->capacity)
+    {
+        worker->capacity = worker->capacity ? worker->capacity * 2 : 64;
+        worker->problems = realloc(worker->problems, worker->capacity * sizeof(struct fsck_problem));
+        if (!worker->problems)
+        {
+            worker->nproblems = worker->capacity = 0;
+            return;
+        }
+    }
+
+    struct fsck_problem *problem = &worker->problems[worker->nproblems++];
+    problem->type = type;
+    problem->inumber = inumber;
+    problem->slot = slot;
+    problem->blocknum = blocknum;
+    problem->owner = owner;
+}
+
+// Data and indirect blocks live after the superblock, the inode blocks and
+// the checksum blocks
+static int in_range(struct fs_ctx *fs, int blocknum)
+{
+    return blocknum >= first_data_block(fs) && blocknum < fs->nblocks;
+}
+
+// Clones share data blocks within their family, so a block can only have
+// more than one claim if all of them come from one family and it isn't also
+// used as an indirect block
+static int conflicting(struct fsck_state *state, int blocknum)
+{
+    return state->claims[blocknum] > 1 && (state->indirects[blocknum] || state->family[blocknum] == FAMILY_MIXED);
+}
+
+static void claim(struct fsck_state *state, int blocknum, int inumber, int slot, int family)
+{
+    int owner = __atomic_load_n(&state->owner[blocknum], __ATOMIC_RELAXED);
+    int first = 0;
+
+    if (!__atomic_compare_exchange_n(&state->family[blocknum], &first, family, 0, __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED) &&
+        first != family)
+    {
+        __atomic_store_n(&state->family[blocknum], FAMILY_MIXED, __ATOMIC_RELAXED);
+    }
+
+    __atomic_fetch_add(&state->claims[blocknum], 1, __ATOMIC_RELAXED);
+    if (slot == SLOT_INDIRECT)
+    {
+        __atomic_fetch_add(&state->indirects[blocknum], 1, __ATOMIC_RELAXED);
+    }
+
+    while (inumber < owner &&
+           !__atomic_compare_exchange_n(&state->owner[blocknum], &owner, inumber, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+// The first pass claims every pointer that is in range and notes the ones
+// that aren't. The second only runs when something needs reporting against
+// the final owners or repairing: it names each block that another inode owns,
+// unless it is a data block and the owner is of the same family, and when
+// repairing clears the pointers the first pass objected to.
+// Returns 1 if the pointer should be cleared.
+static int check_pointer(struct fsck_worker *worker, int inumber, int slot, int blocknum)
+{
+    struct fsck_state *state = worker->state;
+
+    if (!in_range(state->fs, blocknum))
+    {
+        if (worker->pass == 1)
+        {
+            add_problem(worker, PROBLEM_RANGE, inumber, slot, blocknum, 0);
+        }
+        return 1;
+    }
+
+    if (worker->pass == 1)
+    {
+        claim(state, blocknum, inumber, slot, worker->family);
+        return 0;
+    }
+
+    int owner = state->owner[blocknum];
+
+    if (conflicting(state, blocknum) && owner != inumber &&
+        (state->indirects[blocknum] || state->families[owner] != worker->family))
+    {
+        add_problem(worker, PROBLEM_DOUBLE, inumber, slot, blocknum, state->owner[blocknum]);
+        return 1;
+    }
+
+    return 0;
+}
+
+static int check_inode(struct fsck_worker *worker, int inumber, struct fs_inode *inode)
+{
+    struct fs_ctx *fs = worker->state->fs;
+    int max_size = (POINTERS_PER_INODE + fs->pointers_per_block) * fs->block_size;
+    int dirty = 0, indirect_dirty = 0;
+
+    worker->family = inode_family(inode, inumber);
+
+    if (worker->pass == 1)
+    {
+        worker->inodes++;
+        worker->directories += inode_type(inode) == FS_INODE_DIR;
+        worker->state->families[inumber] = worker->family;
+
+        if (inode->size < 0 || inode->size > max_size)
+        {
+            add_problem(worker, PROBLEM_SIZE, inumber, 0, inode->size, 0);
+        }
+    }
+    else if (worker->state->repair && (inode->size < 0 || inode->size > max_size))
+    {
+        inode->size = inode->size < 0 ? 0 : max_size;
+        dirty = 1;
+    }
+
+    for (int i = 0; i < POINTERS_PER_INODE; i++)
+    {
+        if (inode->direct[i] && check_pointer(worker, inumber, i, inode->direct[i]) && worker->pass == 2)
+        {
+            inode->direct[i] = 0;
+            dirty = 1;
+        }
+    }
+
+    if (!inode->indirect)
+    {
+        return dirty;
+    }
+
+    if (check_pointer(worker, inumber, SLOT_INDIRECT, inode->indirect))
+    {
+        // Whatever the indirect block points to is left unclaimed, so a
+        // repair hands those blocks back to the free map
+        if (worker->pass == 2)
+        {
+            inode->indirect = 0;
+            dirty = 1;
+        }
+        return dirty;
+    }
+
+    disk_read(fs->disk, inode->indirect, worker->indirect->data);
+    worker->reads[STATS_INDIRECT]++;
+
+    for (int i = 0; i < fs->pointers_per_block; i++)
+    {
+        int blocknum = worker->indirect->pointers[i];
+
+        if (blocknum && check_pointer(worker, inumber, SLOT_INDIRECT + 1 + i, blocknum) && worker->pass == 2)
+        {
+            worker->indirect->pointers[i] = 0;
+            indirect_dirty = 1;
+        }
+    }
+
+    if (indirect_dirty && worker->state->repair)
+    {
+        if (fs->checksums)
+        {
+            record_checksum(fs, inode->indirect, worker->indirect->data);
+        }
+        disk_write(fs->disk, inode->indirect, worker->indirect->data);
+        worker->writes[STATS_INDIRECT]++;
+    }
+
+    return dirty;
+}
+
+static void *fsck_worker_run(void *arg)
+{
+    struct fsck_worker *worker = arg;
+    struct fs_ctx *fs = worker->state->fs;
+
+    for (int i = worker->first; i < worker->last; i++)
+    {
+        int dirty = 0;
+
+        disk_read(fs->disk, i, worker->block->data);
+        worker->reads[STATS_INODE]++;
+
+        // Blocks from before the last format hold no inodes
+        if (!inode_block_current(worker->block, fs->epoch))
+        {
+            continue;
+        }
+
+        for (int j = 1; j < fs->inodes_per_block; j++)
+        {
+            if (worker->block->inode[j].isvalid)
+            {
+                dirty |= check_inode(worker, (i - 1) * fs->inodes_per_block + j, &worker->block->inode[j]);
+            }
+        }
+
+        if (dirty && worker->state->repair)
+        {
+            if (fs->checksums)
+            {
+                record_checksum(fs, i, worker->block->data);
+            }
+            disk_write(fs->disk, i, worker->block->data);
+            worker->writes[STATS_INODE]++;
+        }
+    }
+
+    return 0;
+}
+
+// Run one pass over the inode table with the blocks split evenly across the workers
+static void run_pass(struct fsck_worker *workers, int nthreads, int pass)
+{
+    for (int i = 0; i < nthreads; i++)
+    {
+        workers[i].pass = pass;
+    }
+
+    pool_run(fsck_worker_run, workers, nthreads, sizeof(struct fsck_worker));
+}
+
+static int compare_problems(const void *a, const void *b)
+{
+    const struct fsck_problem *x = a, *y = b;
+
+    if (x->inumber != y->inumber)
+        return x->inumber < y->inumber ? -1 : 1;
+
+    return x->slot - y->slot;
+}
+
+static void print_problem(FILE *log, struct fsck_problem *problem, int repair)
+{
+    char where[32];
+
+    if (problem->slot < SLOT_INDIRECT)
+        snprintf(where, sizeof(where), "direct pointer %d", problem->slot);
+    else if (problem->slot == SLOT_INDIRECT)
+        snprintf(where, sizeof(where), "indirect pointer");
+    else
+        snprintf(where, sizeof(where), "indirect entry %d", problem->slot - SLOT_INDIRECT - 1);
+
+    switch (problem->type)
+    {
+    case PROBLEM_RANGE:
+        fprintf(log, "inode %d: %s points to block %d, outside the data area%s\n", problem->inumber, where,
+                problem->blocknum, repair ? ", cleared" : "");
+        break;
+    case PROBLEM_DOUBLE:
+        fprintf(log, "inode %d: %s claims block %d, already used by inode %d%s\n", problem->inumber, where,
+                problem->blocknum, problem->owner, repair ? ", cleared" : "");
+        break;
+    case PROBLEM_SIZE:
+        fprintf(log, "inode %d: size %d is out of range%s\n", problem->inumber, problem->blocknum,
+                repair ? ", clamped" : "");
+        break;
+    }
+}
+
+static int do_fsck(struct fs_ctx *fs, int nthreads, int repair, struct fs_fsck_report *report, FILE *log)
+{
+    struct fsck_state state;
+    struct fsck_worker *workers;
+    int result = 1;
+
+    memset(report, 0, sizeof(struct fs_fsck_report));
+
+    // A read-only mount can be checked but not repaired, and nor can one
+    // with files mapped, whose references a rebuilt free map would lose
+    if (!fs->mounted || (repair && (fs->readonly || fs->mappings)))
+    {
+        if (log && fs->mounted && fs->mappings)
+            fprintf(log, "files are mapped; unmap them before repairing\n");
+        return 0;
+    }
+
+    nthreads = pool_threads(nthreads, fs->num_inode_blocks < FS_FSCK_MAX_THREADS ? fs->num_inode_blocks
+                                                                                : FS_FSCK_MAX_THREADS);
+
+    state.fs = fs;
+    state.repair = repair;
+    state.claims = calloc(fs->nblocks, sizeof(int));
+    state.indirects = calloc(fs->nblocks, sizeof(int));
+    state.owner = malloc(fs->nblocks * sizeof(int));
+    state.family = calloc(fs->nblocks, sizeof(int));
+    state.families = calloc((long)fs->num_inode_blocks * fs->inodes_per_block, sizeof(int));
+    workers = calloc(nthreads, sizeof(struct fsck_worker));
+
+    if (!state.claims || !state.indirects || !state.owner || !state.family || !state.families || !workers)
+    {
+        free(state.claims);
+        free(state.indirects);
+        free(state.owner);
+        free(state.family);
+        free(state.families);
+        free(workers);
+        return 0;
+    }
+
+    for (int i = 0; i < fs->nblocks; i++)
+    {
+        state.owner[i] = INT_MAX;
+    }
+
+    for (int i = 0; i < nthreads; i++)
+    {
+        workers[i].state = &state;
+        workers[i].first = 1 + (long)fs->num_inode_blocks * i / nthreads;
+        workers[i].last = 1 + (long)fs->num_inode_blocks * (i + 1) / nthreads;
+        workers[i].block = aligned_alloc(DISK_ALIGN, sizeof(union fs_block));
+        workers[i].indirect = aligned_alloc(DISK_ALIGN, sizeof(union fs_block));
+
+        if (!workers[i].block || !workers[i].indirect)
+        {
+            result = 0;
+        }
+    }
+
+    if (result)
+    {
+        int nproblems = 0, doubles = 0;
+
+        run_pass(workers, nthreads, 1);
+
+        for (int i = 0; i < nthreads; i++)
+        {
+            nproblems += workers[i].nproblems;
+        }
+        for (int i = 0; i < fs->nblocks; i++)
+        {
+            doubles += conflicting(&state, i);
+        }
+
+        if (doubles || (repair && nproblems))
+        {
+            run_pass(workers, nthreads, 2);
+        }
+
+        for (int i = 0; i < nthreads; i++)
+        {
+            // Workers cover ascending inode ranges, so sorting each list
+            // orders the whole log however the threads were scheduled
+            qsort(workers[i].problems, workers[i].nproblems, sizeof(struct fsck_problem), compare_problems);
+
+            report->inodes += workers[i].inodes;
+            report->directories += workers[i].directories;
+
+            for (int j = 0; j < workers[i].nproblems; j++)
+            {
+                struct fsck_problem *problem = &workers[i].problems[j];
+
+                report->range_errors += problem->type == PROBLEM_RANGE;
+                report->double_claims += problem->type == PROBLEM_DOUBLE;
+                report->bad_sizes += problem->type == PROBLEM_SIZE;
+
+                if (log)
+                {
+                    print_problem(log, problem, repair);
+                }
+            }
+
+            for (int j = 0; j < STATS_NUM_BLOCK_TYPES; j++)
+            {
+                fs->stats.block_reads[j] += workers[i].reads[j];
+                fs->stats.block_writes[j] += workers[i].writes[j];
+            }
+        }
+
+        // Compare what the inodes claim with the allocator's free map, once
+        // the blocks reserved for writers are back in it. Mapped files count
+        // as pointers to the blocks they hold.
+        unreserve_blocks(fs);
+        count_mapped_blocks(fs, state.claims);
+
+        for (int i = 0; i < fs->nblocks; i++)
+        {
+            int used = i < first_data_block(fs) || state.claims[i];
+
+            report->blocks_in_use += used;
+
+            if (fs->bitmap[i] && !used)
+            {
+                report->leaked++;
+                if (log)
+                    fprintf(log, "block %d is marked in use but nothing points to it%s\n", i, repair ? ", freed" : "");
+            }
+            else if (!fs->bitmap[i] && used)
+            {
+                report->unmarked++;
+                if (log)
+                    fprintf(log, "block %d is in use but marked free%s\n", i, repair ? ", marked" : "");
+            }
+            else if (state.claims[i] && fs->bitmap[i] != state.claims[i])
+            {
+                report->bad_counts++;
+                if (log)
+                    fprintf(log, "block %d has %d references in the free map but %d pointers%s\n", i, fs->bitmap[i],
+                            state.claims[i], repair ? ", recounted" : "");
+            }
+        }
+
+        // Repairs can change which blocks are reachable, so the free map is
+        // rebuilt from the inodes as they are now
+        if (repair && (report->range_errors || report->double_claims || report->bad_sizes || report->leaked ||
+                       report->unmarked || report->bad_counts))
+        {
+            memset(fs->bitmap, 0, disk_size(fs->disk) * sizeof(int));
+            create_new_bitmap(fs);
+            report->repaired = 1;
+        }
+    }
+
+    for (int i = 0; i < nthreads; i++)
+    {
+        free(workers[i].block);
+        free(workers[i].indirect);
+        free(workers[i].problems);
+    }
+
+    report->threads = nthreads;
+
+    free(workers);
+    free(state.claims);
+    free(state.indirects);
+    free(state.owner);
+    free(state.family);
+    free(state.families);
+
+    return result;
+}
+
+int fs_fsck(struct fs_ctx *fs, int nthreads, int repair, struct fs_fsck_report *report, FILE *log)
+{
+    long start = op_begin(fs, STATS_FSCK);
+    int result = do_fsck(fs, nthreads, repair, report, log);
+    op_end(fs, STATS_FSCK, start, 0);
+
+    return result;
+}
@@ -0,0 +1,379 @@
+
+#include "fs.h"
+#include "fs_internal.h"
+#include "crc32c.h"
+#include "pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Each checksum block holds one CRC32C per block for as many blocks as it has
+// room for; entry n of the table covers block n. The superblock and the
+// checksum blocks themselves aren't covered.
+static long table_entries(struct fs_ctx *fs)
+{
+    return (long)fs->checksum_blocks * fs->pointers_per_block;
+}
+
+static int covered(struct fs_ctx *fs, int blocknum)
+{
+    return blocknum > 0 && blocknum < table_entries(fs) &&
+           (blocknum < fs->checksum_start || blocknum >= first_data_block(fs));
+}
+
+void fs_set_checksums(struct fs_ctx *fs, int enable)
+{
+    fs->checksum_format = enable;
+}
+
+int checksum_blocks_for(struct fs_ctx *fs, int nblocks)
+{
+    return (nblocks + fs->pointers_per_block - 1) / fs->pointers_per_block;
+}
+
+// The checksum blocks the superblock records, or none when it predates them
+// or they don't add up
+int checksum_blocks_of(struct fs_ctx *fs, union fs_block *super)
+{
+    if (super->super.ext_magic == FS_EXT_MAGIC && super->super.checksum_blocks > 0 &&
+        super->super.checksum_blocks == checksum_blocks_for(fs, super->super.nblocks) &&
+        super->super.ninodeblocks + 1 + super->super.checksum_blocks < disk_size(fs->disk))
+    {
+        return super->super.checksum_blocks;
+    }
+
+    return 0;
+}
+
+void set_checksum_region(struct fs_ctx *fs, union fs_block *super)
+{
+    fs->checksum_start = super->super.ninodeblocks + 1;
+    fs->checksum_blocks = checksum_blocks_of(fs, super);
+}
+
+static int alloc_checksums(struct fs_ctx *fs)
+{
+    fs->checksums = aligned_alloc(DISK_ALIGN, (long)fs->checksum_blocks << fs->block_shift);
+    fs->checksum_dirty = calloc(fs->checksum_blocks, 1);
+
+    if (!fs->checksums || !fs->checksum_dirty)
+    {
+        free(fs->checksums);
+        free(fs->checksum_dirty);
+        fs->checksums = 0;
+        fs->checksum_dirty = 0;
+        return 0;
+    }
+
+    return 1;
+}
+
+// A fresh table for a format; every entry is filled as the format writes
+// its blocks, and all of it goes out at the end
+int start_checksums(struct fs_ctx *fs)
+{
+    if (!fs->checksum_blocks)
+    {
+        return 1;
+    }
+
+    if (!alloc_checksums(fs))
+    {
+        return 0;
+    }
+
+    memset(fs->checksums, 0, (long)fs->checksum_blocks << fs->block_shift);
+    memset(fs->checksum_dirty, 1, fs->checksum_blocks);
+    fs->checksum_unclean = 1;
+
+    return 1;
+}
+
+// Read the table for a writable mount, once the free map is built. After a
+// crash the table may be behind the blocks it covers, so it is taken from
+// them as they are now.
+int load_checksums(struct fs_ctx *fs, union fs_block *super)
+{
+    union fs_block block;
+
+    if (!fs->checksum_blocks)
+    {
+        return 1;
+    }
+
+    if (!alloc_checksums(fs))
+    {
+        return 0;
+    }
+
+    for (int i = 0; i < fs->checksum_blocks; i++)
+    {
+        read_block(fs, STATS_CHECKSUM, fs->checksum_start + i, (char *)fs->checksums + ((long)i << fs->block_shift));
+    }
+
+    fs->checksum_unclean = !super->super.checksum_clean;
+
+    if (fs->checksum_unclean)
+    {
+        for (int i = 0; i < fs->nblocks; i++)
+        {
+            if (covered(fs, i) && fs->bitmap[i])
+            {
+                read_block(fs, STATS_DATA, i, block.data);
+                fs->checksums[i] = crc32c(0, block.data, fs->block_size);
+            }
+        }
+
+        memset(fs->checksum_dirty, 1, fs->checksum_blocks);
+    }
+
+    return 1;
+}
+
+// Write out the checksum blocks that changed, then mark the table complete
+void close_checksums(struct fs_ctx *fs)
+{
+    union fs_block block;
+
+    if (fs->checksums && fs->checksum_unclean)
+    {
+        for (int i = 0; i < fs->checksum_blocks; i++)
+        {
+            if (fs->checksum_dirty[i])
+            {
+                write_block(fs, STATS_CHECKSUM, fs->checksum_start + i,
+                            (char *)fs->checksums + ((long)i << fs->block_shift));
+                fs->checksum_dirty[i] = 0;
+            }
+        }
+
+        read_block(fs, STATS_SUPERBLOCK, 0, block.data);
+        block.super.checksum_clean = 1;
+        write_block(fs, STATS_SUPERBLOCK, 0, block.data);
+        fs->checksum_unclean = 0;
+    }
+
+    free(fs->checksums);
+    free(fs->checksum_dirty);
+    fs->checksums = 0;
+    fs->checksum_dirty = 0;
+}
+
+// The first change after the table was written out clears the clean mark, so
+// that a crash before the next close has the table rebuilt rather than trusted.
+// fsck repairs write from several threads; only one of them gets to mark it.
+static void mark_unclean(struct fs_ctx *fs)
+{
+    union fs_block block;
+    int clean = 0;
+
+    if (__atomic_compare_exchange_n(&fs->checksum_unclean, &clean, 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        disk_read(fs->disk, 0, block.data);
+        block.super.checksum_clean = 0;
+        disk_write(fs->disk, 0, block.data);
+    }
+}
+
+void record_checksum(struct fs_ctx *fs, int blocknum, const char *data)
+{
+    if (!covered(fs, blocknum))
+    {
+        return;
+    }
+
+    if (!__atomic_load_n(&fs->checksum_unclean, __ATOMIC_RELAXED))
+    {
+        mark_unclean(fs);
+    }
+
+    fs->checksums[blocknum] = crc32c(0, data, fs->block_size);
+    __atomic_store_n(&fs->checksum_dirty[blocknum / fs->pointers_per_block], 1, __ATOMIC_RELAXED);
+}
+
+// Returns 1 if the block matches its checksum or has none
+int verify_checksum(struct fs_ctx *fs, int blocknum, const char *data)
+{
+    return !fs->checksums || !covered(fs, blocknum) || crc32c(0, data, fs->block_size) == fs->checksums[blocknum];
+}
+
+// The rate is kept to across all the workers, whose ranges may hold very
+// different numbers of blocks in use
+struct scrub_state
+{
+    struct fs_ctx *fs;
+    double rate;
+    double start;
+    long bytes;
+};
+
+// Scrub workers each check a contiguous range of blocks and list the bad ones
+// to be logged in block order
+struct scrub_worker
+{
+    struct scrub_state *state;
+    int first;
+    int last;
+
+    union fs_block *block;
+
+    long blocks;
+    long bytes;
+    int *bad;
+    int nbad;
+    int capacity;
+    int reads[STATS_NUM_BLOCK_TYPES];
+};
+
+static void add_bad(struct scrub_worker *worker, int blocknum)
+{
+    if (worker->nbad == worker->capacity)
+    {
+        worker->capacity = worker->capacity ? worker->capacity * 2 : 64;
+        worker->bad = realloc(worker->bad, worker->capacity * sizeof(int));
+        if (!worker->bad)
+        {
+            worker->nbad = worker->capacity = 0;
+            return;
+        }
+    }
+
+    worker->bad[worker->nbad++] = blocknum;
+}
+
+static void *scrub_worker_run(void *arg)
+{
+    struct scrub_worker *worker = arg;
+    struct scrub_state *state = worker->state;
+    struct fs_ctx *fs = state->fs;
+
+    for (int i = worker->first; i < worker->last; i++)
+    {
+        if (!covered(fs, i) || !fs->bitmap[i])
+        {
+            continue;
+        }
+
+        disk_read(fs->disk, i, worker->block->data);
+
+        // Inode blocks from before the last format were never checksummed
+        if (i <= fs->num_inode_blocks)
+        {
+            worker->reads[STATS_INODE]++;
+            if (!inode_block_current(worker->block, fs->epoch))
+            {
+                continue;
+            }
+        }
+        else
+        {
+            worker->reads[STATS_DATA]++;
+        }
+
+        worker->blocks++;
+        worker->bytes += fs->block_size;
+
+        if (crc32c(0, worker->block->data, fs->block_size) != fs->checksums[i])
+        {
+            add_bad(worker, i);
+        }
+
+        if (state->rate <= 0)
+        {
+            continue;
+        }
+
+        // Sleep off any lead over the rate
+        long bytes = __atomic_add_fetch(&state->bytes, fs->block_size, __ATOMIC_RELAXED);
+        double ahead = bytes / state->rate - (stats_seconds() - state->start);
+        if (ahead > 0.001)
+        {
+            struct timespec pause = {(time_t)ahead, (long)((ahead - (time_t)ahead) * 1e9)};
+            nanosleep(&pause, 0);
+        }
+    }
+
+    return 0;
+}
+
+static int do_scrub(struct fs_ctx *fs, int nthreads, long rate, struct fs_scrub_report *report, FILE *log)
+{
+    struct scrub_state state = {fs, rate, stats_seconds(), 0};
+    struct scrub_worker *workers;
+    int result = 1;
+
+    memset(report, 0, sizeof(struct fs_scrub_report));
+
+    if (!fs->mounted || !fs->checksums)
+    {
+        if (log && fs->mounted)
+            fprintf(log, fs->shared ? "a shared mount can't be scrubbed\n" : "the disk has no checksums\n");
+        return 0;
+    }
+
+    nthreads = pool_threads(nthreads, FS_SCRUB_MAX_THREADS);
+    workers = calloc(nthreads, sizeof(struct scrub_worker));
+    if (!workers)
+    {
+        return 0;
+    }
+
+    // Blocks reserved for writers were never written
+    unreserve_blocks(fs);
+
+    for (int i = 0; i < nthreads; i++)
+    {
+        workers[i].state = &state;
+        workers[i].first = (long)fs->nblocks * i / nthreads;
+        workers[i].last = (long)fs->nblocks * (i + 1) / nthreads;
+        workers[i].block = aligned_alloc(DISK_ALIGN, sizeof(union fs_block));
+
+        if (!workers[i].block)
+        {
+            result = 0;
+        }
+    }
+
+    if (result)
+    {
+        pool_run(scrub_worker_run, workers, nthreads, sizeof(struct scrub_worker));
+    }
+
+    for (int i = 0; i < nthreads; i++)
+    {
+        report->blocks += workers[i].blocks;
+        report->bytes += workers[i].bytes;
+        report->bad += workers[i].nbad;
+
+        for (int j = 0; log && j < workers[i].nbad; j++)
+        {
+            fprintf(log, "block %d doesn't match its checksum\n", workers[i].bad[j]);
+        }
+
+        for (int j = 0; j < STATS_NUM_BLOCK_TYPES; j++)
+        {
+            fs->stats.block_reads[j] += workers[i].reads[j];
+        }
+
+        free(workers[i].block);
+        free(workers[i].bad);
+    }
+
+    free(workers);
+
+    report->threads = nthreads;
+    report->seconds = stats_seconds() - state.start;
+
+    return result && !report->bad;
+}
+
+int fs_scrub(struct fs_ctx *fs, int nthreads, long rate, struct fs_scrub_report *report, FILE *log)
+{
+    long start = op_begin(fs, STATS_SCRUB);
+    int result = do_scrub(fs, nthreads, rate, report, log);
+    op_end(fs, STATS_SCRUB, start, 0);
+
+    return result;
+}
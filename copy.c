@@ -0,0 +1,275 @@
+
+#include "fs.h"
+#include "disk.h"
+#include "stats.h"
+#include "pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+// Bytes moved per call into the filesystem; big enough that a worker spends
+// most of its time on the host side, outside the lock
+#define COPY_CHUNK (1 << 20)
+
+// Workers take the next item until none are left. The lock is held around
+// each call into the filesystem, never around host I/O, so one worker's
+// writes into the image overlap with the others' reads of their host files.
+struct copy_job
+{
+    struct fs_ctx *fs;
+    struct fs_copy_item *items;
+    int count;
+    int next;
+    int in;
+    pthread_mutex_t lock;
+};
+
+// A worker without a buffer leaves the items to the others
+struct copy_worker
+{
+    struct copy_job *job;
+    char *buffer;
+};
+
+// Open an inode for a copy, or return 0 for a directory, which fs_open refuses
+static struct fs_file *open_inode(struct copy_job *job, int inumber)
+{
+    struct fs_file *handle;
+
+    pthread_mutex_lock(&job->lock);
+    handle = fs_open(job->fs, inumber);
+    pthread_mutex_unlock(&job->lock);
+
+    return handle;
+}
+
+static void close_inode(struct copy_job *job, struct fs_file *handle)
+{
+    pthread_mutex_lock(&job->lock);
+    fs_close(handle);
+    pthread_mutex_unlock(&job->lock);
+}
+
+// Replace whatever the inode held with the host file
+static int copy_in(struct copy_job *job, struct fs_copy_item *item, char *buffer)
+{
+    FILE *file = fopen(item->path, "r");
+    struct fs_file *handle;
+    int result = 1;
+
+    if (!file)
+    {
+        return 0;
+    }
+
+    handle = open_inode(job, item->inumber);
+    if (!handle)
+    {
+        fclose(file);
+        return 0;
+    }
+
+    pthread_mutex_lock(&job->lock);
+    fs_truncate_h(handle, 0);
+    pthread_mutex_unlock(&job->lock);
+
+    while (result)
+    {
+        int length = fread(buffer, 1, COPY_CHUNK, file);
+        if (length <= 0)
+        {
+            result = !ferror(file);
+            break;
+        }
+
+        pthread_mutex_lock(&job->lock);
+        int actual = fs_write_h(handle, buffer, length);
+        pthread_mutex_unlock(&job->lock);
+
+        // A short write means the filesystem is full
+        if (actual > 0)
+        {
+            item->bytes += actual;
+        }
+        result = actual == length;
+    }
+
+    close_inode(job, handle);
+    fclose(file);
+    return result;
+}
+
+static int copy_out(struct copy_job *job, struct fs_copy_item *item, char *buffer)
+{
+    struct fs_file *handle = open_inode(job, item->inumber);
+    FILE *file;
+    int result = 1;
+
+    if (!handle)
+    {
+        return 0;
+    }
+
+    file = fopen(item->path, "w");
+    if (!file)
+    {
+        close_inode(job, handle);
+        return 0;
+    }
+
+    while (result)
+    {
+        pthread_mutex_lock(&job->lock);
+        errno = 0;
+        int length = fs_read_h(handle, buffer, COPY_CHUNK);
+        int error = errno;
+        pthread_mutex_unlock(&job->lock);
+
+        // A block that doesn't match its checksum reads as an early end with EIO
+        if (length <= 0)
+        {
+            result = length == 0 && error != EIO;
+            break;
+        }
+
+        result = fwrite(buffer, 1, length, file) == length;
+        if (result)
+        {
+            item->bytes += length;
+        }
+    }
+
+    close_inode(job, handle);
+    result = fclose(file) == 0 && result;
+    return result;
+}
+
+static int compare_inumbers(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+// Whether any inode is named by more than one item. Each item gets a handle of
+// its own, and two handles on one inode would each write back their own view
+// of it. Also returns 1 if there's no memory to find out.
+static int duplicated(struct fs_copy_item *items, int count)
+{
+    int *inumbers = malloc(count * sizeof(int));
+    int result = !inumbers;
+
+    for (int i = 0; inumbers && i < count; i++)
+    {
+        inumbers[i] = items[i].inumber;
+    }
+
+    if (inumbers)
+    {
+        qsort(inumbers, count, sizeof(int), compare_inumbers);
+    }
+
+    for (int i = 1; inumbers && i < count && !result; i++)
+    {
+        result = inumbers[i] == inumbers[i - 1];
+    }
+
+    free(inumbers);
+    return result;
+}
+
+static void *copy_worker_run(void *arg)
+{
+    struct copy_worker *worker = arg;
+    struct copy_job *job = worker->job;
+    int i;
+
+    while (worker->buffer && (i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count)
+    {
+        struct fs_copy_item *item = &job->items[i];
+
+        item->result = job->in ? copy_in(job, item, worker->buffer) : copy_out(job, item, worker->buffer);
+    }
+
+    return 0;
+}
+
+static int copy_many(struct fs_ctx *fs, struct fs_copy_item *items, int count, int nthreads, int in,
+                     struct fs_copy_report *report)
+{
+    struct copy_job job;
+    struct copy_worker *workers;
+    double start = stats_seconds();
+
+    memset(report, 0, sizeof(struct fs_copy_report));
+
+    // Items no worker gets to count as failed
+    for (int i = 0; i < count; i++)
+    {
+        items[i].bytes = 0;
+        items[i].result = 0;
+    }
+
+    // A list naming an inode twice is refused before anything is copied
+    if (count > 0 && duplicated(items, count))
+    {
+        report->files = report->failed = count;
+        return 0;
+    }
+
+    nthreads = pool_threads(nthreads, count < FS_COPY_MAX_THREADS ? count : FS_COPY_MAX_THREADS);
+
+    workers = calloc(nthreads, sizeof(struct copy_worker));
+    if (!workers)
+    {
+        return 0;
+    }
+
+    job.fs = fs;
+    job.items = items;
+    job.count = count;
+    job.next = 0;
+    job.in = in;
+    pthread_mutex_init(&job.lock, 0);
+
+    for (int i = 0; i < nthreads; i++)
+    {
+        workers[i].job = &job;
+        workers[i].buffer = aligned_alloc(DISK_ALIGN, COPY_CHUNK);
+    }
+
+    pool_run(copy_worker_run, workers, nthreads, sizeof(struct copy_worker));
+
+    for (int i = 0; i < nthreads; i++)
+    {
+        free(workers[i].buffer);
+    }
+
+    pthread_mutex_destroy(&job.lock);
+    free(workers);
+
+    report->threads = nthreads;
+    report->seconds = stats_seconds() - start;
+
+    for (int i = 0; i < count; i++)
+    {
+        report->files++;
+        report->failed += !items[i].result;
+        report->bytes += items[i].bytes;
+    }
+
+    return !report->failed;
+}
+
+int fs_copyin_many(struct fs_ctx *fs, struct fs_copy_item *items, int count, int nthreads,
+                   struct fs_copy_report *report)
+{
+    return copy_many(fs, items, count, nthreads, 1, report);
+}
+
+int fs_copyout_many(struct fs_ctx *fs, struct fs_copy_item *items, int count, int nthreads,
+                    struct fs_copy_report *report)
+{
+    return copy_many(fs, items, count, nthreads, 0, report);
+}
@@ -0,0 +1,254 @@
+
+#include "crc32c.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_HARDWARE "sse4.2"
+#define HARDWARE_TARGET __attribute__((target("sse4.2")))
+#define crc32c_word(crc, word) ((uint32_t)_mm_crc32_u64(crc, word))
+#define crc32c_byte(crc, byte) _mm_crc32_u8(crc, byte)
+#elif defined(__aarch64__) && defined(__linux__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CRC32C_HARDWARE "armv8 crc"
+#define HARDWARE_TARGET __attribute__((target("+crc")))
+#define crc32c_word(crc, word) __crc32cd(crc, word)
+#define crc32c_byte(crc, byte) __crc32cb(crc, byte)
+#endif
+
+// The Castagnoli polynomial, bit reversed
+#define POLY 0x82f63b78
+
+// The hardware kernel runs three streams of these lengths side by side, then
+// folds them together by shifting each partial CRC past the streams after it
+#define LONG_STREAM 8192
+#define SHORT_STREAM 256
+
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+static uint32_t (*kernel)(uint32_t crc, const unsigned char *data, long length);
+
+// Slicing by eight: table[k][n] is the CRC of byte n followed by k zero bytes
+static uint32_t table[8][256];
+
+// Shifting a CRC past LONG_STREAM or SHORT_STREAM zero bytes, a byte at a time
+static uint32_t long_shift[4][256];
+static uint32_t short_shift[4][256];
+
+// Multiply two polynomials modulo POLY, with bit 31 as the constant term
+static uint32_t multiply(uint32_t a, uint32_t b)
+{
+    uint32_t product = 0;
+
+    for (uint32_t m = 1u << 31; m; m >>= 1)
+    {
+        if (a & m)
+        {
+            product ^= b;
+        }
+        b = b & 1 ? (b >> 1) ^ POLY : b >> 1;
+    }
+
+    return product;
+}
+
+// x^(8 * length) modulo POLY, which moves a CRC past length zero bytes
+static uint32_t zeroes_operator(long length)
+{
+    uint32_t power = 1u << 30, result = 1u << 31;
+
+    // power runs through x^(8 * 2^k)
+    for (int i = 0; i < 3; i++)
+    {
+        power = multiply(power, power);
+    }
+
+    for (; length; length >>= 1)
+    {
+        if (length & 1)
+        {
+            result = multiply(power, result);
+        }
+        power = multiply(power, power);
+    }
+
+    return result;
+}
+
+static void make_shift_table(uint32_t shift[4][256], long length)
+{
+    uint32_t op = zeroes_operator(length);
+
+    for (int k = 0; k < 4; k++)
+    {
+        for (uint32_t n = 0; n < 256; n++)
+        {
+            shift[k][n] = multiply(op, n << (8 * k));
+        }
+    }
+}
+
+static uint32_t shift_crc(uint32_t shift[4][256], uint32_t crc)
+{
+    return shift[0][crc & 0xff] ^ shift[1][(crc >> 8) & 0xff] ^ shift[2][(crc >> 16) & 0xff] ^ shift[3][crc >> 24];
+}
+
+static uint32_t portable_kernel(uint32_t crc, const unsigned char *data, long length)
+{
+    // Single bytes up to an eight byte boundary, then eight bytes at a time
+    while (length && ((uintptr_t)data & 7))
+    {
+        crc = table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+        length--;
+    }
+
+    for (; length >= 8; data += 8, length -= 8)
+    {
+        uint64_t word;
+
+        memcpy(&word, data, 8);
+        word ^= crc;
+        crc = table[7][word & 0xff] ^ table[6][(word >> 8) & 0xff] ^ table[5][(word >> 16) & 0xff] ^
+              table[4][(word >> 24) & 0xff] ^ table[3][(word >> 32) & 0xff] ^ table[2][(word >> 40) & 0xff] ^
+              table[1][(word >> 48) & 0xff] ^ table[0][word >> 56];
+    }
+
+    while (length--)
+    {
+        crc = table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+#ifdef CRC32C_HARDWARE
+static inline uint64_t load_word(const unsigned char *data)
+{
+    uint64_t word;
+
+    memcpy(&word, data, 8);
+    return word;
+}
+
+// Three runs of stream bytes each, as long as there are enough left
+HARDWARE_TARGET static uint32_t hardware_streams(uint32_t crc, const unsigned char **data, long *length, long stream,
+                                                 uint32_t shift[4][256])
+{
+    while (*length >= 3 * stream)
+    {
+        const unsigned char *p = *data;
+        uint32_t crc1 = 0, crc2 = 0;
+
+        for (const unsigned char *end = p + stream; p < end; p += 8)
+        {
+            crc = crc32c_word(crc, load_word(p));
+            crc1 = crc32c_word(crc1, load_word(p + stream));
+            crc2 = crc32c_word(crc2, load_word(p + 2 * stream));
+        }
+
+        crc = shift_crc(shift, crc) ^ crc1;
+        crc = shift_crc(shift, crc) ^ crc2;
+
+        *data += 3 * stream;
+        *length -= 3 * stream;
+    }
+
+    return crc;
+}
+
+HARDWARE_TARGET static uint32_t hardware_kernel(uint32_t crc, const unsigned char *data, long length)
+{
+    while (length && ((uintptr_t)data & 7))
+    {
+        crc = crc32c_byte(crc, *data++);
+        length--;
+    }
+
+    crc = hardware_streams(crc, &data, &length, LONG_STREAM, long_shift);
+    crc = hardware_streams(crc, &data, &length, SHORT_STREAM, short_shift);
+
+    for (; length >= 8; data += 8, length -= 8)
+    {
+        crc = crc32c_word(crc, load_word(data));
+    }
+
+    while (length--)
+    {
+        crc = crc32c_byte(crc, *data++);
+    }
+
+    return crc;
+}
+
+static int hardware_supported()
+{
+#if defined(__x86_64__)
+    return __builtin_cpu_supports("sse4.2");
+#else
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#endif
+}
+#endif
+
+static void make_tables()
+{
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        uint32_t crc = n;
+
+        for (int k = 0; k < 8; k++)
+        {
+            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+        }
+        table[0][n] = crc;
+    }
+
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        for (int k = 1; k < 8; k++)
+        {
+            table[k][n] = table[0][table[k - 1][n] & 0xff] ^ (table[k - 1][n] >> 8);
+        }
+    }
+
+    kernel = portable_kernel;
+
+#ifdef CRC32C_HARDWARE
+    if (hardware_supported())
+    {
+        make_shift_table(long_shift, LONG_STREAM);
+        make_shift_table(short_shift, SHORT_STREAM);
+        kernel = hardware_kernel;
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, long length)
+{
+    pthread_once(&tables_once, make_tables);
+    return ~kernel(~crc, data, length);
+}
+
+uint32_t crc32c_portable(uint32_t crc, const void *data, long length)
+{
+    pthread_once(&tables_once, make_tables);
+    return ~portable_kernel(~crc, data, length);
+}
+
+const char *crc32c_kernel()
+{
+    pthread_once(&tables_once, make_tables);
+
+#ifdef CRC32C_HARDWARE
+    if (kernel == hardware_kernel)
+    {
+        return CRC32C_HARDWARE;
+    }
+#endif
+
+    return "portable";
+}
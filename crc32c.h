@@ -0,0 +1,17 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+
+// CRC32C (Castagnoli) of length bytes, carrying on from crc; start from 0.
+// Runs on the CPU's CRC instruction where there is one, over three streams
+// at once so the instruction's latency is hidden, and from tables otherwise.
+uint32_t crc32c(uint32_t crc, const void *data, long length);
+
+// The table driven version, which every CPU can run
+uint32_t crc32c_portable(uint32_t crc, const void *data, long length);
+
+// Which of the two crc32c runs on this CPU
+const char *crc32c_kernel();
+
+#endif
@@ -0,0 +1,168 @@
+
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static void usage(const char *name)
+{
+    printf("use: %s checkpoint <diskfile>\n", name);
+    printf("     %s export <diskfile> <since> <deltafile>\n", name);
+    printf("     %s apply <deltafile | -> <diskfile>\n", name);
+}
+
+// Open an existing image at its own size
+static struct disk *open_image(const char *filename)
+{
+    struct stat info;
+
+    if (stat(filename, &info) < 0)
+    {
+        printf("couldn't open %s: %s\n", filename, strerror(errno));
+        return 0;
+    }
+
+    struct disk *disk = disk_init(filename, info.st_size / DISK_BLOCK_SIZE);
+    if (!disk)
+    {
+        printf("couldn't initialize %s: %s\n", filename, strerror(errno));
+    }
+
+    return disk;
+}
+
+// Start tracking an image, or close its current generation if it is tracked
+static int do_checkpoint(const char *filename)
+{
+    struct disk *disk = open_image(filename);
+    int checkpoint;
+
+    if (!disk)
+    {
+        return 1;
+    }
+
+    if (!disk_open_changes(disk, filename, 1) || !(checkpoint = disk_checkpoint(disk)))
+    {
+        printf("couldn't checkpoint %s: %s\n", filename, strerror(errno));
+        disk_close(disk);
+        return 1;
+    }
+
+    printf("%s: checkpoint %d\n", filename, checkpoint);
+    disk_close(disk);
+    return 0;
+}
+
+static int do_export(const char *filename, int since, const char *deltafile)
+{
+    struct disk *disk = open_image(filename);
+    FILE *file;
+    long nblocks;
+
+    if (!disk)
+    {
+        return 1;
+    }
+
+    if (!disk_generation(disk))
+    {
+        printf("%s has no change map; run checkpoint on it first\n", filename);
+        disk_close(disk);
+        return 1;
+    }
+
+    file = fopen(deltafile, "w");
+    if (!file)
+    {
+        printf("couldn't open %s: %s\n", deltafile, strerror(errno));
+        disk_close(disk);
+        return 1;
+    }
+
+    int checkpoint = disk_delta_export(disk, since, file, &nblocks);
+
+    if (fclose(file) != 0)
+    {
+        checkpoint = 0;
+    }
+
+    if (!checkpoint)
+    {
+        printf("couldn't export changes since checkpoint %d: %s\n", since, strerror(errno));
+        disk_close(disk);
+        return 1;
+    }
+
+    printf("%s: %ld of %d blocks changed from checkpoint %d to %d\n", filename, nblocks, disk_size(disk),
+           since, checkpoint);
+    disk_close(disk);
+    return 0;
+}
+
+static int do_apply(const char *deltafile, const char *filename)
+{
+    struct disk_delta_header header;
+    FILE *file;
+    long nblocks;
+
+    file = strcmp(deltafile, "-") ? fopen(deltafile, "r") : stdin;
+    if (!file)
+    {
+        printf("couldn't open %s: %s\n", deltafile, strerror(errno));
+        return 1;
+    }
+
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != DISK_DELTA_MAGIC)
+    {
+        printf("%s is not a delta\n", deltafile);
+        fclose(file);
+        return 1;
+    }
+
+    // The image takes the size of the one the delta came from
+    struct disk *disk = disk_init(filename, header.nblocks * (header.block_size / DISK_BLOCK_SIZE));
+    if (!disk)
+    {
+        printf("couldn't initialize %s: %s\n", filename, strerror(errno));
+        fclose(file);
+        return 1;
+    }
+
+    int checkpoint = disk_delta_apply(disk, &header, file, &nblocks);
+    fclose(file);
+
+    if (!checkpoint)
+    {
+        printf("couldn't apply %s after %ld blocks: %s\n", deltafile, nblocks, strerror(errno));
+        disk_close(disk);
+        return 1;
+    }
+
+    printf("%s: %ld blocks applied, now at checkpoint %d (from %d)\n", filename, nblocks, checkpoint,
+           header.since);
+    disk_close(disk);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 3 && !strcmp(argv[1], "checkpoint"))
+    {
+        return do_checkpoint(argv[2]);
+    }
+    else if (argc == 5 && !strcmp(argv[1], "export"))
+    {
+        return do_export(argv[2], atoi(argv[3]), argv[4]);
+    }
+    else if (argc == 4 && !strcmp(argv[1], "apply"))
+    {
+        return do_apply(argv[2], argv[3]);
+    }
+
+    usage(argv[0]);
+    return 1;
+}
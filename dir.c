@@ -0,0 +1,901 @@
+
+#include "fs.h"
+#include "fs_internal.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+// An open directory: its file handle and the blocks its calls work in, kept
+// off the stack as a block can be 64 KB. header is a copy of the header block,
+// leaf the last leaf dir_find read and block holds table blocks and new leaves.
+struct dir
+{
+    struct fs_file *file;
+    union fs_block *header;
+    union fs_block *leaf;
+    union fs_block *block;
+};
+
+// Logical block of the first leaf, after a table that can hold every slot
+static int dir_leaf_start(struct fs_ctx *fs)
+{
+    return DIR_TABLE_START + ((1 << DIR_MAX_DEPTH) + fs->pointers_per_block - 1) / fs->pointers_per_block;
+}
+
+// FNV-1a; the low bits pick a slot in the directory's table
+static unsigned int dir_hash(const char *name, int len)
+{
+    unsigned int hash = 2166136261u;
+
+    for (int i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static int valid_name(const char *name, int len)
+{
+    if (len <= 0 || len > FS_NAME_MAX || memchr(name, '/', len))
+    {
+        return 0;
+    }
+
+    // "." and ".." are never stored, they are answered from the header
+    if ((len == 1 && name[0] == '.') || (len == 2 && name[0] == '.' && name[1] == '.'))
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+// Logical blocks that were never written read back as zeroes
+static void dir_read(struct dir *dir, int index, union fs_block *block)
+{
+    struct fs_ctx *fs = dir->file->fs;
+    int blocknum = fs_file_block(dir->file, index, 0, 0);
+
+    if (blocknum)
+    {
+        read_block(fs, STATS_DIRECTORY, blocknum, block->data);
+    }
+    else
+    {
+        memset(block->data, 0, fs->block_size);
+    }
+}
+
+static int dir_write(struct dir *dir, int index, union fs_block *block)
+{
+    struct fs_file *file = dir->file;
+    struct fs_ctx *fs = file->fs;
+    int blocknum = fs_file_block(file, index, 1, 0);
+
+    // The disk is full
+    if (!blocknum)
+    {
+        return 0;
+    }
+
+    write_block(fs, STATS_DIRECTORY, blocknum, block->data);
+
+    if ((index + 1) * fs->block_size > file->inode.size)
+    {
+        file->inode.size = (index + 1) * fs->block_size;
+        file->inode_dirty = 1;
+    }
+
+    return 1;
+}
+
+static int dir_open(struct fs_ctx *fs, int inumber, struct dir *dir)
+{
+    if (!fs->mounted)
+    {
+        return 0;
+    }
+
+    dir->file = fs_open_inode(fs, inumber);
+    if (!dir->file)
+    {
+        return 0;
+    }
+
+    dir->header = 0;
+    if (dir->file->inode.isvalid == FS_INODE_DIR)
+    {
+        dir->header = aligned_alloc(DISK_ALIGN, 3 * sizeof(union fs_block));
+    }
+
+    if (!dir->header)
+    {
+        fs_close(dir->file);
+        return 0;
+    }
+
+    dir->leaf = dir->header + 1;
+    dir->block = dir->header + 2;
+
+    // An empty directory may have no blocks at all yet
+    dir_read(dir, 0, dir->header);
+
+    if (dir->file->inode.size && dir->header->dir.magic != DIR_MAGIC)
+    {
+        free(dir->header);
+        fs_close(dir->file);
+        return 0;
+    }
+
+    return 1;
+}
+
+static void dir_close(struct dir *dir)
+{
+    free(dir->header);
+    fs_close(dir->file);
+}
+
+// Lay out the header, a one slot table and the first leaf
+static int dir_init(struct dir *dir, int parent)
+{
+    struct fs_ctx *fs = dir->file->fs;
+    union fs_block *block = dir->block;
+
+    memset(block->data, 0, fs->block_size);
+    if (!dir_write(dir, dir_leaf_start(fs), block))
+    {
+        return 0;
+    }
+
+    block->pointers[0] = dir_leaf_start(fs);
+    if (!dir_write(dir, DIR_TABLE_START, block))
+    {
+        return 0;
+    }
+
+    memset(dir->header->data, 0, fs->block_size);
+    dir->header->dir.magic = DIR_MAGIC;
+    dir->header->dir.nleaves = 1;
+    dir->header->dir.parent = parent;
+
+    return dir_write(dir, 0, dir->header);
+}
+
+static int dir_parent(struct dir *dir)
+{
+    if (dir->header->dir.magic != DIR_MAGIC)
+    {
+        return dir->file->inumber;
+    }
+
+    return dir->header->dir.parent;
+}
+
+// Leaf holding the slot a hash maps to, at the head of its overflow chain
+static int dir_slot(struct dir *dir, unsigned int hash)
+{
+    struct fs_ctx *fs = dir->file->fs;
+    int slot = hash & ((1 << dir->header->dir.depth) - 1);
+
+    dir_read(dir, DIR_TABLE_START + slot / fs->pointers_per_block, dir->block);
+
+    return dir->block->pointers[slot % fs->pointers_per_block];
+}
+
+static void dir_load_table(struct dir *dir, int *table)
+{
+    struct fs_ctx *fs = dir->file->fs;
+    int nslots = 1 << dir->header->dir.depth;
+
+    for (int i = 0; i < nslots; i += fs->pointers_per_block)
+    {
+        int count = nslots - i < fs->pointers_per_block ? nslots - i : fs->pointers_per_block;
+
+        dir_read(dir, DIR_TABLE_START + i / fs->pointers_per_block, dir->block);
+        memcpy(&table[i], dir->block->pointers, count * sizeof(int));
+    }
+}
+
+static int dir_store_table(struct dir *dir, int *table)
+{
+    struct fs_ctx *fs = dir->file->fs;
+    int nslots = 1 << dir->header->dir.depth;
+
+    for (int i = 0; i < nslots; i += fs->pointers_per_block)
+    {
+        int count = nslots - i < fs->pointers_per_block ? nslots - i : fs->pointers_per_block;
+
+        memset(dir->block->data, 0, fs->block_size);
+        memcpy(dir->block->pointers, &table[i], count * sizeof(int));
+
+        if (!dir_write(dir, DIR_TABLE_START + i / fs->pointers_per_block, dir->block))
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Offset of a name within a leaf, or -1
+static int leaf_find(struct fs_dir_leaf *leaf, const char *name, int len)
+{
+    int offset = 0;
+
+    while (offset < leaf->used)
+    {
+        struct fs_dirent *entry = (struct fs_dirent *)(leaf->entries + offset);
+
+        if (entry->namelen == len && !memcmp(entry->name, name, len))
+        {
+            return offset;
+        }
+
+        offset += DIRENT_SIZE(entry->namelen);
+    }
+
+    return -1;
+}
+
+static void leaf_append(struct fs_dir_leaf *leaf, const char *name, int len, int inumber)
+{
+    struct fs_dirent *entry = (struct fs_dirent *)(leaf->entries + leaf->used);
+
+    entry->inumber = inumber;
+    entry->namelen = len;
+    memcpy(entry->name, name, len);
+
+    leaf->used += DIRENT_SIZE(len);
+    leaf->count++;
+}
+
+static void leaf_remove(struct fs_dir_leaf *leaf, int offset)
+{
+    struct fs_dirent *entry = (struct fs_dirent *)(leaf->entries + offset);
+    int size = DIRENT_SIZE(entry->namelen);
+
+    memmove(leaf->entries + offset, leaf->entries + offset + size, leaf->used - offset - size);
+    leaf->used -= size;
+    leaf->count--;
+}
+
+// Search the chain of leaves a name hashes to. On a hit the leaf is left in
+// *leaf, its logical block in *index and the entry's offset in *offset.
+static int dir_find(struct dir *dir, const char *name, int len, union fs_block *leaf, int *index, int *offset)
+{
+    if (dir->header->dir.magic != DIR_MAGIC)
+    {
+        return 0;
+    }
+
+    *index = dir_slot(dir, dir_hash(name, len));
+
+    while (*index)
+    {
+        dir_read(dir, *index, leaf);
+
+        *offset = leaf_find(&leaf->leaf, name, len);
+        if (*offset >= 0)
+        {
+            return ((struct fs_dirent *)(leaf->leaf.entries + *offset))->inumber;
+        }
+
+        *index = leaf->leaf.next;
+    }
+
+    return 0;
+}
+
+// Logical block for a new leaf, or 0 once the directory is as large as a file can be
+static int dir_new_leaf(struct dir *dir)
+{
+    struct fs_ctx *fs = dir->file->fs;
+    int index = dir_leaf_start(fs) + dir->header->dir.nleaves;
+
+    if (index >= POINTERS_PER_INODE + fs->pointers_per_block)
+    {
+        return 0;
+    }
+
+    dir->header->dir.nleaves++;
+    return index;
+}
+
+// Split a full leaf on the next hash bit, doubling the table first if the
+// leaf already uses every bit the table does. The new leaf is built in the
+// directory's spare block, which the table is done with by then.
+static int dir_split(struct dir *dir, int index, union fs_block *leaf)
+{
+    struct fs_ctx *fs = dir->file->fs;
+    struct fs_dir_header saved = dir->header->dir;
+    int *table = malloc(sizeof(int) << DIR_MAX_DEPTH);
+    union fs_block *lo = aligned_alloc(DISK_ALIGN, sizeof(union fs_block));
+    union fs_block *hi = dir->block;
+    int depth = leaf->leaf.depth;
+    int offset = 0;
+
+    if (!table || !lo)
+    {
+        free(table);
+        free(lo);
+        return 0;
+    }
+
+    dir_load_table(dir, table);
+
+    if (depth == dir->header->dir.depth)
+    {
+        int nslots = 1 << depth;
+
+        memcpy(&table[nslots], table, nslots * sizeof(int));
+        dir->header->dir.depth++;
+    }
+
+    int new_index = dir_new_leaf(dir);
+
+    memset(lo->data, 0, fs->block_size);
+    memset(hi->data, 0, fs->block_size);
+    lo->leaf.depth = depth + 1;
+    hi->leaf.depth = depth + 1;
+
+    while (new_index && offset < leaf->leaf.used)
+    {
+        struct fs_dirent *entry = (struct fs_dirent *)(leaf->leaf.entries + offset);
+        unsigned int hash = dir_hash(entry->name, entry->namelen);
+
+        leaf_append((hash >> depth) & 1 ? &hi->leaf : &lo->leaf, entry->name, entry->namelen, entry->inumber);
+        offset += DIRENT_SIZE(entry->namelen);
+    }
+
+    // Slots that led to the old leaf and have the new bit set now lead to the new one
+    for (int slot = 0; new_index && slot < 1 << dir->header->dir.depth; slot++)
+    {
+        if (table[slot] == index && (slot >> depth) & 1)
+        {
+            table[slot] = new_index;
+        }
+    }
+
+    // The new leaf and any table growth are the only writes that allocate blocks
+    int result = new_index && dir_write(dir, new_index, hi) && dir_store_table(dir, table);
+
+    if (result)
+    {
+        dir_write(dir, index, lo);
+        dir_write(dir, 0, dir->header);
+    }
+    else
+    {
+        dir->header->dir = saved;
+    }
+
+    free(table);
+    free(lo);
+    return result;
+}
+
+static int dir_add(struct dir *dir, const char *name, int len, int inumber)
+{
+    struct fs_ctx *fs = dir->file->fs;
+    unsigned int hash = dir_hash(name, len);
+    int size = DIRENT_SIZE(len);
+    int space = fs->block_size - DIR_LEAF_HEADER;
+    union fs_block *leaf = dir->leaf;
+    union fs_block *overflow = dir->block;
+
+    if (dir->header->dir.magic != DIR_MAGIC && !dir_init(dir, dir->file->inumber))
+    {
+        return 0;
+    }
+
+    while (1)
+    {
+        int index = dir_slot(dir, hash);
+
+        dir_read(dir, index, leaf);
+
+        // Overflow leaves only exist once the table can't grow any further
+        while (leaf->leaf.used + size > space && leaf->leaf.next)
+        {
+            index = leaf->leaf.next;
+            dir_read(dir, index, leaf);
+        }
+
+        if (leaf->leaf.used + size <= space)
+        {
+            leaf_append(&leaf->leaf, name, len, inumber);
+            dir_write(dir, index, leaf);
+            break;
+        }
+
+        if (leaf->leaf.depth < DIR_MAX_DEPTH)
+        {
+            if (!dir_split(dir, index, leaf))
+            {
+                return 0;
+            }
+            continue;
+        }
+
+        int new_index = dir_new_leaf(dir);
+
+        memset(overflow->data, 0, fs->block_size);
+        overflow->leaf.depth = DIR_MAX_DEPTH;
+        leaf_append(&overflow->leaf, name, len, inumber);
+
+        if (!new_index || !dir_write(dir, new_index, overflow))
+        {
+            dir->header->dir.nleaves -= new_index ? 1 : 0;
+            return 0;
+        }
+
+        leaf->leaf.next = new_index;
+        dir_write(dir, index, leaf);
+        break;
+    }
+
+    dir->header->dir.nentries++;
+    dir_write(dir, 0, dir->header);
+
+    return 1;
+}
+
+static int do_lookup(struct fs_ctx *fs, int inumber, const char *name, int len)
+{
+    struct dir dir;
+    int index, offset;
+
+    if (!dir_open(fs, inumber, &dir))
+    {
+        return 0;
+    }
+
+    int result;
+
+    if (len == 1 && name[0] == '.')
+    {
+        result = inumber;
+    }
+    else if (len == 2 && name[0] == '.' && name[1] == '.')
+    {
+        result = dir_parent(&dir);
+    }
+    else
+    {
+        result = dir_find(&dir, name, len, dir.leaf, &index, &offset);
+    }
+
+    dir_close(&dir);
+    return result;
+}
+
+static int do_link(struct fs_ctx *fs, int inumber, const char *name, int target)
+{
+    struct dir dir;
+    int index, offset;
+    int len = strlen(name);
+
+    if (!writable(fs) || !valid_name(name, len) || target <= 0 ||
+        target >= fs->num_inode_blocks * fs->inodes_per_block)
+    {
+        return 0;
+    }
+
+    if (!dir_open(fs, inumber, &dir))
+    {
+        return 0;
+    }
+
+    int result = 0;
+
+    // The count goes up first, so a name never leads to a free inode
+    if (!dir_find(&dir, name, len, dir.leaf, &index, &offset) && fs_adjust_links(fs, target, 1))
+    {
+        result = dir_add(&dir, name, len, target);
+        if (!result)
+        {
+            fs_adjust_links(fs, target, -1);
+        }
+    }
+
+    dir_close(&dir);
+    return result;
+}
+
+static int do_unlink(struct fs_ctx *fs, int inumber, const char *name)
+{
+    struct dir dir, child;
+    int index, offset;
+    int len = strlen(name);
+
+    if (!writable(fs) || !valid_name(name, len) || !dir_open(fs, inumber, &dir))
+    {
+        return 0;
+    }
+
+    int target = dir_find(&dir, name, len, dir.leaf, &index, &offset);
+    int isdir = target && fs_isdir(fs, target);
+
+    // Directories have to be emptied before they can be unlinked, and the
+    // root never can be
+    if (isdir && target == fs->rootdir)
+    {
+        target = 0;
+    }
+    else if (isdir)
+    {
+        if (!dir_open(fs, target, &child))
+        {
+            target = 0;
+        }
+        else
+        {
+            if (child.header->dir.magic == DIR_MAGIC && child.header->dir.nentries)
+            {
+                target = 0;
+            }
+            dir_close(&child);
+        }
+    }
+
+    if (target)
+    {
+        leaf_remove(&dir.leaf->leaf, offset);
+        dir_write(&dir, index, dir.leaf);
+
+        dir.header->dir.nentries--;
+        dir_write(&dir, 0, dir.header);
+    }
+
+    dir_close(&dir);
+
+    if (target && !isdir)
+    {
+        fs_adjust_links(fs, target, -1);
+    }
+
+    // A directory has no other name, so it goes with this one
+    if (target && isdir)
+    {
+        fs_free_inode(fs, target);
+    }
+
+    return target ? 1 : 0;
+}
+
+static int do_mkdir(struct fs_ctx *fs, int inumber, const char *name)
+{
+    struct dir dir;
+    int len = strlen(name);
+
+    if (!writable(fs) || !valid_name(name, len) || do_lookup(fs, inumber, name, len) || !fs_isdir(fs, inumber))
+    {
+        return 0;
+    }
+
+    int child = fs_alloc_inode(fs, FS_INODE_DIR);
+    if (!child)
+    {
+        return 0;
+    }
+
+    // The header is written straight away so ".." works while the directory is empty
+    if (!dir_open(fs, child, &dir))
+    {
+        fs_free_inode(fs, child);
+        return 0;
+    }
+
+    int result = dir_init(&dir, inumber);
+    dir_close(&dir);
+
+    if (!result || !do_link(fs, inumber, name, child))
+    {
+        fs_free_inode(fs, child);
+        return 0;
+    }
+
+    return child;
+}
+
+int fs_root(struct fs_ctx *fs)
+{
+    union fs_block block;
+
+    if (!fs->mounted)
+    {
+        return 0;
+    }
+
+    if (fs->rootdir)
+    {
+        return fs->rootdir;
+    }
+
+    // An image from before directories: give it a root and record it in the superblock
+    int root = fs_alloc_inode(fs, FS_INODE_DIR);
+    if (!root)
+    {
+        return 0;
+    }
+
+    read_block(fs, STATS_SUPERBLOCK, 0, block.data);
+    block.super.ext_magic = FS_EXT_MAGIC;
+    block.super.rootdir = root;
+    block.super.epoch = 0;
+    write_block(fs, STATS_SUPERBLOCK, 0, block.data);
+
+    fs->rootdir = root;
+    return root;
+}
+
+int fs_isdir(struct fs_ctx *fs, int inumber)
+{
+    union fs_block block;
+
+    if (!fs->mounted || inumber <= 0 || inumber >= fs->num_inode_blocks * fs->inodes_per_block)
+    {
+        return 0;
+    }
+
+    read_inode_block(fs, inode_block_of(fs, inumber), &block);
+
+    return block.inode[inode_slot(fs, inumber)].isvalid == FS_INODE_DIR;
+}
+
+int fs_mkdir(struct fs_ctx *fs, int dir, const char *name)
+{
+    long start = op_begin(fs, STATS_LINK);
+    int result = do_mkdir(fs, dir, name);
+    op_end(fs, STATS_LINK, start, 0);
+
+    return result;
+}
+
+int fs_lookup(struct fs_ctx *fs, int dir, const char *name)
+{
+    long start = op_begin(fs, STATS_LOOKUP);
+    int result = do_lookup(fs, dir, name, strlen(name));
+    op_end(fs, STATS_LOOKUP, start, 0);
+
+    return result;
+}
+
+int fs_link(struct fs_ctx *fs, int dir, const char *name, int inumber)
+{
+    long start = op_begin(fs, STATS_LINK);
+
+    // A directory's only name is the one fs_mkdir gave it
+    int result = !fs_isdir(fs, inumber) && do_link(fs, dir, name, inumber);
+    op_end(fs, STATS_LINK, start, 0);
+
+    return result;
+}
+
+int fs_unlink(struct fs_ctx *fs, int dir, const char *name)
+{
+    long start = op_begin(fs, STATS_LINK);
+    int result = do_unlink(fs, dir, name);
+    op_end(fs, STATS_LINK, start, 0);
+
+    return result;
+}
+
+// Call fn for every entry in leaf order until it returns non-zero.
+// Returns the number of entries visited, or -1 if dir isn't a directory.
+int fs_readdir(struct fs_ctx *fs, int inumber, fs_readdir_fn fn, void *arg)
+{
+    struct dir dir;
+    char name[FS_NAME_MAX + 1];
+    int count = 0;
+
+    if (!dir_open(fs, inumber, &dir))
+    {
+        return -1;
+    }
+
+    for (int i = 0; dir.header->dir.magic == DIR_MAGIC && i < dir.header->dir.nleaves; i++)
+    {
+        int offset = 0;
+
+        dir_read(&dir, dir_leaf_start(fs) + i, dir.leaf);
+
+        while (offset < dir.leaf->leaf.used)
+        {
+            struct fs_dirent *entry = (struct fs_dirent *)(dir.leaf->leaf.entries + offset);
+
+            memcpy(name, entry->name, entry->namelen);
+            name[entry->namelen] = 0;
+            count++;
+
+            if (fn(name, entry->inumber, arg))
+            {
+                dir_close(&dir);
+                return count;
+            }
+
+            offset += DIRENT_SIZE(entry->namelen);
+        }
+    }
+
+    dir_close(&dir);
+    return count;
+}
+
+// Walk path one component at a time. With last set, the final component is
+// not looked up but copied there, and the directory holding it is returned.
+static int do_resolve(struct fs_ctx *fs, const char *path, char *last)
+{
+    int inumber = fs_root(fs);
+
+    while (inumber)
+    {
+        while (*path == '/')
+        {
+            path++;
+        }
+
+        int len = strcspn(path, "/");
+        if (!len)
+        {
+            // A path with no components names the root, which has no parent entry
+            return last ? 0 : inumber;
+        }
+
+        if (len > FS_NAME_MAX)
+        {
+            return 0;
+        }
+
+        if (last && !path[len + strspn(path + len, "/")])
+        {
+            memcpy(last, path, len);
+            last[len] = 0;
+            return inumber;
+        }
+
+        inumber = do_lookup(fs, inumber, path, len);
+        path += len;
+    }
+
+    return 0;
+}
+
+int fs_resolve(struct fs_ctx *fs, const char *path)
+{
+    long start = op_begin(fs, STATS_LOOKUP);
+    int result = do_resolve(fs, path, 0);
+    op_end(fs, STATS_LOOKUP, start, 0);
+
+    return result;
+}
+
+int fs_resolve_parent(struct fs_ctx *fs, const char *path, char *name)
+{
+    long start = op_begin(fs, STATS_LOOKUP);
+    int result = do_resolve(fs, path, name);
+    op_end(fs, STATS_LOOKUP, start, 0);
+
+    return result;
+}
+
+// Copying the tree for a snapshot: copies maps each inumber already seen to
+// its copy, so hard links stay links, and -1 marks inodes to leave out
+struct snapshot
+{
+    struct fs_ctx *fs;
+    int *copies;
+    int ninodes;
+    int target;
+    int failed;
+};
+
+static int snapshot_tree(struct snapshot *snap, int source, int target);
+
+static int snapshot_entry(const char *name, int inumber, void *arg)
+{
+    struct snapshot *snap = arg;
+    struct fs_ctx *fs = snap->fs;
+    int copy;
+
+    if (inumber <= 0 || inumber >= snap->ninodes)
+    {
+        snap->failed = 1;
+        return 1;
+    }
+
+    copy = snap->copies[inumber];
+
+    // Skip what is left out, and a directory that is already in the copy
+    if (copy < 0 || (copy && fs_isdir(fs, inumber)))
+    {
+        return 0;
+    }
+
+    if (copy)
+    {
+        copy = do_link(fs, snap->target, name, copy);
+    }
+    else if (fs_isdir(fs, inumber))
+    {
+        copy = snap->copies[inumber] = do_mkdir(fs, snap->target, name);
+        copy = copy && snapshot_tree(snap, inumber, copy);
+    }
+    else
+    {
+        copy = snap->copies[inumber] = fs_clone(fs, inumber);
+        copy = copy && do_link(fs, snap->target, name, copy);
+    }
+
+    if (!copy)
+    {
+        snap->failed = 1;
+    }
+
+    return snap->failed;
+}
+
+static int snapshot_tree(struct snapshot *snap, int source, int target)
+{
+    int parent = snap->target;
+
+    snap->target = target;
+    fs_readdir(snap->fs, source, snapshot_entry, snap);
+    snap->target = parent;
+
+    return !snap->failed;
+}
+
+// Snapshots live in FS_SNAPSHOT_DIR under the root. Directories are recreated
+// and files are cloned, so no data block is copied.
+int fs_snapshot(struct fs_ctx *fs, const char *name)
+{
+    struct snapshot snap;
+    int root = fs_root(fs);
+    int len = strlen(name);
+
+    if (!root || !valid_name(name, len))
+    {
+        return 0;
+    }
+
+    int snapshots = do_lookup(fs, root, FS_SNAPSHOT_DIR, strlen(FS_SNAPSHOT_DIR));
+    if (!snapshots)
+    {
+        snapshots = do_mkdir(fs, root, FS_SNAPSHOT_DIR);
+    }
+    if (!snapshots || do_lookup(fs, snapshots, name, len))
+    {
+        return 0;
+    }
+
+    int target = do_mkdir(fs, snapshots, name);
+    if (!target)
+    {
+        return 0;
+    }
+
+    snap.fs = fs;
+    snap.ninodes = fs->num_inode_blocks * fs->inodes_per_block;
+    snap.copies = calloc(snap.ninodes, sizeof(int));
+    snap.target = target;
+    snap.failed = 0;
+
+    if (!snap.copies)
+    {
+        return 0;
+    }
+
+    // Earlier snapshots are not part of this one
+    snap.copies[snapshots] = -1;
+    snap.copies[root] = target;
+
+    int result = snapshot_tree(&snap, root, target);
+
+    free(snap.copies);
+    return result ? target : 0;
+}
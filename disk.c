@@ -1,42 +1,182 @@
 
+// For fallocate
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 
 #include "disk.h"
 
 #define DISK_MAGIC 0xdeadbeef
 
-static FILE *diskfile;
-static int nblocks = 0;
-static int nreads = 0;
-static int nwrites = 0;
+// Aligned buffers a direct disk keeps for callers whose own aren't aligned;
+// one bit per buffer in pool_free
+#define DISK_POOL_SIZE 16
+
+// One open disk. The block size, counters and trace live here; the backend
+// only moves bytes at block aligned offsets.
+struct disk
+{
+    const struct disk_ops *ops;
+    void *state;
+
+    int nblocks;
+    long nbytes;
+    int block_size;
+    int block_shift;
+    int nreads;
+    int nwrites;
+    int ndiscards;
+
+    FILE *tracefile;
+    int trace_block_size;
+    int trace_op;
+    struct timespec trace_start;
+
+    // The image's change map, when it has one; entries are per DISK_BLOCK_SIZE block
+    uint32_t *changes;
+    int change_blocks;
+    int change_fd;
+    uint32_t generation;
+};
+
+// The file backend. Blocks are accessed with pread/pwrite so a handle carries
+// no file position and separate handles never share state.
+struct file_disk
+{
+    int fd;
+    long nbytes;
+    int discard_unsupported;
+
+    int direct;
+    char *pool;
+    unsigned int pool_free;
+};
+
+static const struct disk_ops file_ops;
+
+static int write_changes(struct disk *disk, int clean);
 
-int disk_init(const char *filename, int n)
+struct disk *disk_init(const char *filename, int n)
 {
-    diskfile = fopen(filename, "r+");
-    if (!diskfile)
-        diskfile = fopen(filename, "w+");
-    if (!diskfile)
+    return disk_init_with(filename, n, 0);
+}
+
+// With DISK_DIRECT the image is opened with O_DIRECT, so blocks bypass the
+// host's page cache. Hosts that don't support it fail the open with EINVAL.
+struct disk *disk_init_with(const char *filename, int n, int flags)
+{
+    struct file_disk *file = calloc(1, sizeof(struct file_disk));
+    if (!file)
         return 0;
 
-    ftruncate(fileno(diskfile), n * DISK_BLOCK_SIZE);
+    if (flags & DISK_DIRECT)
+    {
+        if (posix_memalign((void **)&file->pool, DISK_ALIGN, DISK_POOL_SIZE * DISK_MAX_BLOCK_SIZE))
+        {
+            free(file);
+            return 0;
+        }
+
+        file->direct = 1;
+        file->pool_free = (1u << DISK_POOL_SIZE) - 1;
+    }
 
-    nblocks = n;
-    nreads = 0;
-    nwrites = 0;
+    file->fd = open(filename, O_RDWR | O_CREAT | (file->direct ? O_DIRECT : 0), 0666);
+    if (file->fd < 0)
+    {
+        free(file->pool);
+        free(file);
+        return 0;
+    }
 
-    return 1;
+    // Growing the file this way leaves a hole, so a new image takes no space
+    // on the host until its blocks are written. An image already the right
+    // size is left alone, keeping its modification time for shared mounts.
+    struct stat info;
+    if (fstat(file->fd, &info) < 0 || info.st_size != (off_t)n * DISK_BLOCK_SIZE)
+    {
+        ftruncate(file->fd, (off_t)n * DISK_BLOCK_SIZE);
+    }
+    file->nbytes = (long)n * DISK_BLOCK_SIZE;
+
+    struct disk *disk = disk_open_backend(&file_ops, file);
+    if (!disk)
+    {
+        file_ops.close(file);
+    }
+    else if (!disk_open_changes(disk, filename, 0))
+    {
+        disk_close(disk);
+        return 0;
+    }
+
+    return disk;
+}
+
+// Wrap a backend in a disk. The disk starts with the smallest block size and
+// owns the state from here on, closing it with the disk.
+struct disk *disk_open_backend(const struct disk_ops *ops, void *state)
+{
+    struct disk *disk = calloc(1, sizeof(struct disk));
+    if (!disk)
+        return 0;
+
+    disk->ops = ops;
+    disk->state = state;
+    disk->nbytes = ops->size(state);
+    disk_set_block_size(disk, DISK_BLOCK_SIZE);
+    disk->trace_op = DISK_TRACE_NO_OP;
+
+    return disk;
+}
+
+const char *disk_backend_name(struct disk *disk)
+{
+    return disk->ops->name;
+}
+
+int disk_size(struct disk *disk)
+{
+    return disk->nblocks;
 }
 
-int disk_size()
+int disk_block_size(struct disk *disk)
 {
-    return nblocks;
+    return disk->block_size;
 }
 
-static void sanity_check(int blocknum, const void *data)
+// Address the image in blocks of another size. Returns 0 for a size that
+// isn't a power of two between DISK_BLOCK_SIZE and DISK_MAX_BLOCK_SIZE.
+int disk_set_block_size(struct disk *disk, int block_size)
+{
+    int shift = 0;
+
+    if (block_size < DISK_BLOCK_SIZE || block_size > DISK_MAX_BLOCK_SIZE || (block_size & (block_size - 1)))
+    {
+        return 0;
+    }
+
+    while ((1 << shift) < block_size)
+    {
+        shift++;
+    }
+
+    disk->block_size = block_size;
+    disk->block_shift = shift;
+    disk->nblocks = disk->nbytes >> shift;
+
+    return 1;
+}
+
+static void sanity_check(struct disk *disk, int blocknum, const void *data)
 {
     if (blocknum < 0)
     {
@@ -44,7 +184,7 @@ static void sanity_check(int blocknum, const void *data)
         abort();
     }
 
-    if (blocknum >= nblocks)
+    if (blocknum >= disk->nblocks)
     {
         printf("ERROR: blocknum (%d) is too big!\n", blocknum);
         abort();
@@ -57,15 +197,193 @@ static void sanity_check(int blocknum, const void *data)
     }
 }
 
-void disk_read(int blocknum, char *data)
+// Stamp the blocks in a byte range with the current generation. Blocks are
+// written from several threads at once, but always with the same value.
+static void mark_changed(struct disk *disk, long offset, long length)
+{
+    if (!disk->changes)
+    {
+        return;
+    }
+
+    for (long i = offset / DISK_BLOCK_SIZE; i < (offset + length) / DISK_BLOCK_SIZE; i++)
+    {
+        __atomic_store_n(&disk->changes[i], disk->generation, __ATOMIC_RELAXED);
+    }
+}
+
+static void trace_record(struct disk *disk, int blocknum, int type)
+{
+    struct disk_trace_record record;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    record.timestamp = (now.tv_sec - disk->trace_start.tv_sec) * 1000000000ULL + now.tv_nsec - disk->trace_start.tv_nsec;
+    // Records stay in the block size the trace was opened with
+    record.blocknum = (long)blocknum * disk->block_size / disk->trace_block_size;
+    record.type = type;
+    record.op = disk->trace_op;
+    record.reserved = 0;
+
+    fwrite(&record, sizeof(record), 1, disk->tracefile);
+}
+
+// Take a buffer from the pool, or allocate one if every buffer is in use by
+// another thread. Blocks never wait for a buffer.
+static char *pool_get(struct file_disk *file)
+{
+    unsigned int free_buffers = __atomic_load_n(&file->pool_free, __ATOMIC_ACQUIRE);
+    void *buffer;
+
+    while (free_buffers)
+    {
+        int i = __builtin_ctz(free_buffers);
+
+        if (__atomic_compare_exchange_n(&file->pool_free, &free_buffers, free_buffers & ~(1u << i), 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+        {
+            return file->pool + (long)i * DISK_MAX_BLOCK_SIZE;
+        }
+    }
+
+    if (posix_memalign(&buffer, DISK_ALIGN, DISK_MAX_BLOCK_SIZE))
+    {
+        printf("ERROR: couldn't allocate a buffer for direct I/O!\n");
+        abort();
+    }
+
+    return buffer;
+}
+
+static void pool_put(struct file_disk *file, char *buffer)
+{
+    long i = (buffer - file->pool) / DISK_MAX_BLOCK_SIZE;
+
+    if (buffer >= file->pool && i < DISK_POOL_SIZE)
+    {
+        __atomic_fetch_or(&file->pool_free, 1u << i, __ATOMIC_RELEASE);
+    }
+    else
+    {
+        free(buffer);
+    }
+}
+
+// Direct I/O needs an aligned buffer; anything else goes through the pool
+static int needs_bounce(struct file_disk *file, const char *data)
+{
+    return file->direct && ((uintptr_t)data & (DISK_ALIGN - 1));
+}
+
+static int file_read(void *state, long offset, char *data, int length)
+{
+    struct file_disk *file = state;
+    char *buffer = needs_bounce(file, data) ? pool_get(file) : data;
+    int result = pread(file->fd, buffer, length, offset) == length;
+
+    if (buffer != data)
+    {
+        memcpy(data, buffer, length);
+        pool_put(file, buffer);
+    }
+
+    return result;
+}
+
+static int file_write(void *state, long offset, const char *data, int length)
+{
+    struct file_disk *file = state;
+    const char *buffer = data;
+
+    if (needs_bounce(file, data))
+    {
+        char *copy = pool_get(file);
+        memcpy(copy, data, length);
+        buffer = copy;
+    }
+
+    int result = pwrite(file->fd, buffer, length, offset) == length;
+
+    if (buffer != data)
+    {
+        pool_put(file, (char *)buffer);
+    }
+
+    return result;
+}
+
+// Punch a hole in the image so the host gets the space back
+static int file_discard(void *state, long offset, long length)
 {
-    sanity_check(blocknum, data);
+    struct file_disk *file = state;
 
-    fseek(diskfile, blocknum * DISK_BLOCK_SIZE, SEEK_SET);
+    if (file->discard_unsupported)
+    {
+        return 0;
+    }
 
-    if (fread(data, DISK_BLOCK_SIZE, 1, diskfile) == 1)
+    if (fallocate(file->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) < 0)
     {
-        nreads++;
+        // Worth asking only once
+        if (errno == EOPNOTSUPP || errno == ENOSYS)
+        {
+            file->discard_unsupported = 1;
+        }
+        return 0;
+    }
+
+    return 1;
+}
+
+static long file_size(void *state)
+{
+    return ((struct file_disk *)state)->nbytes;
+}
+
+static long file_allocated(void *state)
+{
+    struct stat info;
+
+    if (fstat(((struct file_disk *)state)->fd, &info) < 0)
+    {
+        return -1;
+    }
+
+    return (long)info.st_blocks * 512;
+}
+
+static int file_map(void *state, long offset, long length, void *address)
+{
+    return mmap(address, length, PROT_READ, MAP_SHARED | MAP_FIXED, ((struct file_disk *)state)->fd, offset) !=
+           MAP_FAILED;
+}
+
+static void file_close(void *state)
+{
+    struct file_disk *file = state;
+
+    close(file->fd);
+    free(file->pool);
+    free(file);
+}
+
+static const struct disk_ops file_ops = {"file", file_read, file_write, file_discard, file_size, file_allocated,
+                                         file_map, file_close};
+
+void disk_read(struct disk *disk, int blocknum, char *data)
+{
+    sanity_check(disk, blocknum, data);
+
+    if (disk->tracefile)
+    {
+        trace_record(disk, blocknum, DISK_TRACE_READ);
+    }
+
+    if (disk->ops->read(disk->state, (long)blocknum << disk->block_shift, data, disk->block_size))
+    {
+        // fsck reads from several threads at once
+        __atomic_fetch_add(&disk->nreads, 1, __ATOMIC_RELAXED);
     }
     else
     {
@@ -74,15 +392,19 @@ void disk_read(int blocknum, char *data)
     }
 }
 
-void disk_write(int blocknum, const char *data)
+void disk_write(struct disk *disk, int blocknum, const char *data)
 {
-    sanity_check(blocknum, data);
+    sanity_check(disk, blocknum, data);
 
-    fseek(diskfile, blocknum * DISK_BLOCK_SIZE, SEEK_SET);
+    if (disk->tracefile)
+    {
+        trace_record(disk, blocknum, DISK_TRACE_WRITE);
+    }
 
-    if (fwrite(data, DISK_BLOCK_SIZE, 1, diskfile) == 1)
+    if (disk->ops->write(disk->state, (long)blocknum << disk->block_shift, data, disk->block_size))
     {
-        nwrites++;
+        mark_changed(disk, (long)blocknum << disk->block_shift, disk->block_size);
+        __atomic_fetch_add(&disk->nwrites, 1, __ATOMIC_RELAXED);
     }
     else
     {
@@ -91,13 +413,462 @@ void disk_write(int blocknum, const char *data)
     }
 }
 
-void disk_close()
+// Tell the backend a run of blocks is no longer in use; they read back as
+// zeroes. Returns 0 if the backend can't give the space back.
+int disk_discard(struct disk *disk, int blocknum, int count)
+{
+    if (blocknum < 0 || count <= 0 || blocknum + count > disk->nblocks)
+    {
+        printf("ERROR: discarding blocks #%d-%d outside of %d blocks!\n", blocknum, blocknum + count - 1,
+               disk->nblocks);
+        abort();
+    }
+
+    if (!disk->ops->discard ||
+        !disk->ops->discard(disk->state, (long)blocknum << disk->block_shift, (long)count << disk->block_shift))
+    {
+        return 0;
+    }
+
+    mark_changed(disk, (long)blocknum << disk->block_shift, (long)count << disk->block_shift);
+    __atomic_fetch_add(&disk->ndiscards, count, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// Bytes the image actually occupies, which is less than its size when it is
+// sparse. Returns -1 if the backend can't tell.
+long disk_allocated_bytes(struct disk *disk)
+{
+    return disk->ops->allocated ? disk->ops->allocated(disk->state) : -1;
+}
+
+int disk_map(struct disk *disk, int blocknum, int count, void *address)
+{
+    if (!disk->ops->map || disk->block_size % sysconf(_SC_PAGESIZE) || blocknum < 0 || count <= 0 ||
+        blocknum + count > disk->nblocks)
+    {
+        return 0;
+    }
+
+    return disk->ops->map(disk->state, (long)blocknum << disk->block_shift, (long)count << disk->block_shift, address);
+}
+
+// Write the whole image to a file, leaving holes where blocks are all zeroes.
+// It goes to a temporary file first, so saving over the image being read is safe.
+int disk_save(struct disk *disk, const char *filename)
+{
+    char temp[4096];
+    char *block;
+    int fd, result = 1;
+
+    snprintf(temp, sizeof(temp), "%s.save", filename);
+
+    fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    if (posix_memalign((void **)&block, DISK_ALIGN, DISK_BLOCK_SIZE))
+    {
+        close(fd);
+        unlink(temp);
+        return 0;
+    }
+
+    for (long offset = 0; result && offset < disk->nbytes; offset += DISK_BLOCK_SIZE)
+    {
+        result = disk->ops->read(disk->state, offset, block, DISK_BLOCK_SIZE);
+
+        if (result && (block[0] || memcmp(block, block + 1, DISK_BLOCK_SIZE - 1)))
+        {
+            result = pwrite(fd, block, DISK_BLOCK_SIZE, offset) == DISK_BLOCK_SIZE;
+        }
+    }
+
+    result = result && ftruncate(fd, disk->nbytes) == 0;
+
+    free(block);
+    close(fd);
+
+    if (!result || rename(temp, filename) < 0)
+    {
+        unlink(temp);
+        return 0;
+    }
+
+    return 1;
+}
+
+// The map goes out before the header that vouches for it, so a crash in
+// between leaves a header that still says unclean
+static int write_changes(struct disk *disk, int clean)
+{
+    struct disk_changes_header header;
+    long length = (long)disk->change_blocks * sizeof(uint32_t);
+
+    header.magic = DISK_CHANGES_MAGIC;
+    header.nblocks = disk->change_blocks;
+    header.generation = disk->generation;
+    header.clean = clean;
+
+    return pwrite(disk->change_fd, disk->changes, length, sizeof(header)) == length &&
+           fsync(disk->change_fd) == 0 &&
+           pwrite(disk->change_fd, &header, sizeof(header), 0) == sizeof(header) && fsync(disk->change_fd) == 0;
+}
+
+int disk_open_changes(struct disk *disk, const char *filename, int create)
+{
+    struct disk_changes_header header;
+    char path[4096];
+    int nblocks = disk->nbytes / DISK_BLOCK_SIZE;
+
+    if (disk->changes)
+    {
+        return 1;
+    }
+
+    snprintf(path, sizeof(path), "%s%s", filename, DISK_CHANGES_SUFFIX);
+
+    int fd = open(path, O_RDWR | (create ? O_CREAT : 0), 0666);
+    if (fd < 0)
+    {
+        return !create && errno == ENOENT;
+    }
+
+    disk->changes = calloc(nblocks ? nblocks : 1, sizeof(uint32_t));
+    if (!disk->changes)
+    {
+        close(fd);
+        return 0;
+    }
+
+    disk->change_blocks = nblocks;
+    disk->change_fd = fd;
+
+    int length = pread(fd, &header, sizeof(header), 0);
+
+    if (length == 0 && create)
+    {
+        // A new map: everything on the image so far is generation 0
+        disk->generation = 1;
+    }
+    else if (length != sizeof(header) || header.magic != DISK_CHANGES_MAGIC || !header.generation)
+    {
+        printf("ERROR: %s is not a change map!\n", path);
+        errno = EINVAL;
+        goto fail;
+    }
+    else
+    {
+        long size = (long)nblocks * sizeof(uint32_t);
+
+        disk->generation = header.generation;
+
+        // After a crash or a resize nobody knows what changed, so everything did
+        if (!header.clean || header.nblocks != nblocks || pread(fd, disk->changes, size, sizeof(header)) != size)
+        {
+            for (int i = 0; i < nblocks; i++)
+            {
+                disk->changes[i] = disk->generation;
+            }
+        }
+    }
+
+    // Unclean until the disk is closed
+    if (!write_changes(disk, 0))
+    {
+        goto fail;
+    }
+
+    return 1;
+
+fail:
+    close(fd);
+    free(disk->changes);
+    disk->changes = 0;
+    return 0;
+}
+
+// The generation being written, or 0 if the disk isn't tracked
+int disk_generation(struct disk *disk)
+{
+    return disk->changes ? disk->generation : 0;
+}
+
+// Close the current generation and start the next one. Returns the
+// checkpoint, or 0 if the disk isn't tracked. Nothing may write the disk
+// while this runs.
+int disk_checkpoint(struct disk *disk)
+{
+    if (!disk->changes)
+    {
+        errno = EINVAL;
+        return 0;
+    }
+
+    disk->generation++;
+
+    if (!write_changes(disk, 0))
+    {
+        disk->generation--;
+        return 0;
+    }
+
+    return disk->generation - 1;
+}
+
+// Write out a run and start the next one empty
+static int write_run(FILE *file, struct disk_delta_run *run, const char *blocks, long *nblocks)
+{
+    int result = 1;
+
+    if (run->count)
+    {
+        result = fwrite(run, sizeof(*run), 1, file) == 1 &&
+                 (run->zero || fwrite(blocks, DISK_BLOCK_SIZE, run->count, file) == run->count);
+        *nblocks += run->count;
+    }
+
+    run->count = 0;
+    return result;
+}
+
+// Stream every block changed after checkpoint since, or the whole image when
+// since is 0. A checkpoint is taken first and returned, so the next delta can
+// start where this one ends; blocks written after it go into that one.
+int disk_delta_export(struct disk *disk, int since, FILE *file, long *nblocks)
 {
-    if (diskfile)
+    struct disk_delta_header header;
+    struct disk_delta_run run;
+    char *blocks;
+    int result = 1;
+
+    *nblocks = 0;
+
+    if (!disk->changes || since < 0 || since >= disk->generation)
     {
-        printf("%d disk block reads\n", nreads);
-        printf("%d disk block writes\n", nwrites);
-        fclose(diskfile);
-        diskfile = 0;
+        errno = EINVAL;
+        return 0;
+    }
+
+    int generation = disk_checkpoint(disk);
+    if (!generation)
+    {
+        return 0;
+    }
+
+    // One block more than a run holds, for the block that ends it
+    if (posix_memalign((void **)&blocks, DISK_ALIGN, (DISK_DELTA_RUN + 1) * DISK_BLOCK_SIZE))
+    {
+        return 0;
+    }
+
+    header.magic = DISK_DELTA_MAGIC;
+    header.block_size = DISK_BLOCK_SIZE;
+    header.nblocks = disk->change_blocks;
+    header.since = since;
+    header.generation = generation;
+    header.reserved = 0;
+    result = fwrite(&header, sizeof(header), 1, file) == 1;
+
+    memset(&run, 0, sizeof(run));
+
+    for (int i = 0; result && i < disk->change_blocks; i++)
+    {
+        if (since && disk->changes[i] <= since)
+        {
+            result = write_run(file, &run, blocks, nblocks);
+            continue;
+        }
+
+        char *block = blocks + (long)run.count * DISK_BLOCK_SIZE;
+        if (!disk->ops->read(disk->state, (long)i * DISK_BLOCK_SIZE, block, DISK_BLOCK_SIZE))
+        {
+            result = 0;
+            break;
+        }
+
+        // Runs of zeroes carry no data, so a run ends where that changes
+        int zero = !block[0] && !memcmp(block, block + 1, DISK_BLOCK_SIZE - 1);
+
+        if (run.count && (zero != run.zero || run.count == DISK_DELTA_RUN))
+        {
+            result = write_run(file, &run, blocks, nblocks);
+            memcpy(blocks, block, DISK_BLOCK_SIZE);
+        }
+
+        if (!run.count)
+        {
+            run.start = i;
+            run.zero = zero;
+        }
+
+        run.count++;
     }
+
+    result = result && write_run(file, &run, blocks, nblocks);
+
+    // The run of no blocks that ends the delta
+    memset(&run, 0, sizeof(run));
+    result = result && fwrite(&run, sizeof(run), 1, file) == 1 && fflush(file) == 0;
+
+    free(blocks);
+    return result ? generation : 0;
 }
+
+// Write a delta's runs over the disk, which must be the size of the image the
+// delta came from. The header has already been read from the file. Returns
+// 0 if the delta is cut short, in which case only part of it was applied.
+int disk_delta_apply(struct disk *disk, const struct disk_delta_header *header, FILE *file, long *nblocks)
+{
+    struct disk_delta_run run;
+    char *blocks;
+    int result = 1;
+
+    *nblocks = 0;
+
+    if (header->magic != DISK_DELTA_MAGIC || header->block_size != DISK_BLOCK_SIZE ||
+        (long)header->nblocks * DISK_BLOCK_SIZE != disk->nbytes)
+    {
+        errno = EINVAL;
+        return 0;
+    }
+
+    if (posix_memalign((void **)&blocks, DISK_ALIGN, DISK_DELTA_RUN * DISK_BLOCK_SIZE))
+    {
+        return 0;
+    }
+
+    while (result)
+    {
+        if (fread(&run, sizeof(run), 1, file) != 1 || run.count > DISK_DELTA_RUN ||
+            run.start + run.count > header->nblocks)
+        {
+            errno = EINVAL;
+            result = 0;
+            break;
+        }
+
+        if (!run.count)
+        {
+            break;
+        }
+
+        long offset = (long)run.start * DISK_BLOCK_SIZE;
+        long length = (long)run.count * DISK_BLOCK_SIZE;
+
+        if (run.zero)
+        {
+            // Give the space back if the backend can, otherwise write the zeroes
+            if (!disk->ops->discard || !disk->ops->discard(disk->state, offset, length))
+            {
+                memset(blocks, 0, length);
+                result = disk->ops->write(disk->state, offset, blocks, length);
+            }
+        }
+        else if (fread(blocks, DISK_BLOCK_SIZE, run.count, file) != run.count)
+        {
+            errno = EINVAL;
+            result = 0;
+        }
+        else
+        {
+            result = disk->ops->write(disk->state, offset, blocks, length);
+        }
+
+        if (result)
+        {
+            mark_changed(disk, offset, length);
+            *nblocks += run.count;
+        }
+    }
+
+    free(blocks);
+    return result ? header->generation : 0;
+}
+
+int disk_read_count(struct disk *disk)
+{
+    return disk->nreads;
+}
+
+int disk_write_count(struct disk *disk)
+{
+    return disk->nwrites;
+}
+
+int disk_discard_count(struct disk *disk)
+{
+    return disk->ndiscards;
+}
+
+void disk_close(struct disk *disk)
+{
+    if (disk)
+    {
+        disk_trace_close(disk);
+
+        printf("%d disk block reads\n", disk->nreads);
+        printf("%d disk block writes\n", disk->nwrites);
+        if (disk->ndiscards)
+        {
+            printf("%d disk blocks discarded\n", disk->ndiscards);
+        }
+        if (disk->changes)
+        {
+            if (!write_changes(disk, 1))
+            {
+                printf("ERROR: couldn't save the change map: %s\n", strerror(errno));
+            }
+            close(disk->change_fd);
+            free(disk->changes);
+        }
+
+        disk->ops->close(disk->state);
+        free(disk);
+    }
+}
+
+int disk_trace_open(struct disk *disk, const char *filename)
+{
+    struct disk_trace_header header;
+
+    disk_trace_close(disk);
+
+    disk->tracefile = fopen(filename, "w");
+    if (!disk->tracefile)
+        return 0;
+
+    header.magic = DISK_TRACE_MAGIC;
+    header.block_size = disk->block_size;
+    header.nblocks = disk->nblocks;
+    header.reserved = 0;
+
+    if (fwrite(&header, sizeof(header), 1, disk->tracefile) != 1)
+    {
+        fclose(disk->tracefile);
+        disk->tracefile = 0;
+        return 0;
+    }
+
+    disk->trace_block_size = disk->block_size;
+    clock_gettime(CLOCK_MONOTONIC, &disk->trace_start);
+
+    return 1;
+}
+
+void disk_trace_close(struct disk *disk)
+{
+    if (disk->tracefile)
+    {
+        fclose(disk->tracefile);
+        disk->tracefile = 0;
+    }
+}
+
+// Tag the block accesses that follow with the filesystem operation issuing them
+void disk_trace_set_op(struct disk *disk, int op)
+{
+    disk->trace_op = op;
+}
\ No newline at end of file
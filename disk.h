@@ -1,12 +1,140 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include <stdint.h>
+#include <stdio.h>
+
+// Disks start out with the smallest block size; a filesystem can switch to
+// any power of two up to the largest once it knows which it was formatted with
 #define DISK_BLOCK_SIZE 4096
+#define DISK_MAX_BLOCK_SIZE 65536
+
+// Flags for disk_init_with
+#define DISK_DIRECT 1
+
+// Buffers aligned to this are read and written in place by a direct disk
+#define DISK_ALIGN 4096
+
+#define DISK_TRACE_MAGIC 0x53465452
+#define DISK_TRACE_READ 0
+#define DISK_TRACE_WRITE 1
+#define DISK_TRACE_NO_OP 0xff
+
+// A trace file is one header followed by one record per block access
+struct disk_trace_header
+{
+    uint32_t magic;
+    uint32_t block_size;
+    uint32_t nblocks;
+    uint32_t reserved;
+};
+
+struct disk_trace_record
+{
+    uint64_t timestamp;
+    int32_t blocknum;
+    uint8_t type;
+    uint8_t op;
+    uint16_t reserved;
+};
+
+// Change tracking. An image can have a change map next to it, named after it
+// with DISK_CHANGES_SUFFIX, that holds the generation each DISK_BLOCK_SIZE
+// block was last written or discarded in. A checkpoint closes the current
+// generation, so the blocks changed since checkpoint g are those whose entry
+// is above g; generation 0 stands for the image as it was when tracking began.
+#define DISK_CHANGES_SUFFIX ".changes"
+#define DISK_CHANGES_MAGIC 0x53464347
+
+// The map's header is marked clean only once the map has been written out in
+// full. A map found unclean is not trusted: every block counts as changed.
+struct disk_changes_header
+{
+    uint32_t magic;
+    uint32_t nblocks;
+    uint32_t generation;
+    uint32_t clean;
+};
+
+// A delta is one header followed by runs of changed blocks, each carrying
+// its blocks unless they are all zeroes, and ends with a run of no blocks
+#define DISK_DELTA_MAGIC 0x5346444c
+#define DISK_DELTA_RUN 256
+
+struct disk_delta_header
+{
+    uint32_t magic;
+    uint32_t block_size;
+    uint32_t nblocks;
+    uint32_t since;
+    uint32_t generation;
+    uint32_t reserved;
+};
+
+struct disk_delta_run
+{
+    uint32_t start;
+    uint32_t count;
+    uint32_t zero;
+    uint32_t reserved;
+};
+
+struct disk;
+
+// Where the blocks of a disk live. Offsets and lengths are whole blocks; read
+// and write return 0 on failure with errno set. discard and allocated may be
+// null when the backend can't give space back or measure it, and map when it
+// can't place its blocks read-only at a page aligned address.
+struct disk_ops
+{
+    const char *name;
+    int (*read)(void *state, long offset, char *data, int length);
+    int (*write)(void *state, long offset, const char *data, int length);
+    int (*discard)(void *state, long offset, long length);
+    long (*size)(void *state);
+    long (*allocated)(void *state);
+    int (*map)(void *state, long offset, long length, void *address);
+    void (*close)(void *state);
+};
+
+struct disk *disk_open_backend(const struct disk_ops *ops, void *state);
+const char *disk_backend_name(struct disk *disk);
+
+// An image file on the host
+struct disk *disk_init(const char *filename, int nblocks);
+struct disk *disk_init_with(const char *filename, int nblocks, int flags);
+
+// A disk held in memory, loaded from an image file if one is given. With
+// nblocks 0 the image's own size is used. Nothing is written back unless
+// disk_save is called.
+struct disk *disk_init_ram(const char *filename, int nblocks);
+int disk_save(struct disk *disk, const char *filename);
+int disk_size(struct disk *disk);
+int disk_block_size(struct disk *disk);
+int disk_set_block_size(struct disk *disk, int block_size);
+void disk_read(struct disk *disk, int blocknum, char *data);
+void disk_write(struct disk *disk, int blocknum, const char *data);
+int disk_discard(struct disk *disk, int blocknum, int count);
+long disk_allocated_bytes(struct disk *disk);
+// Map count blocks read-only over the pages at address, replacing whatever
+// was there, so that reading them reads the disk. Returns 0 if the backend
+// can't, or the block size isn't a whole number of pages.
+int disk_map(struct disk *disk, int blocknum, int count, void *address);
+// Load the change map of the image the disk was opened from. Without create,
+// an image that has no map is left untracked and that isn't an error.
+int disk_open_changes(struct disk *disk, const char *filename, int create);
+int disk_generation(struct disk *disk);
+int disk_checkpoint(struct disk *disk);
+int disk_delta_export(struct disk *disk, int since, FILE *file, long *nblocks);
+int disk_delta_apply(struct disk *disk, const struct disk_delta_header *header, FILE *file, long *nblocks);
+
+int disk_read_count(struct disk *disk);
+int disk_write_count(struct disk *disk);
+int disk_discard_count(struct disk *disk);
+void disk_close(struct disk *disk);
 
-int disk_init(const char *filename, int nblocks);
-int disk_size();
-void disk_read(int blocknum, char *data);
-void disk_write(int blocknum, const char *data);
-void disk_close();
+int disk_trace_open(struct disk *disk, const char *filename);
+void disk_trace_close(struct disk *disk);
+void disk_trace_set_op(struct disk *disk, int op);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,333 @@
+
+#include "fs.h"
+#include "fs_internal.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+static const char *type_names[] = {"none", "file", "directory"};
+
+// Bucket 0 holds zero, bucket i holds values in [2^(i-1), 2^i)
+static int bucket_of(long value)
+{
+    int bucket = 0;
+
+    while (value > 0 && bucket < FS_DUMP_BUCKETS - 1)
+    {
+        value >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
+
+// Extend the last run if the block follows it on disk, otherwise start a new one
+static void add_block(struct fs_dump_inode *inode, struct fs_dump_run *runs, int blocknum)
+{
+    if (inode->nruns && runs[inode->nruns - 1].start + runs[inode->nruns - 1].length == blocknum)
+    {
+        runs[inode->nruns - 1].length++;
+    }
+    else
+    {
+        runs[inode->nruns].start = blocknum;
+        runs[inode->nruns].length = 1;
+        inode->nruns++;
+    }
+
+    inode->nblocks++;
+}
+
+static void add_to_summary(struct fs_dump_summary *summary, const struct fs_dump_inode *inode)
+{
+    summary->inodes++;
+    summary->files += inode->type == FS_INODE_FILE;
+    summary->directories += inode->type == FS_INODE_DIR;
+    summary->bytes += inode->size;
+    summary->size_histogram[bucket_of(inode->size)]++;
+
+    for (int i = 0; i < inode->nruns; i++)
+    {
+        summary->runs++;
+        summary->run_histogram[bucket_of(inode->runs[i].length)]++;
+
+        if (inode->runs[i].length > summary->longest_run)
+        {
+            summary->longest_run = inode->runs[i].length;
+        }
+    }
+}
+
+// Clones share blocks, which count once however many inodes point to them.
+// Pointers that lead off the disk aren't counted.
+static void count_block(struct fs_dump_summary *summary, unsigned char *seen, int blocknum)
+{
+    if (blocknum > 0 && blocknum < summary->nblocks && !seen[blocknum])
+    {
+        seen[blocknum] = 1;
+        summary->data_blocks++;
+    }
+}
+
+static void count_blocks(struct fs_dump_summary *summary, unsigned char *seen, const struct fs_dump_inode *inode)
+{
+    count_block(summary, seen, inode->indirect);
+
+    for (int i = 0; i < inode->nruns; i++)
+    {
+        for (int j = 0; j < inode->runs[i].length; j++)
+        {
+            count_block(summary, seen, inode->runs[i].start + j);
+        }
+    }
+}
+
+// Walk every inode in the current epoch, folding each one into the summary
+// if there is one. Blocks are handed out as runs in file order, so an inode
+// costs at most one extra read for its indirect block and nothing else.
+static int do_walk(struct fs_ctx *fs, fs_inode_fn fn, void *arg, struct fs_dump_summary *summary)
+{
+    union fs_block block;
+    union fs_block indirect;
+    struct fs_dump_inode inode;
+    struct fs_dump_run *runs;
+    unsigned char *seen = 0;
+
+    if (!read_superblock(fs, &block))
+    {
+        return 0;
+    }
+
+    int nblocks = block.super.nblocks < disk_size(fs->disk) ? block.super.nblocks : disk_size(fs->disk);
+    int ninodeblocks = block.super.ninodeblocks;
+    int data_start = ninodeblocks + 1 + checksum_blocks_of(fs, &block);
+    int epoch = block.super.ext_magic == FS_EXT_MAGIC ? block.super.epoch : 0;
+
+    runs = malloc((POINTERS_PER_INODE + fs->pointers_per_block) * sizeof(struct fs_dump_run));
+    seen = summary ? calloc(nblocks, 1) : 0;
+    if (!runs || (summary && !seen))
+    {
+        free(runs);
+        free(seen);
+        return 0;
+    }
+
+    if (summary)
+    {
+        memset(summary, 0, sizeof(struct fs_dump_summary));
+        summary->block_size = fs->block_size;
+        summary->nblocks = nblocks;
+        summary->inode_blocks = ninodeblocks;
+    }
+
+    for (int i = 1; i <= ninodeblocks && i < nblocks; i++)
+    {
+        // Blocks from before the last format hold no inodes
+        read_block(fs, STATS_INODE, i, block.data);
+        if (!inode_block_current(&block, epoch))
+        {
+            continue;
+        }
+
+        for (int j = 1; j < fs->inodes_per_block; j++)
+        {
+            struct fs_inode *current = &block.inode[j];
+
+            if (!current->isvalid)
+            {
+                continue;
+            }
+
+            memset(&inode, 0, sizeof(inode));
+            inode.inumber = (i - 1) * fs->inodes_per_block + j;
+            inode.type = inode_type(current);
+            inode.size = current->size;
+            inode.indirect = current->indirect;
+            inode.runs = runs;
+
+            for (int k = 0; k < POINTERS_PER_INODE; k++)
+            {
+                if (current->direct[k])
+                {
+                    add_block(&inode, runs, current->direct[k]);
+                }
+            }
+
+            // Pointers that lead off the disk are left for fsck to report
+            if (current->indirect > 0 && current->indirect < nblocks)
+            {
+                read_block(fs, STATS_INDIRECT, current->indirect, indirect.data);
+
+                for (int k = 0; k < fs->pointers_per_block; k++)
+                {
+                    if (indirect.pointers[k])
+                    {
+                        add_block(&inode, runs, indirect.pointers[k]);
+                    }
+                }
+            }
+
+            if (summary)
+            {
+                add_to_summary(summary, &inode);
+                count_blocks(summary, seen, &inode);
+            }
+
+            if (fn && fn(&inode, arg))
+            {
+                free(runs);
+                free(seen);
+                return 1;
+            }
+        }
+    }
+
+    if (summary)
+    {
+        summary->free_blocks = nblocks - data_start - summary->data_blocks;
+        if (summary->free_blocks < 0)
+        {
+            summary->free_blocks = 0;
+        }
+    }
+
+    free(runs);
+    free(seen);
+    return 1;
+}
+
+static int dump_json(const struct fs_dump_inode *inode, void *arg)
+{
+    FILE *file = arg;
+
+    fprintf(file, "{\"inode\": %d, \"type\": \"%s\", \"size\": %d, \"blocks\": %d, \"indirect\": %d, \"runs\": [",
+            inode->inumber, type_names[inode->type <= FS_INODE_DIR ? inode->type : 0], inode->size, inode->nblocks,
+            inode->indirect);
+
+    for (int i = 0; i < inode->nruns; i++)
+    {
+        fprintf(file, "%s[%d, %d]", i ? ", " : "", inode->runs[i].start, inode->runs[i].length);
+    }
+
+    fprintf(file, "]}\n");
+    return 0;
+}
+
+static int dump_binary(const struct fs_dump_inode *inode, void *arg)
+{
+    FILE *file = arg;
+    struct fs_dump_record record;
+
+    record.inumber = inode->inumber;
+    record.type = inode->type;
+    record.size = inode->size;
+    record.nblocks = inode->nblocks;
+    record.indirect = inode->indirect;
+    record.nruns = inode->nruns;
+
+    fwrite(&record, sizeof(record), 1, file);
+    fwrite(inode->runs, sizeof(struct fs_dump_run), inode->nruns, file);
+    return 0;
+}
+
+static void print_histogram(FILE *file, const char *name, const long *histogram)
+{
+    int first = 1;
+
+    fprintf(file, ", \"%s\": [", name);
+
+    // Only non-empty buckets, each with its upper bound
+    for (int i = 0; i < FS_DUMP_BUCKETS; i++)
+    {
+        if (histogram[i])
+        {
+            fprintf(file, "%s{\"lt\": %ld, \"count\": %ld}", first ? "" : ", ", 1L << i, histogram[i]);
+            first = 0;
+        }
+    }
+
+    fprintf(file, "]");
+}
+
+static void print_summary(FILE *file, const struct fs_dump_summary *summary)
+{
+    fprintf(file, "{\"summary\": {\"block_size\": %d, \"blocks\": %d, \"inode_blocks\": %d, \"inodes\": %d, "
+                  "\"files\": %d, \"directories\": %d, \"bytes\": %ld, \"data_blocks\": %d, \"free_blocks\": %d, "
+                  "\"runs\": %ld, \"longest_run\": %d",
+            summary->block_size, summary->nblocks, summary->inode_blocks, summary->inodes, summary->files,
+            summary->directories, summary->bytes, summary->data_blocks, summary->free_blocks, summary->runs,
+            summary->longest_run);
+
+    print_histogram(file, "file_sizes", summary->size_histogram);
+    print_histogram(file, "run_lengths", summary->run_histogram);
+
+    fprintf(file, "}}\n");
+}
+
+int fs_iterate_inodes(struct fs_ctx *fs, fs_inode_fn fn, void *arg)
+{
+    return do_walk(fs, fn, arg, 0);
+}
+
+int fs_dump_summary(struct fs_ctx *fs, struct fs_dump_summary *summary)
+{
+    return do_walk(fs, 0, 0, summary);
+}
+
+int fs_dump(struct fs_ctx *fs, int format, FILE *file)
+{
+    struct fs_dump_summary summary;
+
+    if (format == FS_DUMP_JSON)
+    {
+        // One object per line, with the totals last
+        if (!do_walk(fs, dump_json, file, &summary))
+        {
+            return 0;
+        }
+        print_summary(file, &summary);
+    }
+    else if (format == FS_DUMP_BINARY)
+    {
+        struct fs_dump_header header;
+        struct fs_dump_record end;
+        union fs_block block;
+
+        if (!read_superblock(fs, &block))
+        {
+            return 0;
+        }
+
+        // Records follow the header until one for inode 0, so the output
+        // can be streamed through a pipe
+        memset(&header, 0, sizeof(header));
+        header.magic = FS_DUMP_MAGIC;
+        header.block_size = fs->block_size;
+        header.nblocks = block.super.nblocks;
+        header.inode_blocks = block.super.ninodeblocks;
+        fwrite(&header, sizeof(header), 1, file);
+
+        if (!do_walk(fs, dump_binary, file, 0))
+        {
+            return 0;
+        }
+
+        memset(&end, 0, sizeof(end));
+        fwrite(&end, sizeof(end), 1, file);
+    }
+    else if (format == FS_DUMP_SUMMARY)
+    {
+        if (!do_walk(fs, 0, 0, &summary))
+        {
+            return 0;
+        }
+        print_summary(file, &summary);
+    }
+    else
+    {
+        return 0;
+    }
+
+    return 1;
+}
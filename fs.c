@@ -1,79 +1,415 @@
 
 #include "fs.h"
-#include "disk.h"
+#include "fs_internal.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <limits.h>
 
-#define DISK_BLOCK_SIZE 4096
-#define FS_MAGIC 0xf0f03410
-#define INODES_PER_BLOCK 128
-#define POINTERS_PER_INODE 5
-#define POINTERS_PER_BLOCK 1024
+struct fs_ctx *fs_ctx_init(struct disk *disk)
+{
+    struct fs_ctx *fs = calloc(1, sizeof(struct fs_ctx));
+
+    if (fs)
+    {
+        fs->disk = disk;
+        fs->discard = 1;
+        fs->checksum_format = 1;
+        fs_set_geometry(fs, DISK_BLOCK_SIZE);
+
+        for (int i = 0; i < FS_ALLOC_SHARDS; i++)
+        {
+            pthread_mutex_init(&fs->shards[i].lock, 0);
+        }
+        pthread_mutex_init(&fs->discard_lock, 0);
+    }
 
-int fs_mounted = 0;
-int *bitmap;
-int num_inode_blocks;
+    return fs;
+}
 
-struct fs_superblock
+void fs_ctx_free(struct fs_ctx *fs)
 {
-    int magic;
-    int nblocks;
-    int ninodeblocks;
-    int ninodes;
-};
+    if (fs)
+    {
+        fs_flush_discards(fs);
+        close_checksums(fs);
+        shared_detach(fs);
+        drop_mappings(fs);
+
+        for (int i = 0; i < FS_ALLOC_SHARDS; i++)
+        {
+            pthread_mutex_destroy(&fs->shards[i].lock);
+        }
+        pthread_mutex_destroy(&fs->discard_lock);
+
+        free(fs->group_free);
+        free(fs->bitmap);
+        free(fs);
+    }
+}
 
-struct fs_inode
+struct fs_stats *fs_get_stats(struct fs_ctx *fs)
 {
-    int isvalid;
-    int size;
-    int direct[POINTERS_PER_INODE];
-    int indirect;
-};
+    return &fs->stats;
+}
 
-union fs_block
+// Switch the context and its disk to a block size. The inode and pointer
+// counts follow from it, and all of them are powers of two.
+int fs_set_geometry(struct fs_ctx *fs, int block_size)
 {
-    struct fs_superblock super;
-    struct fs_inode inode[INODES_PER_BLOCK];
-    int pointers[POINTERS_PER_BLOCK];
-    char data[DISK_BLOCK_SIZE];
-};
+    if (!disk_set_block_size(fs->disk, block_size))
+    {
+        return 0;
+    }
+
+    fs->block_size = block_size;
+    fs->block_shift = 0;
+    while ((1 << fs->block_shift) < block_size)
+    {
+        fs->block_shift++;
+    }
+
+    fs->inodes_per_block = block_size / sizeof(struct fs_inode);
+    fs->inode_shift = fs->block_shift - 5;
+    fs->pointers_per_block = block_size / sizeof(int);
+
+    return 1;
+}
+
+// The superblock sits in the first DISK_BLOCK_SIZE bytes whatever the block
+// size, so it is read with the smallest one. Afterwards the context uses the
+// block size it records. Returns 0 if there is no filesystem on the disk.
+int read_superblock(struct fs_ctx *fs, union fs_block *block)
+{
+    fs_set_geometry(fs, DISK_BLOCK_SIZE);
+    read_block(fs, STATS_SUPERBLOCK, 0, block->data);
+
+    if (block->super.magic != FS_MAGIC)
+    {
+        return 0;
+    }
+
+    // Disks formatted before the block size was recorded use the smallest
+    if (block->super.ext_magic == FS_EXT_MAGIC && block->super.block_size)
+    {
+        return fs_set_geometry(fs, block->super.block_size);
+    }
+
+    return 1;
+}
+
+// Threads are given shards in turn the first time they allocate
+static __thread int alloc_shard = -1;
+static int next_alloc_shard;
+
+void bind_alloc_shard(int shard)
+{
+    alloc_shard = shard % FS_ALLOC_SHARDS;
+}
 
-int allocate_new_block(int blocks)
+// Reserve up to a batch of free blocks for a shard, starting at its cursor in
+// its own group and moving through the groups after it until one has free
+// blocks. Each block is claimed in the free map with a compare and swap, so
+// shards that meet in a group never take the same block.
+static void refill_shard(struct fs_ctx *fs, struct fs_alloc_shard *shard)
 {
-    for (int i = 0; i < blocks; i++)
+    shard->next = 0;
+    shard->nreserved = 0;
+
+    for (int n = 0; n < fs->ngroups && !shard->nreserved; n++)
     {
-        if (!bitmap[i])
+        int group = (shard->group + n) % fs->ngroups;
+        int start = group * FS_ALLOC_GROUP_BLOCKS;
+        int size = fs->nblocks - start < FS_ALLOC_GROUP_BLOCKS ? fs->nblocks - start : FS_ALLOC_GROUP_BLOCKS;
+        int cursor = shard->cursor >= start && shard->cursor < start + size ? shard->cursor - start : 0;
+        int k;
+
+        if (!__atomic_load_n(&fs->group_free[group], __ATOMIC_RELAXED))
+        {
+            continue;
+        }
+
+        // Once around the group, so blocks freed behind the cursor are found too
+        for (k = 0; k < size && shard->nreserved < FS_ALLOC_BATCH; k++)
+        {
+            int blocknum = start + (cursor + k) % size;
+            int expected = 0;
+
+            if (!__atomic_load_n(&fs->bitmap[blocknum], __ATOMIC_RELAXED) &&
+                __atomic_compare_exchange_n(&fs->bitmap[blocknum], &expected, 1, 0, __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED))
+            {
+                shard->reserved[shard->nreserved++] = blocknum;
+            }
+        }
+
+        if (shard->nreserved)
         {
-            bitmap[i] = 1;
-            return i;
+            shard->group = group;
+            shard->cursor = start + (cursor + k) % size;
+            __atomic_fetch_sub(&fs->group_free[group], shard->nreserved, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&fs->used_blocks, shard->nreserved, __ATOMIC_RELAXED);
         }
     }
 
-    return 0;
+    // A block is queued for discard before the reference that frees it goes,
+    // so one just reserved that still waits for its discard is in the queue by
+    // now. The queue is flushed before any of them is handed out, so the hole
+    // is never punched under new contents.
+    if (shard->nreserved && __atomic_load_n(&fs->ndiscards, __ATOMIC_ACQUIRE))
+    {
+        fs_flush_discards(fs);
+    }
+}
+
+// With every group empty the last free blocks may be sitting in other shards'
+// reservations. Shards that are busy are passed over rather than waited on.
+static void steal_reservations(struct fs_ctx *fs, struct fs_alloc_shard *shard)
+{
+    for (int i = 0; i < FS_ALLOC_SHARDS && shard->next == shard->nreserved; i++)
+    {
+        struct fs_alloc_shard *other = &fs->shards[i];
+
+        if (other == shard || pthread_mutex_trylock(&other->lock))
+        {
+            continue;
+        }
+
+        shard->next = 0;
+        shard->nreserved = 0;
+        while (other->next < other->nreserved)
+        {
+            shard->reserved[shard->nreserved++] = other->reserved[other->next++];
+        }
+
+        pthread_mutex_unlock(&other->lock);
+    }
+}
+
+// Hand out the calling thread's next reserved block, or 0 when the disk is
+// full. Any number of threads may allocate at once.
+int allocate_new_block(struct fs_ctx *fs)
+{
+    struct fs_alloc_shard *shard;
+    int blocknum = 0;
+
+    if (alloc_shard < 0)
+    {
+        bind_alloc_shard(__atomic_fetch_add(&next_alloc_shard, 1, __ATOMIC_RELAXED));
+    }
+
+    shard = &fs->shards[alloc_shard];
+    pthread_mutex_lock(&shard->lock);
+
+    if (shard->next == shard->nreserved)
+    {
+        refill_shard(fs, shard);
+    }
+    if (shard->next == shard->nreserved)
+    {
+        steal_reservations(fs, shard);
+    }
+    if (shard->next < shard->nreserved)
+    {
+        blocknum = shard->reserved[shard->next++];
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+    return blocknum;
+}
+
+// Give back the blocks reserved but not handed out, so the free map and the
+// counters only show blocks in use. Nothing may allocate meanwhile.
+void unreserve_blocks(struct fs_ctx *fs)
+{
+    for (int i = 0; i < FS_ALLOC_SHARDS; i++)
+    {
+        struct fs_alloc_shard *shard = &fs->shards[i];
+
+        while (shard->next < shard->nreserved)
+        {
+            int blocknum = shard->reserved[shard->next++];
+
+            fs->bitmap[blocknum] = 0;
+            fs->group_free[blocknum / FS_ALLOC_GROUP_BLOCKS]++;
+            fs->used_blocks--;
+        }
+    }
+}
+
+// Count the free blocks of each group and start every shard at the front of
+// a group, spreading the first few shards across different ones
+static int reset_allocator(struct fs_ctx *fs)
+{
+    fs->ngroups = (fs->nblocks + FS_ALLOC_GROUP_BLOCKS - 1) / FS_ALLOC_GROUP_BLOCKS;
+
+    free(fs->group_free);
+    fs->group_free = calloc(fs->ngroups ? fs->ngroups : 1, sizeof(int));
+    if (!fs->group_free)
+    {
+        return 0;
+    }
+
+    for (int i = 0; i < fs->nblocks; i++)
+    {
+        fs->group_free[i / FS_ALLOC_GROUP_BLOCKS] += !fs->bitmap[i];
+    }
+
+    for (int i = 0; i < FS_ALLOC_SHARDS; i++)
+    {
+        fs->shards[i].group = fs->ngroups ? i % fs->ngroups : 0;
+        fs->shards[i].cursor = fs->shards[i].group * FS_ALLOC_GROUP_BLOCKS;
+        fs->shards[i].next = 0;
+        fs->shards[i].nreserved = 0;
+    }
+
+    return 1;
+}
+
+// Called with the discard lock held
+static void flush_discards_locked(struct fs_ctx *fs)
+{
+    for (int i = 0; i < fs->ndiscards; i++)
+    {
+        // A host that can't punch holes just keeps the space
+        if (!disk_discard(fs->disk, fs->discard_start[i], fs->discard_count[i]))
+        {
+            break;
+        }
+    }
+
+    __atomic_store_n(&fs->ndiscards, 0, __ATOMIC_RELEASE);
+}
+
+// Freed blocks are collected into runs so that a file laid out in order is
+// discarded with a few calls rather than one per block. Called with the
+// discard lock held.
+static void queue_discard(struct fs_ctx *fs, int blocknum)
+{
+    int last = fs->ndiscards - 1;
+
+    if (last >= 0 && fs->discard_start[last] + fs->discard_count[last] == blocknum)
+    {
+        fs->discard_count[last]++;
+    }
+    else if (last >= 0 && blocknum + 1 == fs->discard_start[last])
+    {
+        fs->discard_start[last]--;
+        fs->discard_count[last]++;
+    }
+    else
+    {
+        if (fs->ndiscards == FS_DISCARD_BATCH)
+        {
+            flush_discards_locked(fs);
+        }
+
+        fs->discard_start[fs->ndiscards] = blocknum;
+        fs->discard_count[fs->ndiscards] = 1;
+        __atomic_store_n(&fs->ndiscards, fs->ndiscards + 1, __ATOMIC_RELAXED);
+    }
+}
+
+void fs_flush_discards(struct fs_ctx *fs)
+{
+    pthread_mutex_lock(&fs->discard_lock);
+    flush_discards_locked(fs);
+    pthread_mutex_unlock(&fs->discard_lock);
+}
+
+void fs_set_discard(struct fs_ctx *fs, int enable)
+{
+    if (!enable && fs->ndiscards)
+    {
+        fs_flush_discards(fs);
+    }
+
+    fs->discard = enable;
+}
+
+// Each entry of the free map counts the pointers to its block, so clones can
+// share data blocks. Pointers that lead off the data blocks were never
+// counted, so they are ignored here and never free a metadata block.
+void release_block(struct fs_ctx *fs, int blocknum)
+{
+    if (blocknum >= first_data_block(fs) && blocknum < disk_size(fs->disk) && fs->bitmap[blocknum])
+    {
+        int discard = fs->discard;
+
+        // The last reference queues the block's discard before it goes, so a
+        // shard can't reserve the block before the discard is queued. The lock
+        // keeps the count from changing in between.
+        if (discard)
+        {
+            pthread_mutex_lock(&fs->discard_lock);
+            if (__atomic_load_n(&fs->bitmap[blocknum], __ATOMIC_RELAXED) == 1)
+            {
+                queue_discard(fs, blocknum);
+            }
+        }
+
+        // The block is free once its last reference goes
+        if (!__atomic_sub_fetch(&fs->bitmap[blocknum], 1, __ATOMIC_RELEASE) && blocknum < fs->nblocks)
+        {
+            __atomic_fetch_add(&fs->group_free[blocknum / FS_ALLOC_GROUP_BLOCKS], 1, __ATOMIC_RELAXED);
+            __atomic_fetch_sub(&fs->used_blocks, 1, __ATOMIC_RELAXED);
+        }
+
+        if (discard)
+        {
+            pthread_mutex_unlock(&fs->discard_lock);
+        }
+    }
+}
+
+void share_block(struct fs_ctx *fs, int blocknum)
+{
+    if (blocknum >= first_data_block(fs) && blocknum < disk_size(fs->disk) && fs->bitmap[blocknum])
+    {
+        fs->bitmap[blocknum]++;
+    }
 }
 
-int create_new_bitmap()
+int create_new_bitmap(struct fs_ctx *fs)
 {
 
     union fs_block block;
 
     union fs_block indirect_block;
 
+    fs->used_inodes = 0;
+
     // Begin processing of the new bitmap
-    for (int i = 0; i < disk_size(); i++)
+    for (int i = 0; i < disk_size(fs->disk); i++)
     {
         // Read info for new filesystem
-        disk_read(i, block.data);
+        if (i == 0)
+        {
+            read_block(fs, STATS_SUPERBLOCK, i, block.data);
+        }
+        else if (i <= fs->num_inode_blocks)
+        {
+            read_inode_block(fs, i, &block);
+        }
+        else if (i < first_data_block(fs))
+        {
+            // Checksum blocks are always in use
+            fs->bitmap[i] = 1;
+            continue;
+        }
+        else
+        {
+            read_block(fs, STATS_DATA, i, block.data);
+        }
 
         if (i == 0)
         { // Check if superblock and set it
             if (block.super.magic == FS_MAGIC)
             {
-                bitmap[0] = 1;
+                fs->bitmap[0] = 1;
             }
             else
             {
@@ -82,40 +418,45 @@ int create_new_bitmap()
         }
         // set inode blocks as valid and set the data blocks that
         // they point to as valid
-        else if (i <= num_inode_blocks)
+        else if (i <= fs->num_inode_blocks)
         {
-            bitmap[i] = 1;
+            fs->bitmap[i] = 1;
 
             // Go through each inode in the inode block
-            for (int j = 0; j < INODES_PER_BLOCK; j++)
+            for (int j = 0; j < fs->inodes_per_block; j++)
             {
                 // Check if the inode is valid
                 if (block.inode[j].isvalid)
                 {
+                    fs->used_inodes++;
 
-                    // Check the direct pointers
+                    // Count the direct pointers, ignoring any that point off the data blocks.
+                    // Clones share data blocks, so a block can be counted more than once.
                     for (int k = 0; k < POINTERS_PER_INODE; k++)
                     {
-                        if (block.inode[j].direct[k])
+                        if (block.inode[j].direct[k] >= first_data_block(fs) &&
+                            block.inode[j].direct[k] < disk_size(fs->disk))
                         {
-                            bitmap[block.inode[j].direct[k]] = 1;
+                            fs->bitmap[block.inode[j].direct[k]]++;
                         }
                     }
 
                     // Check the indirect pointer
-                    if (block.inode[j].indirect)
+                    if (block.inode[j].indirect >= first_data_block(fs) &&
+                        block.inode[j].indirect < disk_size(fs->disk))
                     {
                         // Read the indirect pointer and check the indirect block
-                        disk_read(block.inode[j].indirect, indirect_block.data);
+                        read_block(fs, STATS_INDIRECT, block.inode[j].indirect, indirect_block.data);
 
-                        bitmap[block.inode[j].indirect] = 1;
+                        fs->bitmap[block.inode[j].indirect]++;
 
                         // Check pointers on indirect block
-                        for (int l = 0; l < POINTERS_PER_BLOCK; l++)
+                        for (int l = 0; l < fs->pointers_per_block; l++)
                         {
-                            if (indirect_block.pointers[l])
+                            if (indirect_block.pointers[l] >= first_data_block(fs) &&
+                                indirect_block.pointers[l] < disk_size(fs->disk))
                             {
-                                bitmap[indirect_block.pointers[l]] = 1;
+                                fs->bitmap[indirect_block.pointers[l]]++;
                             }
                         }
                     }
@@ -124,16 +465,27 @@ int create_new_bitmap()
         }
     }
 
-    return 1;
+    // The only full count; from here on the counters follow each allocation
+    fs->used_blocks = 0;
+    for (int i = 0; i < fs->nblocks; i++)
+    {
+        fs->used_blocks += fs->bitmap[i] != 0;
+    }
+
+    return reset_allocator(fs) ? 1 : -1;
 }
 
-void print_inode(struct fs_inode *current_inode, int inode_block, int block_offset)
+void print_inode(struct fs_ctx *fs, struct fs_inode *current_inode, int inode_block, int block_offset)
 {
     // Counter for number of direct blocks
     int direct_blocks = 0;
 
     // Print the inode number and size
-    printf("inode %d:\n", (inode_block - 1) * INODES_PER_BLOCK + block_offset);
+    printf("inode %d:\n", (inode_block - 1) * fs->inodes_per_block + block_offset);
+    if (inode_type(current_inode) == FS_INODE_DIR)
+    {
+        printf("    directory\n");
+    }
     printf("    size: %d bytes\n", current_inode->size);
 
     // Search for direct blocks to report
@@ -166,13 +518,13 @@ void print_inode(struct fs_inode *current_inode, int inode_block, int block_offs
         union fs_block indirect_block;
 
         // Reads information about indirect block
-        disk_read(current_inode->indirect, indirect_block.data);
+        read_block(fs, STATS_INDIRECT, current_inode->indirect, indirect_block.data);
 
         // Print information about indirect block
         printf("    indirect block: %d\n", current_inode->indirect);
         printf("    indirect data blocks:");
 
-        for (int j = 0; j < POINTERS_PER_BLOCK; j++)
+        for (int j = 0; j < fs->pointers_per_block; j++)
         {
             // Lists indirect data blocks
             if (indirect_block.pointers[j])
@@ -185,190 +537,297 @@ void print_inode(struct fs_inode *current_inode, int inode_block, int block_offs
     }
 }
 
-int set_inode_blocks()
+// Inode blocks for a disk at the given bytes of disk per inode; 0 keeps
+// the original ten percent of the blocks
+int set_inode_blocks(struct fs_ctx *fs, int inode_ratio)
 {
     int inode_blocks;
 
+    if (inode_ratio > 0)
+    {
+        long ninodes = (long)disk_size(fs->disk) * fs->block_size / inode_ratio;
+        inode_blocks = (ninodes + fs->inodes_per_block - 1) / fs->inodes_per_block;
+    }
     // Ensure that at least ten percent of the blocks are reserved for inodes
-    if (disk_size() % 10 == 0)
+    else if (disk_size(fs->disk) % 10 == 0)
     {
-        inode_blocks = disk_size() / 10;
+        inode_blocks = disk_size(fs->disk) / 10;
     }
     else
     {
-        inode_blocks = (disk_size() / 10) + 1;
+        inode_blocks = (disk_size(fs->disk) / 10) + 1;
+    }
+
+    // Leave room for the superblock and at least one data block
+    if (inode_blocks > disk_size(fs->disk) - 2)
+    {
+        inode_blocks = disk_size(fs->disk) - 2;
+    }
+    if (inode_blocks < 1)
+    {
+        inode_blocks = 1;
     }
 
     return inode_blocks;
 }
 
-void destroy_data(int inode_blocks)
+// Empty inode blocks first through last by stamping them with the epoch
+void destroy_data(struct fs_ctx *fs, int first, int last, int epoch)
 {
     union fs_block block;
 
-    for (int i = 1; i <= inode_blocks; i++)
-    {
-        // Read inode block
-        disk_read(i, block.data);
-
-        // Traverse each inode in the inode block
-        for (int j = 0; j < INODES_PER_BLOCK; j++)
-        {
-            // Make each inode invalid
-            block.inode[j].isvalid = 0;
-        }
+    memset(block.data, 0, fs->block_size);
+    block.inode[0].size = epoch;
 
-        // Write the destroyed inode block back to the disk
-        disk_write(i, block.data);
+    for (int i = first; i <= last; i++)
+    {
+        write_block(fs, STATS_INODE, i, block.data);
     }
 }
 
-void fs_debug()
+void fs_debug(struct fs_ctx *fs)
 {
     union fs_block block;
-    disk_read(0, block.data);
+    read_superblock(fs, &block);
+
+    int ninodeblocks = block.super.ninodeblocks;
+    int epoch = block.super.ext_magic == FS_EXT_MAGIC ? block.super.epoch : 0;
 
     printf("superblock:\n");
     printf("    %d blocks\n", block.super.nblocks);
     printf("    %d inode blocks\n", block.super.ninodeblocks);
     printf("    %d inodes\n", block.super.ninodes);
+    if (block.super.ext_magic == FS_EXT_MAGIC)
+    {
+        printf("    root directory: inode %d\n", block.super.rootdir);
+        printf("    epoch: %d\n", block.super.epoch);
+        printf("    block size: %d bytes\n", fs->block_size);
+        printf("    checksum blocks: %d\n", block.super.checksum_blocks);
+    }
 
     // Traverse each inode block
-    for (int i = 1; i <= block.super.ninodeblocks; i++)
+    for (int i = 1; i <= ninodeblocks && i < disk_size(fs->disk); i++)
     {
-        // Read inode block
-        disk_read(i, block.data);
+        // Read inode block, skipping it if it predates the last format
+        read_block(fs, STATS_INODE, i, block.data);
+        if (!inode_block_current(&block, epoch))
+        {
+            continue;
+        }
 
         // Traverse each inode in the inode block
-        for (int j = 0; j < INODES_PER_BLOCK; j++)
+        for (int j = 0; j < fs->inodes_per_block; j++)
         {
             // If inode is valid (has info), print it out
             if (block.inode[j].isvalid)
             {
-                print_inode(&(block.inode[j]), i, j);
+                print_inode(fs, &(block.inode[j]), i, j);
             }
         }
     }
 }
 
-int fs_format()
+// A format that follows an earlier one only bumps the epoch in the superblock:
+// inode blocks stamped with an older epoch read back as empty, so nothing else
+// has to be cleared. A full format, or one over a disk without an epoch, stamps
+// every inode block instead.
+static int do_format(struct fs_ctx *fs, int block_size, int inode_ratio, int full)
 {
     // If filesystem is already mounted, return an error
-    if (fs_mounted)
+    if (fs->mounted)
     {
         return 0;
     }
 
     union fs_block block;
+    int old_inode_blocks = 0, epoch = 1;
+
+    // Epochs only carry over while the inode blocks stay where they were
+    if (read_superblock(fs, &block) && !full && block.super.ext_magic == FS_EXT_MAGIC && block.super.epoch > 0 &&
+        fs->block_size == block_size)
+    {
+        old_inode_blocks = block.super.ninodeblocks;
+        epoch = block.super.epoch + 1;
+    }
+
+    if (!fs_set_geometry(fs, block_size) || disk_size(fs->disk) < 3)
+    {
+        return 0;
+    }
 
     // Create each element of the super block
+    memset(block.data, 0, fs->block_size);
     block.super.magic = FS_MAGIC;
-    block.super.nblocks = disk_size();
-    block.super.ninodeblocks = set_inode_blocks();
-    block.super.ninodes = block.super.ninodeblocks * INODES_PER_BLOCK;
+    block.super.nblocks = disk_size(fs->disk);
+    block.super.ninodeblocks = set_inode_blocks(fs, inode_ratio);
+    block.super.ninodes = block.super.ninodeblocks * fs->inodes_per_block;
+    block.super.ext_magic = FS_EXT_MAGIC;
+    block.super.rootdir = 1;
+    block.super.epoch = epoch;
+    block.super.block_size = block_size;
+
+    // Checksum blocks go after the inode blocks when there is room for them,
+    // and the table is written out once the format is done
+    int checksum_blocks = checksum_blocks_for(fs, block.super.nblocks);
+    if (fs->checksum_format && block.super.ninodeblocks + checksum_blocks <= block.super.nblocks - 2)
+    {
+        block.super.checksum_blocks = checksum_blocks;
+    }
 
-    // Destroy any existing data in the filesystem
-    destroy_data(block.super.ninodeblocks);
-    disk_write(0, block.data);
+    set_checksum_region(fs, &block);
+    if (!start_checksums(fs))
+    {
+        return 0;
+    }
+
+    // Blocks that were never inode blocks under an epoch could hold anything,
+    // so only they have to be cleared
+    destroy_data(fs, old_inode_blocks + 1, block.super.ninodeblocks, epoch);
+    int first_data = first_data_block(fs);
+    write_block(fs, STATS_SUPERBLOCK, 0, block.data);
+
+    // The root directory starts out empty; its blocks are allocated on the first link
+    memset(block.data, 0, fs->block_size);
+    block.inode[0].size = epoch;
+    block.inode[1].isvalid = FS_INODE_DIR;
+    write_block(fs, STATS_INODE, 1, block.data);
+    close_checksums(fs);
+
+    // Every data block is free now, so the image can give all of them back
+    if (fs->discard)
+    {
+        disk_discard(fs->disk, first_data, disk_size(fs->disk) - first_data);
+    }
 
     // Formatted successfully
     return 1;
 }
 
-int fs_mount()
+static int do_mount(struct fs_ctx *fs)
 {
     union fs_block block;
-    disk_read(0, block.data);
+
+    // A shared mount is left behind for a private one, and an earlier
+    // private one has its checksums written out
+    close_checksums(fs);
+    shared_detach(fs);
 
     // Cannot mount on top of an another filesystem
-    if (block.super.magic != FS_MAGIC)
+    if (!read_superblock(fs, &block))
     {
         return 0;
     }
 
-    // Allocate space for the new free block bitmap
-    bitmap = calloc(block.super.nblocks, sizeof(int));
+    // Allocate space for the new free block bitmap, replacing any from an earlier mount
+    drop_mappings(fs);
+    free(fs->bitmap);
+    fs->bitmap = calloc(disk_size(fs->disk), sizeof(int));
 
     // Allocation failed
-    if (!bitmap)
+    if (!fs->bitmap)
     {
         return 0;
     }
 
-    // Set new values for the system and mark as mounted
-    num_inode_blocks = block.super.ninodeblocks;
-    fs_mounted = 1;
+    // Set new values for the system and mark as mounted, never trusting the
+    // superblock with more blocks than the image has
+    fs->nblocks = block.super.nblocks < disk_size(fs->disk) ? block.super.nblocks : disk_size(fs->disk);
+    fs->num_inode_blocks = block.super.ninodeblocks;
+    fs->inode_hint = 1;
+    fs->mounted = 1;
+
+    // Images formatted before directories existed get a root on first use
+    if (block.super.ext_magic == FS_EXT_MAGIC && block.super.rootdir > 0 &&
+        block.super.rootdir < block.super.ninodes)
+    {
+        fs->rootdir = block.super.rootdir;
+        fs->epoch = block.super.epoch;
+    }
+    else
+    {
+        fs->rootdir = 0;
+        fs->epoch = 0;
+    }
+
+    set_checksum_region(fs, &block);
 
     // Creates new free block bitmap
-    int rc = create_new_bitmap();
+    int rc = create_new_bitmap(fs);
     if (rc == -1) { 
         return 0;
     }
 
+    // The checksums need the free map to be rebuilt after a crash
+    if (!load_checksums(fs, &block))
+    {
+        return 0;
+    }
+
     // Mounted successfully
     return 1;
 }
 
-int fs_create()
+// Claim the first free inode for a new file or directory, starting from the
+// inode block where the last one was found. Slot 0 of each block is never used.
+int fs_alloc_inode(struct fs_ctx *fs, int type)
 {
-    // Check to see if a disk is mounted
-    if (!fs_mounted)
+    union fs_block block;
+
+    if (!writable(fs))
     {
         return 0;
     }
 
-    union fs_block block;
-    disk_read(0, block.data);
-
-    int free_inode = 0;
-
-    for (int k = 1; k <= block.super.ninodeblocks; k++)
+    for (int n = 0; n < fs->num_inode_blocks; n++)
     {
+        int k = (fs->inode_hint + n - 1) % fs->num_inode_blocks + 1;
+
         // Read inode block
-        disk_read(k, block.data);
-        struct fs_inode inode;
+        read_inode_block(fs, k, &block);
 
         // Traverse each inode in the inode block
-        for (int j = 1; j < INODES_PER_BLOCK; j++)
+        for (int j = 1; j < fs->inodes_per_block; j++)
         {
-            inode = block.inode[j];
-
-            // If inode is invalid. insert valid inode
-            if (!inode.isvalid)
+            // If inode is invalid, claim it with no blocks
+            if (!block.inode[j].isvalid)
             {
-                free_inode = (k - 1) * INODES_PER_BLOCK + j;
-
-                inode.isvalid = 1;
-                inode.size = 0;
-
-                // Setting direct pointers to 0
-                for (int i; i < POINTERS_PER_INODE; i++)
-                {
-                    inode.direct[i] = 0;
-                }
-                
-                inode.indirect = 0;
+                memset(&block.inode[j], 0, sizeof(struct fs_inode));
+                block.inode[j].isvalid = type;
 
-                block.inode[j] = inode;
+                write_block(fs, STATS_INODE, k, block.data);
+                fs->inode_hint = k;
+                fs->used_inodes++;
 
-                disk_write(k, block.data);
-                break;
+                return (k - 1) * fs->inodes_per_block + j;
             }
         }
     }
-    return free_inode;
+
+    return 0;
+}
+
+static int do_create(struct fs_ctx *fs)
+{
+    // Check to see if a disk is mounted for writing
+    if (!writable(fs))
+    {
+        return 0;
+    }
+
+    return fs_alloc_inode(fs, FS_INODE_FILE);
 }
 
-int fs_delete(int inumber)
+// Free an inode of either type and the blocks it holds
+int fs_free_inode(struct fs_ctx *fs, int inumber)
 {
-    // Check to see if a disk is mounted
-    if (!fs_mounted)
+    // Check to see if a disk is mounted for writing
+    if (!writable(fs))
     {
         return 0;
     }
 
     union fs_block super_block;
-    disk_read(0, super_block.data);
+    read_block(fs, STATS_SUPERBLOCK, 0, super_block.data);
 
     if (inumber > super_block.super.ninodes || inumber <= 0)
     {
@@ -377,10 +836,10 @@ int fs_delete(int inumber)
 
     union fs_block block;
     // Read inode block
-    disk_read(((inumber / INODES_PER_BLOCK) + 1), block.data);
+    read_inode_block(fs, inode_block_of(fs, inumber), &block);
 
     // if inode doesn't exist, return 0
-    if (!block.inode[inumber % INODES_PER_BLOCK].isvalid)
+    if (!block.inode[inode_slot(fs, inumber)].isvalid)
     {
         return 0;
     }
@@ -389,67 +848,139 @@ int fs_delete(int inumber)
     for (int i = 0; i < POINTERS_PER_INODE; i++)
     {
 
-        if (block.inode[inumber % INODES_PER_BLOCK].direct[i])
+        if (block.inode[inode_slot(fs, inumber)].direct[i])
         {
             // set the bitmap entry for the pointed-to block to 0
-            bitmap[block.inode[inumber % INODES_PER_BLOCK].direct[i]] = 0;
+            release_block(fs, block.inode[inode_slot(fs, inumber)].direct[i]);
             // set the pointer to 0
-            block.inode[inumber % INODES_PER_BLOCK].direct[i] = 0;
+            block.inode[inode_slot(fs, inumber)].direct[i] = 0;
         }
     }
     // if there is an indirect block mapping, free the data blocks mapped from the indirect block
 
-    if (block.inode[inumber % INODES_PER_BLOCK].indirect)
+    if (block.inode[inode_slot(fs, inumber)].indirect)
     {
         union fs_block indirect_block;
-        disk_read(block.inode[inumber % INODES_PER_BLOCK].indirect, indirect_block.data);
+        read_block(fs, STATS_INDIRECT, block.inode[inode_slot(fs, inumber)].indirect, indirect_block.data);
 
-        for (int i = 0; i < POINTERS_PER_BLOCK; i++)
+        for (int i = 0; i < fs->pointers_per_block; i++)
         {
-            if (indirect_block.pointers[i]);
+            if (indirect_block.pointers[i])
             {
                 // set the bitmap entry for the pointed-to block to 0
-                bitmap[indirect_block.pointers[i]] = 0;
+                release_block(fs, indirect_block.pointers[i]);
                 // set the pointer to 0
                 indirect_block.pointers[i] = 0;
             }
         }
-        disk_write(block.inode[inumber % INODES_PER_BLOCK].indirect, indirect_block.data);
+        write_block(fs, STATS_INDIRECT, block.inode[inode_slot(fs, inumber)].indirect, indirect_block.data);
+
+        // free the indirect block itself
+        release_block(fs, block.inode[inode_slot(fs, inumber)].indirect);
     }
     // set the indirect pointer to zero
-    block.inode[inumber % INODES_PER_BLOCK].indirect = 0;
+    block.inode[inode_slot(fs, inumber)].indirect = 0;
 
     // set valid bit to 0
-    block.inode[inumber % INODES_PER_BLOCK].isvalid = 0;
-    block.inode[inumber % INODES_PER_BLOCK].size = 0;
+    block.inode[inode_slot(fs, inumber)].isvalid = 0;
+    fs->used_inodes--;
+    block.inode[inode_slot(fs, inumber)].size = 0;
     // write
-    disk_write(((inumber / INODES_PER_BLOCK) + 1), block.data);
+    write_block(fs, STATS_INODE, inode_block_of(fs, inumber), block.data);
 
     return 1;
 }
 
-int fs_getsize(int inumber)
+// A clone gets its own inode and indirect block, but shares every data block
+// with the original until one of them writes to it
+static int do_clone(struct fs_ctx *fs, int inumber)
 {
     union fs_block block;
-    disk_read(0, block.data);
+    struct fs_inode inode;
 
-    // Check if inumber is 0, which is an invalid inumber.
-    if (inumber <= 0)
+    if (!writable(fs) || inumber <= 0 || inode_block_of(fs, inumber) > fs->num_inode_blocks)
     {
-        return -1;
+        return 0;
     }
-    // Find correct inode block
-    int index = (inumber + INODES_PER_BLOCK) / INODES_PER_BLOCK;
 
-    // Check if inode block is in limits
-    if (index > block.super.ninodeblocks)
+    read_inode_block(fs, inode_block_of(fs, inumber), &block);
+    inode = block.inode[inode_slot(fs, inumber)];
+
+    // Directories record their parent, so they can't simply be shared
+    if (inode_type(&inode) != FS_INODE_FILE)
+    {
+        return 0;
+    }
+
+    // The clone joins the original's family, which is the original's own
+    // inumber if it was never cloned from anything
+    inode.isvalid = FS_INODE_FILE | (unsigned int)inode_family(&inode, inumber) << FS_INODE_FAMILY_SHIFT;
+
+    int clone = fs_alloc_inode(fs, FS_INODE_FILE);
+    if (!clone)
+    {
+        return 0;
+    }
+
+    if (inode.indirect > 0 && inode.indirect < fs->nblocks)
+    {
+        int indirect = allocate_new_block(fs);
+
+        // Nothing is shared yet, so the empty inode can just be dropped
+        if (!indirect)
+        {
+            fs_free_inode(fs, clone);
+            return 0;
+        }
+
+        read_block(fs, STATS_INDIRECT, inode.indirect, block.data);
+        for (int i = 0; i < fs->pointers_per_block; i++)
+        {
+            share_block(fs, block.pointers[i]);
+        }
+        write_block(fs, STATS_INDIRECT, indirect, block.data);
+
+        inode.indirect = indirect;
+    }
+    else
+    {
+        inode.indirect = 0;
+    }
+
+    for (int i = 0; i < POINTERS_PER_INODE; i++)
+    {
+        share_block(fs, inode.direct[i]);
+    }
+
+    read_inode_block(fs, inode_block_of(fs, clone), &block);
+    block.inode[inode_slot(fs, clone)] = inode;
+    write_block(fs, STATS_INODE, inode_block_of(fs, clone), block.data);
+
+    return clone;
+}
+
+int fs_getsize(struct fs_ctx *fs, int inumber)
+{
+    union fs_block block;
+    read_block(fs, STATS_SUPERBLOCK, 0, block.data);
+
+    // Check if inumber is 0, which is an invalid inumber.
+    if (inumber <= 0)
+    {
+        return -1;
+    }
+    // Find correct inode block
+    int index = inode_block_of(fs, inumber);
+
+    // Check if inode block is in limits
+    if (index > block.super.ninodeblocks)
     {
         return -1;
     }
 
     // Read inode from inode block
-    disk_read(index, block.data);
-    struct fs_inode inode = block.inode[inumber % INODES_PER_BLOCK];
+    read_inode_block(fs, index, &block);
+    struct fs_inode inode = block.inode[inode_slot(fs, inumber)];
 
     // Check if valid inode; if inode is valid, return the size
     if (inode.isvalid)
@@ -461,320 +992,762 @@ int fs_getsize(int inumber)
     return -1;
 }
 
-int fs_read(int inumber, char *data, int length, int offset)
+// Answered from counters kept since the mount, without touching the disk.
+// Used blocks include the superblock and the inode blocks.
+int fs_statfs(struct fs_ctx *fs, struct fs_statfs *buf)
 {
-    // Check to see if a filesystem is mounted
-    if (!fs_mounted)
+    if (!fs->mounted)
     {
         return 0;
     }
 
-    // Check to see if a valid inumber is passed
-    if (inumber <= 0)
+    unreserve_blocks(fs);
+
+    buf->block_size = fs->block_size;
+    buf->total_blocks = fs->nblocks;
+    buf->used_blocks = fs->used_blocks;
+    buf->free_blocks = fs->nblocks - fs->used_blocks;
+    buf->total_inodes = fs->num_inode_blocks * (fs->inodes_per_block - 1);
+    buf->used_inodes = fs->used_inodes;
+    buf->free_inodes = buf->total_inodes - fs->used_inodes;
+
+    return 1;
+}
+
+// Public entry points
+
+int fs_format(struct fs_ctx *fs)
+{
+    return fs_format_with(fs, DISK_BLOCK_SIZE, 0, 0);
+}
+
+int fs_format_with(struct fs_ctx *fs, int block_size, int inode_ratio, int full)
+{
+    long start = op_begin(fs, STATS_FORMAT);
+    int result = do_format(fs, block_size, inode_ratio, full);
+    op_end(fs, STATS_FORMAT, start, 0);
+
+    return result;
+}
+
+int fs_mount(struct fs_ctx *fs)
+{
+    long start = op_begin(fs, STATS_MOUNT);
+    int result = do_mount(fs);
+    op_end(fs, STATS_MOUNT, start, 0);
+
+    return result;
+}
+
+int fs_create(struct fs_ctx *fs)
+{
+    long start = op_begin(fs, STATS_CREATE);
+    int result = do_create(fs);
+    op_end(fs, STATS_CREATE, start, 0);
+
+    return result;
+}
+
+// Count a name given to or taken from a file. Directories keep no count, as
+// they only have the one name. Returns 0 for a free inode, or a count that
+// would go out of range.
+int fs_adjust_links(struct fs_ctx *fs, int inumber, int delta)
+{
+    union fs_block block;
+    int blocknum = inode_block_of(fs, inumber);
+    struct fs_inode *inode = &block.inode[inode_slot(fs, inumber)];
+
+    if (!writable(fs) || inumber <= 0 || inumber >= fs->num_inode_blocks * fs->inodes_per_block)
     {
         return 0;
     }
 
-    int pointer_count, is_direct_block, bytes_left, bytes_read = 0;
+    read_inode_block(fs, blocknum, &block);
 
-    union fs_block block, indirect_block;
-    struct fs_inode inode;
+    if (inode_type(inode) != FS_INODE_FILE)
+    {
+        return inode_type(inode) == FS_INODE_DIR;
+    }
 
-    char loop_data[4096] = "";
-    char total_data[16384] = "";
+    int links = inode_links(inode) + delta;
+    if (links < 0 || links > FS_INODE_LINKS_MAX)
+    {
+        errno = EMLINK;
+        return 0;
+    }
 
-    // Determine the inode offset as well as the inode block and pointer offset
-    int inode_offset = inumber % INODES_PER_BLOCK;
-    int block_index = inumber / INODES_PER_BLOCK + 1;
-    int pointer_offset = offset / 4096;
+    set_inode_links(inode, links);
+    write_block(fs, STATS_INODE, blocknum, block.data);
+    return 1;
+}
 
-    // Read from the inodes block
-    disk_read(block_index, block.data);
-    inode = block.inode[inode_offset];
-    int inode_size = inode.size;
+// Directories only go through fs_unlink, which checks they are empty and
+// never removes the root. A file goes once nothing names it, so no name is
+// left to lead to whatever reuses the inumber.
+static int do_delete(struct fs_ctx *fs, int inumber)
+{
+    union fs_block block;
 
-    // Check to make sure inode is valid and has a reasonable size
-    if ((!inode.isvalid) || !inode_size)
+    if (!fs->mounted || inumber <= 0 || inumber >= fs->num_inode_blocks * fs->inodes_per_block)
     {
         return 0;
     }
 
-    // Determine how many bytes can/need to be read
-    if ((inode_size - offset) < length)
+    read_inode_block(fs, inode_block_of(fs, inumber), &block);
+    struct fs_inode *inode = &block.inode[inode_slot(fs, inumber)];
+
+    if (inode_type(inode) == FS_INODE_DIR || inode_links(inode))
     {
-        bytes_left = inode_size - offset;
+        errno = inode_links(inode) ? EBUSY : EISDIR;
+        return 0;
     }
-    else
+
+    return fs_free_inode(fs, inumber);
+}
+
+int fs_delete(struct fs_ctx *fs, int inumber)
+{
+    long start = op_begin(fs, STATS_DELETE);
+    int result = do_delete(fs, inumber);
+    op_end(fs, STATS_DELETE, start, 0);
+
+    return result;
+}
+
+int fs_clone(struct fs_ctx *fs, int inumber)
+{
+    long start = op_begin(fs, STATS_CLONE);
+    int result = do_clone(fs, inumber);
+    op_end(fs, STATS_CLONE, start, 0);
+
+    return result;
+}
+
+// Open file handles
+
+// A handle on an inode of either type; directories are read and written
+// through these by dir.c
+struct fs_file *fs_open_inode(struct fs_ctx *fs, int inumber)
+{
+    union fs_block block;
+
+    if (!fs->mounted || inumber <= 0 || inumber >= fs->num_inode_blocks * fs->inodes_per_block)
+    {
+        return 0;
+    }
+
+    read_inode_block(fs, inode_block_of(fs, inumber), &block);
+
+    if (!block.inode[inode_slot(fs, inumber)].isvalid)
     {
-        bytes_left = length;
+        return 0;
     }
 
-    // Traverse through each direct pointer in the inode
-    for (int i = pointer_offset; i < POINTERS_PER_INODE; i++)
+    // The handle holds a block buffer, which needs the block alignment
+    struct fs_file *file = aligned_alloc(DISK_ALIGN, sizeof(struct fs_file));
+    if (!file)
     {
-        is_direct_block = inode.direct[i];
+        return 0;
+    }
 
-        // If direct block exists, read a piece of data and copy it. Recalculate how much has been read
-        if (is_direct_block)
-        {
-            disk_read(is_direct_block, *(&loop_data));
-            strcat(*(&total_data), *(&loop_data));
+    file->fs = fs;
+    file->inumber = inumber;
+    file->position = 0;
+    file->inode = block.inode[inode_slot(fs, inumber)];
+    file->inode_dirty = 0;
+    file->indirect_loaded = 0;
+    file->indirect_dirty = 0;
 
-            if ((bytes_left - bytes_read) < 4096)
-            {
-                bytes_read += bytes_left - bytes_read;
-            }
-            else
+    return file;
+}
+
+// Directories are only changed through the directory calls, which keep their
+// index consistent, so the byte level calls refuse them
+struct fs_file *fs_open(struct fs_ctx *fs, int inumber)
+{
+    struct fs_file *file = fs_open_inode(fs, inumber);
+
+    if (file && inode_type(&file->inode) == FS_INODE_DIR)
+    {
+        fs_close(file);
+        errno = EISDIR;
+        return 0;
+    }
+
+    return file;
+}
+
+// Map a block index within the file to a disk block, loading the indirect
+// block the first time it is needed. With allocate set the block is about to
+// be written: missing blocks are allocated, and a block shared with a clone is
+// swapped for a private copy. *source then tells the caller which block holds
+// the current contents, or 0 if there are none yet. A pointer that leads off
+// the data blocks is never written through, so fsck can still find it.
+// Returns 0 for a hole, when the disk is full or at such a pointer.
+int fs_file_block(struct fs_file *file, int index, int allocate, int *source)
+{
+    struct fs_ctx *fs = file->fs;
+    int first = first_data_block(fs);
+    int *pointer;
+
+    if (index < POINTERS_PER_INODE)
+    {
+        pointer = &file->inode.direct[index];
+    }
+    else
+    {
+        if (!file->inode.indirect)
+        {
+            if (!allocate)
             {
-                bytes_read += 4096;
+                return 0;
             }
 
-            if (bytes_read >= bytes_left)
+            int indirect = allocate_new_block(fs);
+            if (!indirect)
             {
-                strcpy(data, total_data);
-                return bytes_read;
+                return 0;
             }
+
+            file->inode.indirect = indirect;
+            file->inode_dirty = 1;
+            memset(file->indirect.data, 0, fs->block_size);
+            file->indirect_loaded = 1;
+            file->indirect_dirty = 1;
         }
+        else if (allocate && (file->inode.indirect < first || file->inode.indirect >= fs->nblocks))
+        {
+            return 0;
+        }
+        else if (!file->indirect_loaded)
+        {
+            read_block(fs, STATS_INDIRECT, file->inode.indirect, file->indirect.data);
+            file->indirect_loaded = 1;
+        }
+
+        pointer = &file->indirect.pointers[index - POINTERS_PER_INODE];
     }
 
-    // Traverse through each indirect pointer in the inode if it exists
-    if (inode.indirect)
+    if (allocate && *pointer && (*pointer < first || *pointer >= fs->nblocks))
     {
-        disk_read(inode.indirect, indirect_block.data);
+        return 0;
+    }
+
+    if (source)
+    {
+        *source = *pointer;
+    }
 
-        if (pointer_offset < 5)
+    // The old block keeps its other references, so its contents stay put
+    // until the caller has copied what it needs
+    if (allocate && (!*pointer || fs->bitmap[*pointer] > 1))
+    {
+        int blocknum = allocate_new_block(fs);
+        if (!blocknum)
         {
-            pointer_count = 0;
+            return 0;
         }
+
+        release_block(fs, *pointer);
+        *pointer = blocknum;
+
+        if (index < POINTERS_PER_INODE)
+            file->inode_dirty = 1;
         else
-        {
-            pointer_count = pointer_offset - 5;
-        }
+            file->indirect_dirty = 1;
+    }
 
-        // Start looking from pointer offset
-        for (int j = pointer_count; j < POINTERS_PER_BLOCK; j++)
-        {
-            if (indirect_block.pointers[j])
-            {
-                disk_read(indirect_block.pointers[j], *(&loop_data));
-                strcat(*(&total_data), *(&loop_data));
+    return *pointer;
+}
 
-                if ((bytes_left - bytes_read) < 4096)
-                {
-                    bytes_read += bytes_left - bytes_read;
-                }
-                else
-                {
-                    bytes_read += 4096;
-                }
+// Scatter/gather runs block by block. A block that lies within one buffer
+// moves straight between it and the disk when it is whole, or through a
+// block buffer when it is partial; a block spread over several buffers is
+// gathered or scattered through the block buffer. No byte is copied twice.
+struct iov_cursor
+{
+    const struct iovec *iov;
+    int iovcnt;
+    size_t offset;
+};
 
-                if (bytes_read >= bytes_left)
-                {
-                    strcpy(data, total_data);
-                    return bytes_read;
-                }
-            }
-        }
+// Bytes a vector holds, capped so they fit in an int
+static int iov_total(const struct iovec *iov, int iovcnt)
+{
+    long total = 0;
+
+    for (int i = 0; i < iovcnt && total < INT_MAX; i++)
+    {
+        total += iov[i].iov_len;
     }
 
-    return bytes_read;
+    return total < INT_MAX ? total : INT_MAX;
 }
 
-int fs_write(int inumber, const char *data, int length, int offset)
+// Where the next length bytes are, if they sit in a single buffer
+static char *iov_contiguous(struct iov_cursor *cursor, int length)
 {
-    // Check to see if a filesystem is mounted
-    if (!fs_mounted)
+    // Empty buffers are stepped over first
+    while (cursor->iovcnt && cursor->offset == cursor->iov->iov_len)
     {
-        return 0;
+        cursor->iov++;
+        cursor->iovcnt--;
+        cursor->offset = 0;
     }
 
-    // Check to see if a valid inumber is passed
-    if (inumber <= 0)
+    if (!cursor->iovcnt || cursor->iov->iov_len - cursor->offset < (size_t)length)
     {
         return 0;
     }
 
-    int pointer_count, new_block, bytes_left, bytes_written = 0;
-    union fs_block block, indirect_block, super_block;
-
-    char total_data[16384] = "";
-    strcpy(total_data, data);
+    return (char *)cursor->iov->iov_base + cursor->offset;
+}
 
-    disk_read(0, super_block.data);
+// Copy length bytes between the buffers and memory, advancing the cursor
+static void iov_copy(struct iov_cursor *cursor, char *memory, int length, int to_buffers)
+{
+    while (length > 0 && cursor->iovcnt)
+    {
+        size_t chunk = cursor->iov->iov_len - cursor->offset;
+        char *buffer = (char *)cursor->iov->iov_base + cursor->offset;
 
-    // Determine the inode offset as well as the inode block and pointer offset
-    int inode_offset = inumber % INODES_PER_BLOCK;
-    int block_index = inumber / INODES_PER_BLOCK + 1;
-    int pointer_offset = offset / 4096;
+        if (chunk > (size_t)length)
+        {
+            chunk = length;
+        }
 
-    // Read from the inodes block
-    disk_read(block_index, block.data);
+        if (to_buffers)
+            memcpy(buffer, memory, chunk);
+        else
+            memcpy(memory, buffer, chunk);
 
-    int inode_size = (POINTERS_PER_INODE + POINTERS_PER_BLOCK) * 4096;
+        memory += chunk;
+        length -= chunk;
+        cursor->offset += chunk;
 
-    // Determine how many bytes can/need to be written
-    if ((inode_size - offset) < length)
-    {
-        bytes_left = inode_size - offset;
-    }
-    else
-    {
-        bytes_left = length;
+        if (cursor->offset == cursor->iov->iov_len)
+        {
+            cursor->iov++;
+            cursor->iovcnt--;
+            cursor->offset = 0;
+        }
     }
+}
+
+static int do_readv_h(struct fs_file *file, const struct iovec *iov, int iovcnt)
+{
+    struct fs_ctx *fs = file->fs;
+    struct iov_cursor cursor = {iov, iovcnt, 0};
+    union fs_block block;
+    int length = iov_total(iov, iovcnt);
+    int bytes_read = 0;
 
-    // Check if inode is valid
-    if (!block.inode[inode_offset].isvalid)
+    if (length > file->inode.size - file->position)
     {
-        return 0;
+        length = file->inode.size - file->position;
     }
 
-    // If the offset is 0 at the start, reset direct and indirect pointers to 0
-    if (offset == 0)
+    while (bytes_read < length)
     {
-        //Iterate through pointers of direct block
-        for (int x = 0; x < POINTERS_PER_INODE; x++)
+        int index = file->position >> fs->block_shift;
+        int block_offset = file->position & (fs->block_size - 1);
+        int chunk = fs->block_size - block_offset;
+        int blocknum = fs_file_block(file, index, 0, 0);
+
+        if (chunk > length - bytes_read)
+        {
+            chunk = length - bytes_read;
+        }
+
+        char *target = iov_contiguous(&cursor, chunk);
+
+        if (!blocknum)
         {
-            if (block.inode[inode_offset].direct[x] <= 0)
+            // Holes read back as zeroes
+            if (target)
             {
-                continue;
+                memset(target, 0, chunk);
+                cursor.offset += chunk;
+            }
+            else
+            {
+                memset(block.data, 0, chunk);
+                iov_copy(&cursor, block.data, chunk, 1);
             }
-
-            bitmap[block.inode[inode_offset].direct[x]] = 0;
-            block.inode[inode_offset].direct[x] = 0;
         }
-
-        if (block.inode[inode_offset].indirect > 0)
+        else if (target && chunk == fs->block_size)
         {
-            union fs_block indirect_block;
-            disk_read(block.inode[inode_offset].indirect, indirect_block.data);
-
-            // Iterate through pointers of indirect block
-            for (int y = 0; y < POINTERS_PER_BLOCK; y++)
+            // Whole blocks go straight into the caller's buffer
+            read_block(fs, STATS_DATA, blocknum, target);
+            if (!verify_checksum(fs, blocknum, target))
             {
-                if (indirect_block.pointers[y] <= 0)
-                {
-                    continue;
-                }
-
-                bitmap[indirect_block.pointers[y]] = 0;
-                indirect_block.pointers[y] = 0;
+                errno = EIO;
+                break;
             }
+            cursor.offset += chunk;
+        }
+        else
+        {
+            read_block(fs, STATS_DATA, blocknum, block.data);
+            if (!verify_checksum(fs, blocknum, block.data))
+            {
+                errno = EIO;
+                break;
+            }
+            iov_copy(&cursor, block.data + block_offset, chunk, 1);
+        }
 
-            disk_write(block.inode[inode_offset].indirect, indirect_block.data);
+        bytes_read += chunk;
+        file->position += chunk;
+    }
 
-            bitmap[block.inode[inode_offset].indirect] = 0;
-            block.inode[inode_offset].indirect = 0;
-        }
+    return bytes_read;
+}
 
-        disk_write(block_index, block.data);
+static int do_writev_h(struct fs_file *file, const struct iovec *iov, int iovcnt)
+{
+    struct fs_ctx *fs = file->fs;
+    struct iov_cursor cursor = {iov, iovcnt, 0};
+    union fs_block block;
+    int length = iov_total(iov, iovcnt);
+    int bytes_written = 0;
+    int max_size = (POINTERS_PER_INODE + fs->pointers_per_block) * fs->block_size;
+
+    if (!writable(fs))
+    {
+        return 0;
     }
 
-    // Traverse through each direct pointer in the inode
-    for (int i = pointer_offset; i < POINTERS_PER_INODE; i++)
+    if (length > max_size - file->position)
     {
-        new_block = allocate_new_block(super_block.super.nblocks);
+        length = max_size - file->position;
+    }
 
-        // If the disk is full, there are no more blocks left
-        if (!new_block)
+    while (bytes_written < length)
+    {
+        int index = file->position >> fs->block_shift;
+        int block_offset = file->position & (fs->block_size - 1);
+        int chunk = fs->block_size - block_offset;
+        int source;
+        int blocknum = fs_file_block(file, index, 1, &source);
+
+        // The disk is full
+        if (!blocknum)
         {
-            block.inode[inode_offset].size = offset + bytes_written;
-            disk_write(block_index, block.data);
+            break;
+        }
 
-            return bytes_written;
+        if (chunk > length - bytes_written)
+        {
+            chunk = length - bytes_written;
         }
 
-        block.inode[inode_offset].direct[i] = new_block;
-        disk_write(block.inode[inode_offset].direct[i], total_data);
+        char *data = iov_contiguous(&cursor, chunk);
 
-        // Write a piece of data and copy it. Recalculate how much has been read
-        if ((bytes_left - bytes_written) < DISK_BLOCK_SIZE)
+        if (data && chunk == fs->block_size)
         {
-            bytes_written += bytes_left - bytes_written;
+            // Whole blocks are written straight from the caller's buffer
+            write_block(fs, STATS_DATA, blocknum, data);
+            cursor.offset += chunk;
         }
         else
         {
-            bytes_written += DISK_BLOCK_SIZE;
+            // A partial block keeps whatever the file already had around it; a
+            // whole one spread over several buffers is only gathered
+            if (chunk < fs->block_size)
+            {
+                if (!source)
+                    memset(block.data, 0, fs->block_size);
+                else
+                    read_block(fs, STATS_DATA, source, block.data);
+            }
+
+            iov_copy(&cursor, block.data + block_offset, chunk, 0);
+            write_block(fs, STATS_DATA, blocknum, block.data);
         }
 
-        strcpy(total_data, &data[bytes_written]);
+        bytes_written += chunk;
+        file->position += chunk;
+    }
 
-        // Check to see if too many bytes were written
-        if (bytes_written >= bytes_left)
-        {
-            block.inode[inode_offset].size = offset + bytes_written;
-            disk_write(block_index, block.data);
+    if (file->position > file->inode.size)
+    {
+        file->inode.size = file->position;
+        file->inode_dirty = 1;
+    }
 
-            return bytes_written;
-        }
+    return bytes_written;
+}
+
+static int do_read_h(struct fs_file *file, char *data, int length)
+{
+    struct iovec iov = {data, length};
+
+    return do_readv_h(file, &iov, 1);
+}
+
+static int do_write_h(struct fs_file *file, const char *data, int length)
+{
+    struct iovec iov = {(void *)data, length};
+
+    return do_writev_h(file, &iov, 1);
+}
+
+// Reads and writes by inumber go through a handle of their own
+static struct fs_file *open_at(struct fs_ctx *fs, int inumber, int offset)
+{
+    struct fs_file *file = fs_open(fs, inumber);
+
+    if (file && fs_seek(file, offset) < 0)
+    {
+        fs_close(file);
+        return 0;
     }
 
-    // Check if you need to create an indirect block
-    if (!block.inode[inode_offset].indirect)
+    return file;
+}
+
+static int do_readv(struct fs_ctx *fs, int inumber, const struct iovec *iov, int iovcnt, int offset)
+{
+    struct fs_file *file = open_at(fs, inumber, offset);
+
+    if (!file)
     {
-        block.inode[inode_offset].indirect = allocate_new_block(super_block.super.nblocks);
-        disk_write(block.inode[inode_offset].indirect, indirect_block.data);
+        return 0;
     }
 
-    // Traverse through all the pointers in the indirect block
-    if (pointer_offset < 5)
+    int result = do_readv_h(file, iov, iovcnt);
+    fs_close(file);
+
+    return result;
+}
+
+static int do_writev(struct fs_ctx *fs, int inumber, const struct iovec *iov, int iovcnt, int offset)
+{
+    struct fs_file *file = open_at(fs, inumber, offset);
+
+    if (!file)
     {
-        pointer_count = 0;
+        return 0;
     }
-    else
+
+    int result = do_writev_h(file, iov, iovcnt);
+    fs_close(file);
+
+    return result;
+}
+
+// The string based calls, as they have always behaved but binary safe: a
+// write replaces whatever the file held from offset on
+static int do_read(struct fs_ctx *fs, int inumber, char *data, int length, int offset)
+{
+    struct iovec iov = {data, length};
+
+    return do_readv(fs, inumber, &iov, 1, offset);
+}
+
+static int do_write(struct fs_ctx *fs, int inumber, const char *data, int length, int offset)
+{
+    struct iovec iov = {(void *)data, length};
+    struct fs_file *file = open_at(fs, inumber, offset);
+
+    if (!file)
     {
-        pointer_count = pointer_offset - 5;
+        return 0;
     }
 
-    for (int j = pointer_count; j < POINTERS_PER_BLOCK; j++)
+    int result = do_writev_h(file, &iov, 1);
+
+    if (file->position < file->inode.size)
     {
-        new_block = allocate_new_block(super_block.super.nblocks);
+        fs_truncate_h(file, file->position);
+    }
 
-        // If the disk is full, there are no more blocks left
-        if (!new_block)
-        {
-            block.inode[inode_offset].size = offset + bytes_written;
-            disk_write(block.inode[inode_offset].indirect, indirect_block.data);
+    fs_close(file);
+    return result;
+}
 
-            disk_write(block_index, block.data);
+int fs_read(struct fs_ctx *fs, int inumber, char *data, int length, int offset)
+{
+    long start = op_begin(fs, STATS_READ);
+    int result = do_read(fs, inumber, data, length, offset);
+    op_end(fs, STATS_READ, start, result);
 
-            return bytes_written;
-        }
+    return result;
+}
+
+int fs_write(struct fs_ctx *fs, int inumber, const char *data, int length, int offset)
+{
+    long start = op_begin(fs, STATS_WRITE);
+    int result = do_write(fs, inumber, data, length, offset);
+    op_end(fs, STATS_WRITE, start, result);
+
+    return result;
+}
+
+int fs_readv(struct fs_ctx *fs, int inumber, const struct iovec *iov, int iovcnt, int offset)
+{
+    long start = op_begin(fs, STATS_READ);
+    int result = do_readv(fs, inumber, iov, iovcnt, offset);
+    op_end(fs, STATS_READ, start, result);
+
+    return result;
+}
+
+int fs_writev(struct fs_ctx *fs, int inumber, const struct iovec *iov, int iovcnt, int offset)
+{
+    long start = op_begin(fs, STATS_WRITE);
+    int result = do_writev(fs, inumber, iov, iovcnt, offset);
+    op_end(fs, STATS_WRITE, start, result);
+
+    return result;
+}
+
+int fs_read_h(struct fs_file *file, char *data, int length)
+{
+    long start = op_begin(file->fs, STATS_READ);
+    int result = do_read_h(file, data, length);
+    op_end(file->fs, STATS_READ, start, result);
+
+    return result;
+}
+
+int fs_write_h(struct fs_file *file, const char *data, int length)
+{
+    long start = op_begin(file->fs, STATS_WRITE);
+    int result = do_write_h(file, data, length);
+    op_end(file->fs, STATS_WRITE, start, result);
+
+    return result;
+}
+
+int fs_seek(struct fs_file *file, int offset)
+{
+    struct fs_ctx *fs = file->fs;
+
+    if (offset < 0 || offset > (POINTERS_PER_INODE + fs->pointers_per_block) * fs->block_size)
+    {
+        return -1;
+    }
+
+    file->position = offset;
+    return offset;
+}
+
+int fs_truncate_h(struct fs_file *file, int length)
+{
+    struct fs_ctx *fs = file->fs;
+    int keep = (length + fs->block_size - 1) / fs->block_size;
+    int indirect_used = 0;
+
+    if (!writable(fs) || length < 0 || length > file->inode.size)
+    {
+        return 0;
+    }
+
+    // The rest of a block cut partway through is zeroed, so it reads back as
+    // zeroes if the file grows over it again. A block shared with a clone is
+    // copied first, as for any other write.
+    int tail = length & (fs->block_size - 1);
+    int index = length >> fs->block_shift;
 
-        indirect_block.pointers[j] = new_block;
-        disk_write(indirect_block.pointers[j], total_data);
+    if (tail && length < file->inode.size && fs_file_block(file, index, 0, 0))
+    {
+        union fs_block block;
+        int source;
+        int blocknum = fs_file_block(file, index, 1, &source);
 
-        // Write a piece of data and copy it. Recalculate how much has been read
-        if ((bytes_left - bytes_written) < DISK_BLOCK_SIZE)
+        if (!blocknum)
         {
-            bytes_written += bytes_left - bytes_written;
+            return 0;
         }
-        else
+
+        read_block(fs, STATS_DATA, source, block.data);
+        memset(block.data + tail, 0, fs->block_size - tail);
+        write_block(fs, STATS_DATA, blocknum, block.data);
+    }
+
+    // Release every block past the new end of the file
+    for (int i = keep; i < POINTERS_PER_INODE; i++)
+    {
+        if (file->inode.direct[i])
         {
-            bytes_written += DISK_BLOCK_SIZE;
+            release_block(fs, file->inode.direct[i]);
+            file->inode.direct[i] = 0;
         }
+    }
 
-        strcpy(total_data, &data[bytes_written]);
+    if (file->inode.indirect)
+    {
+        fs_file_block(file, POINTERS_PER_INODE, 0, 0);
 
-        // Check to see if too many bytes were written
-        if (bytes_written >= bytes_left)
+        for (int i = 0; i < fs->pointers_per_block; i++)
         {
-            block.inode[inode_offset].size = offset + bytes_written;
-            disk_write(block.inode[inode_offset].indirect, indirect_block.data);
-
-            disk_write(block_index, block.data);
+            if (!file->indirect.pointers[i])
+            {
+                continue;
+            }
 
-            // Iterate through pointers of indirect block
-            for (int i = 0; i < POINTERS_PER_BLOCK; i++)
+            if (i + POINTERS_PER_INODE >= keep)
             {
-                if (indirect_block.pointers[i] <= 0)
-                {
-                    continue;
-                }
+                release_block(fs, file->indirect.pointers[i]);
+                file->indirect.pointers[i] = 0;
+                file->indirect_dirty = 1;
             }
+            else
+            {
+                indirect_used = 1;
+            }
+        }
 
-            return bytes_written;
+        // Drop the indirect block once nothing in it is used
+        if (!indirect_used)
+        {
+            release_block(fs, file->inode.indirect);
+            file->inode.indirect = 0;
+            file->indirect_loaded = 0;
+            file->indirect_dirty = 0;
         }
     }
 
-    return bytes_written;
+    file->inode.size = length;
+    file->inode_dirty = 1;
+
+    if (file->position > length)
+    {
+        file->position = length;
+    }
+
+    return 1;
+}
+
+// Write back any metadata the handle changed and release it
+void fs_close(struct fs_file *file)
+{
+    struct fs_ctx *fs = file->fs;
+    union fs_block block;
+
+    if (file->indirect_dirty)
+    {
+        write_block(fs, STATS_INDIRECT, file->inode.indirect, file->indirect.data);
+    }
+
+    if (file->inode_dirty)
+    {
+        int block_index = inode_block_of(fs, file->inumber);
+
+        // Names given or taken while the file was open count on disk only
+        read_inode_block(fs, block_index, &block);
+        set_inode_links(&file->inode, inode_links(&block.inode[inode_slot(fs, file->inumber)]));
+        block.inode[inode_slot(fs, file->inumber)] = file->inode;
+        write_block(fs, STATS_INODE, block_index, block.data);
+    }
+
+    // Blocks a truncate freed go only once the inode no longer points at them
+    if (__atomic_load_n(&fs->ndiscards, __ATOMIC_ACQUIRE))
+    {
+        fs_flush_discards(fs);
+    }
+
+    free(file);
 }
\ No newline at end of file
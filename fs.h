@@ -1,15 +1,294 @@
 #ifndef FS_H
 #define FS_H
 
-void fs_debug();
-int fs_format();
-int fs_mount();
+#include <stdio.h>
+#include <sys/uio.h>
 
-int fs_create();
-int fs_delete(int inumber);
-int fs_getsize();
+struct disk;
+struct fs_ctx;
+struct fs_file;
+struct fs_stats;
 
-int fs_read(int inumber, char *data, int length, int offset);
-int fs_write(int inumber, const char *data, int length, int offset);
+struct fs_ctx *fs_ctx_init(struct disk *disk);
+void fs_ctx_free(struct fs_ctx *fs);
+struct fs_stats *fs_get_stats(struct fs_ctx *fs);
+
+void fs_debug(struct fs_ctx *fs);
+int fs_format(struct fs_ctx *fs);
+// Block size is a power of two from 4K to 64K; an inode ratio of 0 gives
+// inodes ten percent of the disk. A full format rewrites every inode block.
+int fs_format_with(struct fs_ctx *fs, int block_size, int inode_ratio, int full);
+int fs_mount(struct fs_ctx *fs);
+
+int fs_create(struct fs_ctx *fs);
+int fs_delete(struct fs_ctx *fs, int inumber);
+int fs_getsize(struct fs_ctx *fs, int inumber);
+
+// A clone is a new file sharing all of the original's data blocks. Each block
+// is copied the first time either file writes to it. Directories can't be cloned.
+int fs_clone(struct fs_ctx *fs, int inumber);
+
+// Capacity of a mounted filesystem. Slot 0 of each inode block is reserved,
+// so it isn't counted among the inodes.
+struct fs_statfs
+{
+    int block_size;
+    int total_blocks;
+    int used_blocks;
+    int free_blocks;
+    int total_inodes;
+    int used_inodes;
+    int free_inodes;
+};
+
+int fs_statfs(struct fs_ctx *fs, struct fs_statfs *buf);
+
+// Freed blocks are punched out of the image file so it only takes up space on
+// the host for blocks in use. On by default.
+void fs_set_discard(struct fs_ctx *fs, int enable);
+
+// Whether the next format gives every block a CRC32C checksum, kept in
+// checksum blocks after the inode blocks. Reads through fs_read and the
+// handles check each data block against it and stop short with errno EIO at
+// one that doesn't match. On by default; images without them still mount.
+void fs_set_checksums(struct fs_ctx *fs, int enable);
+
+// fs_write replaces whatever the file held from offset on. fs_readv and
+// fs_writev work like preadv and pwritev: a write overwrites in place and
+// only ever makes the file longer, and holes read back as zeroes. Whole
+// blocks that lie within one buffer go between it and the disk uncopied.
+// Reads stop at the end of the file and writes when the disk is full; each
+// call returns the bytes it moved.
+int fs_read(struct fs_ctx *fs, int inumber, char *data, int length, int offset);
+int fs_write(struct fs_ctx *fs, int inumber, const char *data, int length, int offset);
+int fs_readv(struct fs_ctx *fs, int inumber, const struct iovec *iov, int iovcnt, int offset);
+int fs_writev(struct fs_ctx *fs, int inumber, const struct iovec *iov, int iovcnt, int offset);
+
+// Open files cache the inode and block map between calls. Only one handle
+// should be open on an inode at a time, and its metadata reaches the disk on fs_close.
+struct fs_file *fs_open(struct fs_ctx *fs, int inumber);
+int fs_read_h(struct fs_file *file, char *data, int length);
+int fs_write_h(struct fs_file *file, const char *data, int length);
+int fs_seek(struct fs_file *file, int offset);
+int fs_truncate_h(struct fs_file *file, int length);
+void fs_close(struct fs_file *file);
+
+// Map a file's contents read-only into memory and set length to its size.
+// Runs of the file's blocks are mapped straight from the image when the disk
+// can map them, so nothing is copied and pages are read in as they are first
+// touched, or at once to check them when the disk has checksums; otherwise
+// the file is read into the mapping once. Holes read as zeroes. The view
+// keeps the file as it was: on a writable mount the blocks mapped from the
+// image are held until fs_munmap, so writes copy them first and a deleted
+// file's blocks aren't reused meanwhile, and fsck won't repair while any are
+// held. A later mount lets go of them. Returns 0 on failure, with errno EIO
+// for a block that doesn't match its checksum; an empty file maps to an
+// empty string.
+const char *fs_mmap(struct fs_ctx *fs, int inumber, long *length);
+void fs_munmap(struct fs_ctx *fs, const char *data, long length);
+
+// Read-only mount shared between processes. The first process to mount
+// builds a POSIX shared memory segment called name holding the free map, the
+// inode blocks and a cache of other blocks; later ones attach to it without
+// reading the disk, and every reader fills the cache for the others. version
+// must change whenever the image does (its modification time, say): a segment
+// built for another version is replaced. Nothing may write the image while
+// any process is attached. Attached processes write the segment's cache, so
+// it is only open to its owner: every process sharing it must run as the same
+// user, and a segment owned by anyone else, or open to others, is refused.
+#define FS_SHARED_CACHE_BYTES (16 * 1024 * 1024)
+
+struct fs_shared_info
+{
+    int built;
+    int attached;
+    long size;
+    long cache_hits;
+    long cache_misses;
+};
+
+int fs_mount_shared(struct fs_ctx *fs, const char *name, long version);
+int fs_shared_info(struct fs_ctx *fs, struct fs_shared_info *info);
+
+// Bulk copies between host files and inodes. The items are shared out to
+// nthreads workers (0 means one per CPU) that read and write their host files
+// in parallel while taking turns in the filesystem, so nothing else may use
+// the context until the copy returns. Copying in replaces an inode's contents.
+// Each item gets the bytes it moved and whether it succeeded. Items must name
+// different inodes; a list naming one twice fails before anything is copied.
+#define FS_COPY_MAX_THREADS 64
+
+struct fs_copy_item
+{
+    const char *path;
+    int inumber;
+    long bytes;
+    int result;
+};
+
+struct fs_copy_report
+{
+    int threads;
+    int files;
+    int failed;
+    long bytes;
+    double seconds;
+};
+
+int fs_copyin_many(struct fs_ctx *fs, struct fs_copy_item *items, int count, int nthreads,
+                   struct fs_copy_report *report);
+int fs_copyout_many(struct fs_ctx *fs, struct fs_copy_item *items, int count, int nthreads,
+                    struct fs_copy_report *report);
+
+// Directories map names to inumbers through a hashed index, so a lookup reads
+// the same few blocks however large the directory grows. fs_unlink only removes
+// a file's name; the inode stays until fs_delete, which fails with errno EBUSY
+// while any name still leads to the file. A file takes at most 255 names, past
+// which fs_link fails with EMLINK. A directory has just the one
+// name fs_mkdir gave it: fs_link and fs_delete refuse directories, and
+// unlinking an empty one frees it too. The root can't be unlinked. Only these
+// calls change a directory; fs_open, fs_mmap and the reads and writes by
+// inumber fail on one with errno EISDIR.
+#define FS_NAME_MAX 255
+
+// Called for each entry in turn; returning non-zero stops the walk
+typedef int (*fs_readdir_fn)(const char *name, int inumber, void *arg);
+
+int fs_root(struct fs_ctx *fs);
+int fs_isdir(struct fs_ctx *fs, int inumber);
+int fs_mkdir(struct fs_ctx *fs, int dir, const char *name);
+int fs_lookup(struct fs_ctx *fs, int dir, const char *name);
+int fs_link(struct fs_ctx *fs, int dir, const char *name, int inumber);
+int fs_unlink(struct fs_ctx *fs, int dir, const char *name);
+int fs_readdir(struct fs_ctx *fs, int dir, fs_readdir_fn fn, void *arg);
+
+// Paths are '/' separated and start from the root; "." and ".." are understood
+int fs_resolve(struct fs_ctx *fs, const char *path);
+int fs_resolve_parent(struct fs_ctx *fs, const char *path, char *name);
+
+// Copy the whole tree into FS_SNAPSHOT_DIR/<name> by cloning every file.
+// Returns the snapshot's directory. A failed snapshot is left partly built.
+#define FS_SNAPSHOT_DIR ".snapshots"
+
+int fs_snapshot(struct fs_ctx *fs, const char *name);
+
+// Consistency check of a mounted filesystem. Inode blocks are split across
+// nthreads workers (0 means one per CPU). Problems are written to log if it
+// isn't null, and with repair the bad pointers are cleared and the free map rebuilt.
+#define FS_FSCK_MAX_THREADS 64
+
+struct fs_fsck_report
+{
+    int threads;
+    int inodes;
+    int directories;
+    int blocks_in_use;
+    int range_errors;
+    int double_claims;
+    int bad_sizes;
+    int leaked;
+    int unmarked;
+    int bad_counts;
+    int repaired;
+};
+
+int fs_fsck(struct fs_ctx *fs, int nthreads, int repair, struct fs_fsck_report *report, FILE *log);
+
+// Read every block in use and check it against its checksum, split across
+// nthreads workers (0 means one per CPU) that together read no more than rate
+// bytes a second (0 for no limit). Blocks that don't match are written to log
+// if it isn't null. Returns 1 if all of them matched, 0 if any didn't, the
+// disk has no checksums or the mount is shared. Nothing else may use the
+// context meanwhile.
+#define FS_SCRUB_MAX_THREADS 64
+
+struct fs_scrub_report
+{
+    int threads;
+    long blocks;
+    long bad;
+    long bytes;
+    double seconds;
+};
+
+int fs_scrub(struct fs_ctx *fs, int nthreads, long rate, struct fs_scrub_report *report, FILE *log);
+
+// Streaming view of the inode table for tools. Each valid inode is passed to
+// the callback with its blocks as runs of consecutive block numbers in file
+// order. The runs are only valid during the call.
+struct fs_dump_run
+{
+    int start;
+    int length;
+};
+
+struct fs_dump_inode
+{
+    int inumber;
+    int type;
+    int size;
+    int nblocks;
+    int indirect;
+    int nruns;
+    const struct fs_dump_run *runs;
+};
+
+// Called for each inode in turn; returning non-zero stops the walk, as it
+// does for fs_readdir_fn
+typedef int (*fs_inode_fn)(const struct fs_dump_inode *inode, void *arg);
+
+int fs_iterate_inodes(struct fs_ctx *fs, fs_inode_fn fn, void *arg);
+
+// Totals gathered in the same walk. data_blocks counts each block once,
+// however many clones share it. Histogram bucket 0 counts zeroes and bucket i
+// counts values in [2^(i-1), 2^i).
+#define FS_DUMP_BUCKETS 32
+
+struct fs_dump_summary
+{
+    int block_size;
+    int nblocks;
+    int inode_blocks;
+    int inodes;
+    int files;
+    int directories;
+    long bytes;
+    int data_blocks;
+    int free_blocks;
+    long runs;
+    int longest_run;
+    long size_histogram[FS_DUMP_BUCKETS];
+    long run_histogram[FS_DUMP_BUCKETS];
+};
+
+int fs_dump_summary(struct fs_ctx *fs, struct fs_dump_summary *summary);
+
+// JSON is one object per inode followed by the summary. Binary is a header,
+// then per inode a record followed by its runs, ending with a record for inode 0.
+#define FS_DUMP_JSON 0
+#define FS_DUMP_BINARY 1
+#define FS_DUMP_SUMMARY 2
+
+#define FS_DUMP_MAGIC 0x504d4453
+
+struct fs_dump_header
+{
+    int magic;
+    int block_size;
+    int nblocks;
+    int inode_blocks;
+};
+
+struct fs_dump_record
+{
+    int inumber;
+    int type;
+    int size;
+    int nblocks;
+    int indirect;
+    int nruns;
+};
+
+int fs_dump(struct fs_ctx *fs, int format, FILE *file);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,382 @@
+#ifndef FS_INTERNAL_H
+#define FS_INTERNAL_H
+
+// Layout and helpers shared by the parts of the filesystem, not by its users
+
+#include "fs.h"
+#include "disk.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+
+#define FS_MAGIC 0xf0f03410
+#define POINTERS_PER_INODE 5
+
+// Blocks hold as many inodes and pointers as the block size allows; these
+// size the in-memory block, the context has the counts for the mounted disk
+#define FS_MAX_INODES_PER_BLOCK (DISK_MAX_BLOCK_SIZE / 32)
+#define FS_MAX_POINTERS_PER_BLOCK (DISK_MAX_BLOCK_SIZE / 4)
+
+// Values of fs_inode.isvalid; any non-zero value marks the inode in use
+#define FS_INODE_FILE 1
+#define FS_INODE_DIR 2
+
+// The type is in the low bits of isvalid. Above it a file counts the names
+// directories give it, and fs_delete refuses it until they are all gone;
+// a directory only ever has one. A clone carries its family in the top bits:
+// the inumber of the file the clones were first made from, folded into the
+// bits there are. Only files of one family may share blocks, which is how fsck
+// tells a clone from a cross-linked block. The original itself keeps no
+// family, so an inode without one belongs to the family named after it. A file
+// whose inumber folds to the same family joins it too, which only hides a
+// cross-link between the two.
+#define FS_INODE_TYPE_MASK 0xf
+#define FS_INODE_LINKS_SHIFT 4
+#define FS_INODE_LINKS_MAX 0xff
+#define FS_INODE_FAMILY_SHIFT 12
+#define FS_INODE_FAMILY_MAX 0xfffff
+
+// Set in fs_superblock.ext_magic once the fields after it are in use.
+// Images formatted before they existed leave that part of the block undefined.
+#define FS_EXT_MAGIC 0x45585431
+
+// Freed blocks are discarded in up to this many runs at a time
+#define FS_DISCARD_BATCH 32
+
+// The free map is split into allocation groups. Each writer thread allocates
+// through its own shard, which reserves blocks a batch at a time from one
+// group, moves to the next group with free blocks when its own runs dry, and
+// takes other shards' reservations once no group has any left.
+#define FS_ALLOC_GROUP_BLOCKS 8192
+#define FS_ALLOC_SHARDS 64
+#define FS_ALLOC_BATCH 32
+
+struct fs_alloc_shard
+{
+    pthread_mutex_t lock;
+    int group;
+    int cursor;
+    int next;
+    int nreserved;
+    int reserved[FS_ALLOC_BATCH];
+
+    // Keeps neighbouring shards off each other's cache lines
+    char pad[64];
+};
+
+struct fs_superblock
+{
+    int magic;
+    int nblocks;
+    int ninodeblocks;
+    int ninodes;
+    int ext_magic;
+    int rootdir;
+    int epoch;
+    int block_size;
+
+    // Checksum blocks follow the inode blocks, and the table they hold is
+    // only known to be complete while checksum_clean is set
+    int checksum_blocks;
+    int checksum_clean;
+};
+
+struct fs_inode
+{
+    int isvalid;
+    int size;
+    int direct[POINTERS_PER_INODE];
+    int indirect;
+};
+
+// Directories are hashed. Logical block 0 of a directory holds its header and
+// the blocks after it a table of 2^depth slots that map the low bits of a name's
+// hash to a leaf, and the leaves follow room for the largest table at the
+// image's block size. A full leaf splits on one more hash bit, doubling the table when
+// it has to; once the table is at its largest, full leaves chain to overflow leaves.
+// A lookup reads the header, one table block and the leaves on one chain.
+#define DIR_MAGIC 0x44495230
+#define DIR_MAX_DEPTH 12
+#define DIR_TABLE_START 1
+#define DIR_LEAF_HEADER (4 * sizeof(int))
+
+struct fs_dir_header
+{
+    int magic;
+    int depth;
+    int nentries;
+    int nleaves;
+    int parent;
+};
+
+// Leaf entries are packed back to back, each padded to a multiple of four bytes
+struct fs_dirent
+{
+    int inumber;
+    unsigned char namelen;
+    char name[];
+};
+
+#define DIRENT_SIZE(namelen) ((offsetof(struct fs_dirent, name) + (namelen) + 3) & ~3)
+
+struct fs_dir_leaf
+{
+    int depth;
+    int count;
+    int used;
+    int next;
+    char entries[DISK_MAX_BLOCK_SIZE - DIR_LEAF_HEADER];
+};
+
+union fs_block
+{
+    struct fs_superblock super;
+    struct fs_inode inode[FS_MAX_INODES_PER_BLOCK];
+    int pointers[FS_MAX_POINTERS_PER_BLOCK];
+    struct fs_dir_header dir;
+    struct fs_dir_leaf leaf;
+
+    // Aligned so a direct disk can read and write blocks in place
+    _Alignas(DISK_ALIGN) char data[DISK_MAX_BLOCK_SIZE];
+};
+
+// A file mapped from the image by fs_mmap holds a reference on each block it
+// mapped until fs_munmap, so writes copy the blocks first and a deleted file's
+// blocks aren't reused while the view still shows them
+struct fs_mapping
+{
+    const char *data;
+    struct fs_mapping *next;
+    int nblocks;
+    int blocks[];
+};
+
+// Everything the filesystem knows about one disk; nothing is shared between contexts
+struct fs_shared;
+
+struct fs_ctx
+{
+    struct disk *disk;
+    int mounted;
+    int readonly;
+    int *bitmap;
+    int nblocks;
+    int num_inode_blocks;
+    int rootdir;
+
+    // Where the checksum blocks are; with none, data starts at checksum_start
+    int checksum_start;
+    int checksum_blocks;
+
+    // Block geometry from the superblock; every size is a power of two
+    int block_size;
+    int block_shift;
+    int inodes_per_block;
+    int inode_shift;
+    int pointers_per_block;
+
+    int epoch;
+    int inode_hint;
+
+    // Kept in step with the free map and the inode table so fs_statfs never scans.
+    // Reserved blocks count as used until they are given back.
+    int used_blocks;
+    int used_inodes;
+
+    // Free blocks left in each allocation group, and the shards allocating from them
+    int ngroups;
+    int *group_free;
+    struct fs_alloc_shard shards[FS_ALLOC_SHARDS];
+
+    // A shared mount's segment, which also holds the free map, and whether
+    // this context built it
+    struct fs_shared *shared;
+    int shared_built;
+
+    // The CRC32C of every block as last written, and the checksum blocks
+    // changed since they were last written out, while mounted writable.
+    // Whether the next format adds checksum blocks at all.
+    uint32_t *checksums;
+    unsigned char *checksum_dirty;
+    int checksum_unclean;
+    int checksum_format;
+
+    // Runs of freed blocks waiting to be discarded from the image. Writers
+    // free blocks and refill their shards concurrently, so the queue has a
+    // lock of its own, also held while a block's last reference is dropped.
+    // ndiscards may be read without it, with acquire, to see if there's work.
+    int discard;
+    pthread_mutex_t discard_lock;
+    int ndiscards;
+    int discard_start[FS_DISCARD_BATCH];
+    int discard_count[FS_DISCARD_BATCH];
+
+    // Views from fs_mmap that hold references on their blocks
+    struct fs_mapping *mappings;
+
+    struct fs_stats stats;
+};
+
+// An open file: the decoded inode, its indirect block once it is needed, and
+// a file position. Metadata changes are written back when the file is closed.
+struct fs_file
+{
+    struct fs_ctx *fs;
+    int inumber;
+    int position;
+
+    struct fs_inode inode;
+    int inode_dirty;
+
+    union fs_block indirect;
+    int indirect_loaded;
+    int indirect_dirty;
+};
+
+int shared_read_block(struct fs_ctx *fs, int blocknum, char *data);
+void shared_detach(struct fs_ctx *fs);
+void record_checksum(struct fs_ctx *fs, int blocknum, const char *data);
+int verify_checksum(struct fs_ctx *fs, int blocknum, const char *data);
+
+// Every block access in the filesystem goes through these so it can be
+// counted by the kind of block it touches. A shared mount answers reads from
+// its segment where it can.
+static inline void read_block(struct fs_ctx *fs, int type, int blocknum, char *data)
+{
+    stats_block_io(&fs->stats, type, 0);
+
+    if (!fs->shared || !shared_read_block(fs, blocknum, data))
+    {
+        disk_read(fs->disk, blocknum, data);
+    }
+}
+
+static inline void write_block(struct fs_ctx *fs, int type, int blocknum, const char *data)
+{
+    if (fs->readonly)
+    {
+        printf("ERROR: write to block %d of a read-only mount!\n", blocknum);
+        abort();
+    }
+
+    if (fs->checksums)
+    {
+        record_checksum(fs, blocknum, data);
+    }
+
+    stats_block_io(&fs->stats, type, 1);
+    disk_write(fs->disk, blocknum, data);
+}
+
+// Operations that change the filesystem check this rather than fs->mounted
+static inline int writable(struct fs_ctx *fs)
+{
+    return fs->mounted && !fs->readonly;
+}
+
+// The first block that can hold file data
+static inline int first_data_block(struct fs_ctx *fs)
+{
+    return fs->checksum_start + fs->checksum_blocks;
+}
+
+static inline int inode_type(const struct fs_inode *inode)
+{
+    return inode->isvalid & FS_INODE_TYPE_MASK;
+}
+
+static inline int inode_links(const struct fs_inode *inode)
+{
+    return (inode->isvalid >> FS_INODE_LINKS_SHIFT) & FS_INODE_LINKS_MAX;
+}
+
+static inline void set_inode_links(struct fs_inode *inode, int links)
+{
+    inode->isvalid = (inode->isvalid & ~(FS_INODE_LINKS_MAX << FS_INODE_LINKS_SHIFT)) | links << FS_INODE_LINKS_SHIFT;
+}
+
+static inline int inode_family(const struct fs_inode *inode, int inumber)
+{
+    int family = (unsigned int)inode->isvalid >> FS_INODE_FAMILY_SHIFT;
+    return family ? family : (inumber - 1) % FS_INODE_FAMILY_MAX + 1;
+}
+
+// Inode block holding an inumber, and its slot there
+static inline int inode_block_of(struct fs_ctx *fs, int inumber)
+{
+    return (inumber >> fs->inode_shift) + 1;
+}
+
+static inline int inode_slot(struct fs_ctx *fs, int inumber)
+{
+    return inumber & (fs->inodes_per_block - 1);
+}
+
+// Slot 0 of an inode block is never handed out; its size field holds the
+// epoch the block was cleared in. Epoch 0 means the disk doesn't use them.
+static inline int inode_block_current(union fs_block *block, int epoch)
+{
+    return !epoch || block->inode[0].size == epoch;
+}
+
+// Inode blocks left over from before the last format read back as empty
+static inline void read_inode_block(struct fs_ctx *fs, int blocknum, union fs_block *block)
+{
+    read_block(fs, STATS_INODE, blocknum, block->data);
+
+    if (!inode_block_current(block, fs->epoch))
+    {
+        memset(block->data, 0, fs->block_size);
+        block->inode[0].size = fs->epoch;
+    }
+}
+
+// Public entry points are wrapped in these to time each call, record it in
+// the per-operation histograms and tag its block accesses in the disk trace
+static inline long op_begin(struct fs_ctx *fs, int op)
+{
+    disk_trace_set_op(fs->disk, op);
+    return stats_begin();
+}
+
+void fs_flush_discards(struct fs_ctx *fs);
+
+static inline void op_end(struct fs_ctx *fs, int op, long start, int bytes)
+{
+    // Blocks freed by the operation leave the image before it returns
+    if (__atomic_load_n(&fs->ndiscards, __ATOMIC_ACQUIRE))
+    {
+        fs_flush_discards(fs);
+    }
+
+    stats_end(&fs->stats, op, start, bytes);
+    disk_trace_set_op(fs->disk, DISK_TRACE_NO_OP);
+}
+
+int allocate_new_block(struct fs_ctx *fs);
+void unreserve_blocks(struct fs_ctx *fs);
+void bind_alloc_shard(int shard);
+void release_block(struct fs_ctx *fs, int blocknum);
+void share_block(struct fs_ctx *fs, int blocknum);
+int create_new_bitmap(struct fs_ctx *fs);
+int fs_set_geometry(struct fs_ctx *fs, int block_size);
+int read_superblock(struct fs_ctx *fs, union fs_block *block);
+struct fs_file *fs_open_inode(struct fs_ctx *fs, int inumber);
+int fs_file_block(struct fs_file *file, int index, int allocate, int *source);
+int fs_alloc_inode(struct fs_ctx *fs, int type);
+int fs_free_inode(struct fs_ctx *fs, int inumber);
+int fs_adjust_links(struct fs_ctx *fs, int inumber, int delta);
+void count_mapped_blocks(struct fs_ctx *fs, int *claims);
+void drop_mappings(struct fs_ctx *fs);
+int checksum_blocks_for(struct fs_ctx *fs, int nblocks);
+int checksum_blocks_of(struct fs_ctx *fs, union fs_block *super);
+void set_checksum_region(struct fs_ctx *fs, union fs_block *super);
+int load_checksums(struct fs_ctx *fs, union fs_block *super);
+int start_checksums(struct fs_ctx *fs);
+void close_checksums(struct fs_ctx *fs);
+
+#endif
\ No newline at end of file
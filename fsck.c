@@ -0,0 +1,105 @@
+
+#include "fs.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// Exit codes follow fsck(8)
+#define FSCK_OK 0
+#define FSCK_CORRECTED 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_USAGE 16
+
+static void usage(const char *name)
+{
+    printf("use: %s [-r] [-d] [-j <threads>] <diskfile>\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    struct fs_fsck_report report;
+    struct stat info;
+    int repair = 0, nthreads = 0, flags = 0;
+    int i = 1;
+
+    while (i < argc && argv[i][0] == '-')
+    {
+        if (!strcmp(argv[i], "-r"))
+        {
+            repair = 1;
+            i++;
+        }
+        else if (!strcmp(argv[i], "-d"))
+        {
+            flags |= DISK_DIRECT;
+            i++;
+        }
+        else if (!strcmp(argv[i], "-j") && i + 1 < argc && (nthreads = atoi(argv[i + 1])) > 0)
+        {
+            i += 2;
+        }
+        else
+        {
+            usage(argv[0]);
+            return FSCK_USAGE;
+        }
+    }
+
+    if (argc - i != 1)
+    {
+        usage(argv[0]);
+        return FSCK_USAGE;
+    }
+
+    // The image must already exist; its size gives the number of blocks
+    if (stat(argv[i], &info) < 0)
+    {
+        printf("couldn't open %s: %s\n", argv[i], strerror(errno));
+        return FSCK_USAGE;
+    }
+
+    struct disk *disk = disk_init_with(argv[i], info.st_size / DISK_BLOCK_SIZE, flags);
+    if (!disk)
+    {
+        printf("couldn't initialize %s: %s\n", argv[i], strerror(errno));
+        return FSCK_USAGE;
+    }
+
+    struct fs_ctx *fs = fs_ctx_init(disk);
+    if (!fs || !fs_mount(fs))
+    {
+        printf("%s doesn't hold a filesystem that can be mounted\n", argv[i]);
+        fs_ctx_free(fs);
+        disk_close(disk);
+        return FSCK_UNCORRECTED;
+    }
+
+    if (!fs_fsck(fs, nthreads, repair, &report, stdout))
+    {
+        printf("fsck failed!\n");
+        fs_ctx_free(fs);
+        disk_close(disk);
+        return FSCK_UNCORRECTED;
+    }
+
+    int errors = report.range_errors + report.double_claims + report.bad_sizes + report.leaked + report.unmarked +
+                 report.bad_counts;
+
+    printf("%s: %d inodes (%d directories), %d blocks in use, checked by %d threads\n", argv[i], report.inodes,
+           report.directories, report.blocks_in_use, report.threads);
+    printf("%d out of range, %d doubly claimed, %d bad sizes, %d leaked, %d unmarked, %d miscounted\n",
+           report.range_errors, report.double_claims, report.bad_sizes, report.leaked, report.unmarked,
+           report.bad_counts);
+
+    fs_ctx_free(fs);
+    disk_close(disk);
+
+    if (!errors)
+        return FSCK_OK;
+
+    return report.repaired ? FSCK_CORRECTED : FSCK_UNCORRECTED;
+}
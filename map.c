@@ -0,0 +1,202 @@
+
+#include "fs.h"
+#include "fs_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Length of the mapping behind a file of this size; whole blocks, so each
+// block of the file can be mapped over its own pages
+static long mapping_length(struct fs_ctx *fs, long length)
+{
+    return (length + fs->block_size - 1) & ~(long)(fs->block_size - 1);
+}
+
+// Map each run of consecutive blocks over its place in the mapping, leaving
+// holes as the zero pages already there, and list the blocks mapped in
+// record. With checksums each block is checked once it is mapped, which reads
+// it in. Returns 0 as soon as a run can't be mapped or a block doesn't match.
+static int map_runs(struct fs_file *file, char *mapping, int nblocks, struct fs_mapping *record)
+{
+    struct fs_ctx *fs = file->fs;
+
+    for (int index = 0; index < nblocks;)
+    {
+        int first = fs_file_block(file, index, 0, 0);
+        int count = 1;
+
+        if (!first)
+        {
+            index++;
+            continue;
+        }
+
+        while (index + count < nblocks && fs_file_block(file, index + count, 0, 0) == first + count)
+        {
+            count++;
+        }
+
+        char *run = mapping + ((long)index << fs->block_shift);
+
+        if (!disk_map(fs->disk, first, count, run))
+        {
+            return 0;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            if (!verify_checksum(fs, first + i, run + ((long)i << fs->block_shift)))
+            {
+                return 0;
+            }
+            record->blocks[record->nblocks++] = first + i;
+        }
+
+        index += count;
+    }
+
+    return 1;
+}
+
+static const char *do_mmap(struct fs_ctx *fs, int inumber, long *length)
+{
+    struct fs_file *file = fs_open(fs, inumber);
+    char *mapping;
+
+    *length = 0;
+    if (!file)
+    {
+        return 0;
+    }
+
+    *length = file->inode.size;
+    if (!*length)
+    {
+        fs_close(file);
+        return "";
+    }
+
+    long span = mapping_length(fs, *length);
+    int nblocks = span >> fs->block_shift;
+    struct fs_mapping *record = malloc(sizeof(struct fs_mapping) + nblocks * sizeof(int));
+
+    mapping = record ? mmap(0, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) : MAP_FAILED;
+    if (mapping == MAP_FAILED)
+    {
+        free(record);
+        fs_close(file);
+        *length = 0;
+        return 0;
+    }
+
+    record->data = mapping;
+    record->nblocks = 0;
+
+    // A disk that can't map, a run it refused or a block that doesn't match
+    // leaves a fresh anonymous mapping to read the whole file into, which
+    // checks every block again and fails at a bad one
+    if (!map_runs(file, mapping, nblocks, record))
+    {
+        record->nblocks = 0;
+
+        if (mmap(mapping, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) ==
+                MAP_FAILED ||
+            fs_read_h(file, mapping, *length) != *length)
+        {
+            munmap(mapping, span);
+            free(record);
+            fs_close(file);
+            *length = 0;
+            return 0;
+        }
+    }
+
+    mprotect(mapping, span, PROT_READ);
+    fs_close(file);
+
+    // Nothing changes the blocks of a read-only mount, and a copy is already
+    // the file as it was
+    if (!writable(fs) || !record->nblocks)
+    {
+        free(record);
+        return mapping;
+    }
+
+    for (int i = 0; i < record->nblocks; i++)
+    {
+        share_block(fs, record->blocks[i]);
+    }
+
+    record->next = fs->mappings;
+    fs->mappings = record;
+
+    return mapping;
+}
+
+const char *fs_mmap(struct fs_ctx *fs, int inumber, long *length)
+{
+    long start = op_begin(fs, STATS_READ);
+    const char *result = do_mmap(fs, inumber, length);
+    op_end(fs, STATS_READ, start, result ? *length : 0);
+
+    return result;
+}
+
+void fs_munmap(struct fs_ctx *fs, const char *data, long length)
+{
+    if (!data || length <= 0)
+    {
+        return;
+    }
+
+    munmap((void *)data, mapping_length(fs, length));
+
+    for (struct fs_mapping **link = &fs->mappings; *link; link = &(*link)->next)
+    {
+        struct fs_mapping *record = *link;
+
+        if (record->data == data)
+        {
+            for (int i = 0; i < record->nblocks; i++)
+            {
+                release_block(fs, record->blocks[i]);
+            }
+
+            *link = record->next;
+            free(record);
+            break;
+        }
+    }
+
+    if (__atomic_load_n(&fs->ndiscards, __ATOMIC_ACQUIRE))
+    {
+        fs_flush_discards(fs);
+    }
+}
+
+// Add the references mappings hold to each block's count of pointers
+void count_mapped_blocks(struct fs_ctx *fs, int *claims)
+{
+    for (struct fs_mapping *record = fs->mappings; record; record = record->next)
+    {
+        for (int i = 0; i < record->nblocks; i++)
+        {
+            claims[record->blocks[i]]++;
+        }
+    }
+}
+
+// A new free map starts without the references of any earlier mount. The
+// views themselves stay valid until they are unmapped, but no longer keep
+// their blocks.
+void drop_mappings(struct fs_ctx *fs)
+{
+    while (fs->mappings)
+    {
+        struct fs_mapping *record = fs->mappings;
+        fs->mappings = record->next;
+        free(record);
+    }
+}
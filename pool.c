@@ -0,0 +1,57 @@
+
+#include "pool.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+int pool_threads(int nthreads, int most)
+{
+    if (nthreads <= 0)
+    {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (nthreads > most)
+    {
+        nthreads = most;
+    }
+    if (nthreads < 1)
+    {
+        nthreads = 1;
+    }
+
+    return nthreads;
+}
+
+void pool_run(void *(*fn)(void *), void *workers, int count, size_t size)
+{
+    pthread_t *threads = count > 1 ? malloc(count * sizeof(pthread_t)) : 0;
+    char *started = threads ? calloc(count, 1) : 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        void *worker = (char *)workers + i * size;
+
+        if (started)
+        {
+            started[i] = pthread_create(&threads[i], 0, fn, worker) == 0;
+        }
+
+        // Fall back to running the worker on this thread
+        if (!started || !started[i])
+        {
+            fn(worker);
+        }
+    }
+
+    for (int i = 0; started && i < count; i++)
+    {
+        if (started[i])
+        {
+            pthread_join(threads[i], 0);
+        }
+    }
+
+    free(threads);
+    free(started);
+}
@@ -0,0 +1,16 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+// Worker pools for the passes that split their work across threads: fsck,
+// scrub and bulk copies. Asking for 0 threads gets one per CPU, and the
+// count is kept between 1 and most.
+int pool_threads(int nthreads, int most);
+
+// Call fn on each of count workers laid out size bytes apart, each on a
+// thread of its own when there is more than one. A worker whose thread can't
+// be started runs on the calling thread instead. Returns once all are done.
+void pool_run(void *(*fn)(void *), void *workers, int count, size_t size);
+
+#endif
@@ -0,0 +1,167 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "disk.h"
+
+// The image lives in an anonymous mapping, so untouched and discarded blocks
+// cost no memory and read back as zeroes
+struct ram_disk
+{
+    char *memory;
+    long nbytes;
+};
+
+static int ram_read(void *state, long offset, char *data, int length)
+{
+    memcpy(data, ((struct ram_disk *)state)->memory + offset, length);
+    return 1;
+}
+
+static int ram_write(void *state, long offset, const char *data, int length)
+{
+    memcpy(((struct ram_disk *)state)->memory + offset, data, length);
+    return 1;
+}
+
+// Hand the pages back; if they don't line up with the host's pages the
+// blocks are only cleared
+static int ram_discard(void *state, long offset, long length)
+{
+    struct ram_disk *ram = state;
+
+    if (madvise(ram->memory + offset, length, MADV_DONTNEED) < 0)
+    {
+        memset(ram->memory + offset, 0, length);
+    }
+
+    return 1;
+}
+
+static long ram_size(void *state)
+{
+    return ((struct ram_disk *)state)->nbytes;
+}
+
+// Pages of the mapping that are actually backed by memory
+static long ram_allocated(void *state)
+{
+    struct ram_disk *ram = state;
+    long page = sysconf(_SC_PAGESIZE);
+    long npages = (ram->nbytes + page - 1) / page;
+    unsigned char *resident = malloc(npages);
+    long count = 0;
+
+    if (!resident || mincore(ram->memory, ram->nbytes, resident) < 0)
+    {
+        free(resident);
+        return -1;
+    }
+
+    for (long i = 0; i < npages; i++)
+    {
+        count += resident[i] & 1;
+    }
+
+    free(resident);
+    return count * page;
+}
+
+static void ram_close(void *state)
+{
+    struct ram_disk *ram = state;
+
+    munmap(ram->memory, ram->nbytes);
+    free(ram);
+}
+
+static const struct disk_ops ram_ops = {"ram", ram_read, ram_write, ram_discard, ram_size, ram_allocated, 0,
+                                        ram_close};
+
+// Copy an image into memory, skipping blocks of zeroes so that a sparse
+// image stays sparse
+static int load_image(struct ram_disk *ram, const char *filename)
+{
+    char block[DISK_BLOCK_SIZE];
+    int fd = open(filename, O_RDONLY);
+    int result = 0;
+
+    if (fd < 0)
+    {
+        // A missing image is simply a new, empty disk
+        return errno == ENOENT;
+    }
+
+    for (long offset = 0; offset < ram->nbytes; offset += DISK_BLOCK_SIZE)
+    {
+        result = pread(fd, block, DISK_BLOCK_SIZE, offset);
+        if (result <= 0)
+        {
+            break;
+        }
+
+        if (block[0] || memcmp(block, block + 1, result - 1))
+        {
+            memcpy(ram->memory + offset, block, result);
+        }
+    }
+
+    close(fd);
+    return result >= 0;
+}
+
+struct disk *disk_init_ram(const char *filename, int nblocks)
+{
+    struct ram_disk *ram;
+    struct stat info;
+
+    if (nblocks <= 0)
+    {
+        if (!filename || stat(filename, &info) < 0)
+        {
+            return 0;
+        }
+        nblocks = info.st_size / DISK_BLOCK_SIZE;
+    }
+
+    ram = calloc(1, sizeof(struct ram_disk));
+    if (!ram)
+    {
+        return 0;
+    }
+
+    ram->nbytes = (long)nblocks * DISK_BLOCK_SIZE;
+    ram->memory = mmap(0, ram->nbytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ram->memory == MAP_FAILED)
+    {
+        free(ram);
+        return 0;
+    }
+
+    if (filename && !load_image(ram, filename))
+    {
+        ram_close(ram);
+        return 0;
+    }
+
+    struct disk *disk = disk_open_backend(&ram_ops, ram);
+    if (!disk)
+    {
+        ram_close(ram);
+    }
+    else if (filename && !disk_open_changes(disk, filename, 0))
+    {
+        // Changes only reach the image through disk_save, but they are
+        // recorded all the same so the map never misses one
+        disk_close(disk);
+        return 0;
+    }
+
+    return disk;
+}
@@ -0,0 +1,398 @@
+
+#include "disk.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#define POLICY_LRU 0
+#define POLICY_FIFO 1
+#define POLICY_CLOCK 2
+#define NUM_POLICIES 3
+
+static const char *policy_names[NUM_POLICIES] = {"lru", "fifo", "clock"};
+
+static struct disk_trace_header header;
+static struct disk_trace_record *records;
+static long nrecords;
+
+static int load_trace(const char *filename)
+{
+    FILE *file = fopen(filename, "r");
+    long capacity = 0;
+
+    if (!file)
+    {
+        printf("couldn't open %s: %s\n", filename, strerror(errno));
+        return 0;
+    }
+
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != DISK_TRACE_MAGIC)
+    {
+        printf("%s is not a disk trace\n", filename);
+        fclose(file);
+        return 0;
+    }
+
+    if (header.block_size < DISK_BLOCK_SIZE || header.block_size > DISK_MAX_BLOCK_SIZE ||
+        (header.block_size & (header.block_size - 1)))
+    {
+        printf("%s was recorded with unsupported %u byte blocks\n", filename, header.block_size);
+        fclose(file);
+        return 0;
+    }
+
+    while (1)
+    {
+        if (nrecords == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 4096;
+            records = realloc(records, capacity * sizeof(struct disk_trace_record));
+            if (!records)
+            {
+                printf("out of memory\n");
+                fclose(file);
+                return 0;
+            }
+        }
+
+        int result = fread(&records[nrecords], sizeof(struct disk_trace_record), capacity - nrecords, file);
+        if (result <= 0)
+            break;
+        nrecords += result;
+    }
+
+    fclose(file);
+    return 1;
+}
+
+static const char *op_name(int op)
+{
+    return op < STATS_NUM_OPS ? stats_op_name(op) : "other";
+}
+
+static void print_summary()
+{
+    long reads[STATS_NUM_OPS + 1] = {0};
+    long writes[STATS_NUM_OPS + 1] = {0};
+
+    for (long i = 0; i < nrecords; i++)
+    {
+        int op = records[i].op < STATS_NUM_OPS ? records[i].op : STATS_NUM_OPS;
+
+        if (records[i].type == DISK_TRACE_WRITE)
+            writes[op]++;
+        else
+            reads[op]++;
+    }
+
+    printf("%ld block accesses over %.3f s on a %u block disk with %u byte blocks\n", nrecords,
+           nrecords ? records[nrecords - 1].timestamp / 1e9 : 0, header.nblocks, header.block_size);
+    printf("%-10s %10s %10s\n", "operation", "reads", "writes");
+
+    for (int i = 0; i <= STATS_NUM_OPS; i++)
+    {
+        if (reads[i] || writes[i])
+        {
+            printf("%-10s %10ld %10ld\n", op_name(i), reads[i], writes[i]);
+        }
+    }
+}
+
+// Re-issue every access in the trace against a disk image as fast as possible.
+// Writes carry a filler block, so the image should be a scratch copy.
+static int replay_disk(const char *filename)
+{
+    static char data[DISK_MAX_BLOCK_SIZE];
+    struct timespec start, end;
+    struct disk *disk = disk_init(filename, header.nblocks * (header.block_size / DISK_BLOCK_SIZE));
+
+    if (!disk)
+    {
+        printf("couldn't initialize %s: %s\n", filename, strerror(errno));
+        return 0;
+    }
+
+    disk_set_block_size(disk, header.block_size);
+
+    memset(data, 0, sizeof(data));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (long i = 0; i < nrecords; i++)
+    {
+        if (records[i].type == DISK_TRACE_WRITE)
+            disk_write(disk, records[i].blocknum, data);
+        else
+            disk_read(disk, records[i].blocknum, data);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("replayed %ld block accesses in %.6f s: %.1f ops/s, %.3f MB/s\n", nrecords, seconds,
+           seconds > 0 ? nrecords / seconds : 0,
+           seconds > 0 ? nrecords * (double)header.block_size / seconds / (1024 * 1024) : 0);
+
+    disk_close(disk);
+    return 1;
+}
+
+// Simulated cache of whole blocks. Every block has a slot in the arrays below,
+// so lookups and evictions are O(1) for all three policies.
+struct cache_model
+{
+    int policy;
+    int capacity;
+    int used;
+
+    char *resident;
+
+    // LRU: doubly linked list of resident blocks, most recent at head
+    int *prev;
+    int *next;
+    int head;
+    int tail;
+
+    // FIFO and CLOCK: ring of resident blocks in insertion order
+    int *ring;
+    char *referenced;
+    int hand;
+};
+
+static void lru_unlink(struct cache_model *cache, int blocknum)
+{
+    if (cache->prev[blocknum] >= 0)
+        cache->next[cache->prev[blocknum]] = cache->next[blocknum];
+    else
+        cache->head = cache->next[blocknum];
+
+    if (cache->next[blocknum] >= 0)
+        cache->prev[cache->next[blocknum]] = cache->prev[blocknum];
+    else
+        cache->tail = cache->prev[blocknum];
+}
+
+static void lru_push(struct cache_model *cache, int blocknum)
+{
+    cache->prev[blocknum] = -1;
+    cache->next[blocknum] = cache->head;
+
+    if (cache->head >= 0)
+        cache->prev[cache->head] = blocknum;
+    else
+        cache->tail = blocknum;
+
+    cache->head = blocknum;
+}
+
+// Returns 1 on a hit; on a miss the block is brought in, evicting if full
+static int cache_access(struct cache_model *cache, int blocknum)
+{
+    if (cache->resident[blocknum])
+    {
+        if (cache->policy == POLICY_LRU)
+        {
+            lru_unlink(cache, blocknum);
+            lru_push(cache, blocknum);
+        }
+        else if (cache->policy == POLICY_CLOCK)
+        {
+            cache->referenced[blocknum] = 1;
+        }
+
+        return 1;
+    }
+
+    if (cache->policy == POLICY_LRU)
+    {
+        if (cache->used == cache->capacity)
+        {
+            int victim = cache->tail;
+            lru_unlink(cache, victim);
+            cache->resident[victim] = 0;
+            cache->used--;
+        }
+
+        lru_push(cache, blocknum);
+    }
+    else
+    {
+        int slot = cache->used;
+
+        if (cache->used == cache->capacity)
+        {
+            // CLOCK gives referenced blocks a second pass before evicting them
+            while (cache->policy == POLICY_CLOCK && cache->referenced[cache->ring[cache->hand]])
+            {
+                cache->referenced[cache->ring[cache->hand]] = 0;
+                cache->hand = (cache->hand + 1) % cache->capacity;
+            }
+
+            slot = cache->hand;
+            cache->resident[cache->ring[slot]] = 0;
+            cache->hand = (cache->hand + 1) % cache->capacity;
+            cache->used--;
+        }
+
+        cache->ring[slot] = blocknum;
+        cache->referenced[blocknum] = 0;
+    }
+
+    cache->resident[blocknum] = 1;
+    cache->used++;
+
+    return 0;
+}
+
+static int simulate(int policy, int capacity)
+{
+    struct cache_model cache;
+    long hits = 0, read_hits = 0, nreads = 0;
+    long op_reads[STATS_NUM_OPS + 1] = {0};
+    long op_hits[STATS_NUM_OPS + 1] = {0};
+    int n = header.nblocks;
+
+    memset(&cache, 0, sizeof(cache));
+    cache.policy = policy;
+    cache.capacity = capacity;
+    cache.head = -1;
+    cache.tail = -1;
+    cache.resident = calloc(n, 1);
+    cache.referenced = calloc(n, 1);
+    cache.prev = calloc(n, sizeof(int));
+    cache.next = calloc(n, sizeof(int));
+    cache.ring = calloc(capacity, sizeof(int));
+
+    if (!cache.resident || !cache.referenced || !cache.prev || !cache.next || !cache.ring)
+    {
+        printf("out of memory\n");
+        return 0;
+    }
+
+    for (long i = 0; i < nrecords; i++)
+    {
+        int blocknum = records[i].blocknum;
+        int op = records[i].op < STATS_NUM_OPS ? records[i].op : STATS_NUM_OPS;
+
+        if (blocknum < 0 || blocknum >= n)
+            continue;
+
+        // Writes go through the cache too, so a later read of the same block hits
+        int hit = cache_access(&cache, blocknum);
+        hits += hit;
+
+        if (records[i].type == DISK_TRACE_READ)
+        {
+            nreads++;
+            read_hits += hit;
+            op_reads[op]++;
+            op_hits[op] += hit;
+        }
+    }
+
+    printf("%-6s %8d %10ld %10ld %8.2f%% %8.2f%%", policy_names[policy], capacity, hits, nrecords - hits,
+           nrecords ? 100.0 * hits / nrecords : 0, nreads ? 100.0 * read_hits / nreads : 0);
+
+    for (int i = 0; i <= STATS_NUM_OPS; i++)
+    {
+        if (op_reads[i])
+        {
+            printf("  %s %.1f%%", op_name(i), 100.0 * op_hits[i] / op_reads[i]);
+        }
+    }
+    printf("\n");
+
+    free(cache.resident);
+    free(cache.referenced);
+    free(cache.prev);
+    free(cache.next);
+    free(cache.ring);
+
+    return 1;
+}
+
+static void usage(const char *name)
+{
+    printf("use: %s <tracefile> <diskfile>\n", name);
+    printf("     %s -c <blocks>[,<blocks>...] [-p lru|fifo|clock] <tracefile>\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    char *sizes = 0;
+    int policy = -1;
+    int i = 1;
+
+    while (i < argc && argv[i][0] == '-')
+    {
+        if (!strcmp(argv[i], "-c") && i + 1 < argc)
+        {
+            sizes = argv[i + 1];
+        }
+        else if (!strcmp(argv[i], "-p") && i + 1 < argc)
+        {
+            for (policy = 0; policy < NUM_POLICIES; policy++)
+            {
+                if (!strcmp(argv[i + 1], policy_names[policy]))
+                    break;
+            }
+            if (policy == NUM_POLICIES)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        i += 2;
+    }
+
+    if ((sizes && argc - i != 1) || (!sizes && argc - i != 2))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!load_trace(argv[i]))
+    {
+        return 1;
+    }
+
+    print_summary();
+
+    if (!sizes)
+    {
+        return !replay_disk(argv[i + 1]);
+    }
+
+    printf("\n%-6s %8s %10s %10s %9s %9s\n", "policy", "blocks", "hits", "misses", "hit rate", "read hits");
+
+    for (char *size = strtok(sizes, ","); size; size = strtok(0, ","))
+    {
+        int capacity = atoi(size);
+        if (capacity <= 0)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+
+        for (int p = 0; p < NUM_POLICIES; p++)
+        {
+            if (policy < 0 || policy == p)
+            {
+                simulate(p, capacity);
+            }
+        }
+    }
+
+    free(records);
+    return 0;
+}
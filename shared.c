@@ -0,0 +1,390 @@
+
+#include "fs.h"
+#include "fs_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SHARED_MAGIC 0x53484d31
+// The read-only part ends on a boundary that is a whole page on any host
+#define SHARED_PAGE 65536
+
+// How long to wait for another process to finish building a segment before
+// deciding it died trying
+#define SHARED_WAIT_MS 2000
+
+// The start of the segment, written once by the process that builds it and
+// mapped read-only by everyone afterwards. Offsets are from the start.
+struct fs_shared
+{
+    int magic;
+    int ready;
+    long version;
+    long size;
+
+    int block_size;
+    int disk_blocks;
+    int nblocks;
+    int num_inode_blocks;
+    int checksum_start;
+    int checksum_blocks;
+    int rootdir;
+    int epoch;
+    int used_blocks;
+    int used_inodes;
+
+    long bitmap_offset;
+    long table_offset;
+    long cache_offset;
+    long data_offset;
+    int cache_slots;
+};
+
+// The writable part, on pages of its own. Each cache slot has a tag whose low
+// half is the block it holds plus one and whose high half counts fills; the
+// count is odd while a process is filling the slot. A reader copies a slot
+// and keeps the copy only if the tag didn't change meanwhile.
+struct fs_shared_cache
+{
+    int attached;
+    long hits;
+    long misses;
+    unsigned long tags[];
+};
+
+static long align(long offset, long alignment)
+{
+    return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+// Inode blocks the segment holds, never more than the disk has
+static int inode_blocks_of(struct fs_ctx *fs, union fs_block *super)
+{
+    return super->super.ninodeblocks < disk_size(fs->disk) ? super->super.ninodeblocks : disk_size(fs->disk) - 1;
+}
+
+static struct fs_shared_cache *cache_of(struct fs_shared *shared)
+{
+    return (struct fs_shared_cache *)((char *)shared + shared->cache_offset);
+}
+
+int shared_read_block(struct fs_ctx *fs, int blocknum, char *data)
+{
+    struct fs_shared *shared = fs->shared;
+    struct fs_shared_cache *cache = cache_of(shared);
+
+    // The superblock is first read with the smallest block size
+    if (fs->block_size != shared->block_size)
+    {
+        return 0;
+    }
+
+    if (blocknum <= shared->num_inode_blocks)
+    {
+        memcpy(data, (char *)shared + shared->table_offset + ((long)blocknum << fs->block_shift), fs->block_size);
+        return 1;
+    }
+
+    int slot = (unsigned int)blocknum * 2654435761u % shared->cache_slots;
+    unsigned long *tag = &cache->tags[slot];
+    char *cached = (char *)shared + shared->data_offset + ((long)slot << fs->block_shift);
+    unsigned long seen = __atomic_load_n(tag, __ATOMIC_ACQUIRE);
+
+    if ((seen & 0xffffffff) == (unsigned long)blocknum + 1 && !((seen >> 32) & 1))
+    {
+        memcpy(data, cached, fs->block_size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(tag, __ATOMIC_RELAXED) == seen)
+        {
+            __atomic_fetch_add(&cache->hits, 1, __ATOMIC_RELAXED);
+            return 1;
+        }
+    }
+
+    __atomic_fetch_add(&cache->misses, 1, __ATOMIC_RELAXED);
+    disk_read(fs->disk, blocknum, data);
+
+    // Fill the slot for the others, unless someone is already at it. A process
+    // that dies mid-fill leaves the slot unused, nothing worse.
+    unsigned long filling = ((seen >> 32) + 1) << 32;
+
+    if (!((seen >> 32) & 1) &&
+        __atomic_compare_exchange_n(tag, &seen, filling, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        memcpy(cached, data, fs->block_size);
+        __atomic_store_n(tag, (filling + (1UL << 32)) | ((unsigned long)blocknum + 1), __ATOMIC_RELEASE);
+    }
+
+    return 1;
+}
+
+void shared_detach(struct fs_ctx *fs)
+{
+    if (fs->shared)
+    {
+        __atomic_fetch_sub(&cache_of(fs->shared)->attached, 1, __ATOMIC_RELAXED);
+        munmap(fs->shared, fs->shared->size);
+
+        // The free map was part of the segment
+        fs->shared = 0;
+        fs->bitmap = 0;
+        fs->readonly = 0;
+        fs->mounted = 0;
+    }
+}
+
+// Take up the mount the segment describes
+static void use_segment(struct fs_ctx *fs, struct fs_shared *shared)
+{
+    fs->shared = shared;
+    fs->bitmap = (int *)((char *)shared + shared->bitmap_offset);
+    fs->nblocks = shared->nblocks;
+    fs->num_inode_blocks = shared->num_inode_blocks;
+    fs->checksum_start = shared->checksum_start;
+    fs->checksum_blocks = shared->checksum_blocks;
+    fs->rootdir = shared->rootdir;
+    fs->epoch = shared->epoch;
+    fs->used_blocks = shared->used_blocks;
+    fs->used_inodes = shared->used_inodes;
+    fs->inode_hint = 1;
+    fs->readonly = 1;
+    fs->mounted = 1;
+
+    // Nothing is allocated from a read-only mount, nor given back
+    for (int i = 0; i < FS_ALLOC_SHARDS; i++)
+    {
+        fs->shards[i].next = fs->shards[i].nreserved = 0;
+    }
+
+    __atomic_fetch_add(&cache_of(shared)->attached, 1, __ATOMIC_RELAXED);
+}
+
+// Only the cache stays writable once the segment is built
+static struct fs_shared *map_segment(int fd, long size)
+{
+    struct fs_shared *shared = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    return shared == MAP_FAILED ? 0 : shared;
+}
+
+// Mount the disk as usual into a new segment. Returns 0 with errno EEXIST if
+// another process created the segment first. Every process attached can write
+// the segment, so only its owner may open it.
+static int build_segment(struct fs_ctx *fs, const char *name, long version, union fs_block *super)
+{
+    struct fs_shared layout;
+    struct fs_shared *shared;
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    memset(&layout, 0, sizeof(layout));
+    layout.block_size = fs->block_size;
+    layout.disk_blocks = disk_size(fs->disk);
+    layout.num_inode_blocks = inode_blocks_of(fs, super);
+    layout.cache_slots = FS_SHARED_CACHE_BYTES / fs->block_size;
+    layout.bitmap_offset = align(sizeof(struct fs_shared), 64);
+    layout.table_offset = align(layout.bitmap_offset + (long)layout.disk_blocks * sizeof(int), DISK_ALIGN);
+    layout.cache_offset = align(layout.table_offset + ((long)(layout.num_inode_blocks + 1) << fs->block_shift),
+                                SHARED_PAGE);
+    layout.data_offset = align(layout.cache_offset + sizeof(struct fs_shared_cache) +
+                                   layout.cache_slots * sizeof(unsigned long),
+                               DISK_ALIGN);
+    layout.size = layout.data_offset + ((long)layout.cache_slots << fs->block_shift);
+
+    // Pages nobody writes stay unallocated, so a mostly empty inode table is cheap
+    if (ftruncate(fd, layout.size) < 0 || !(shared = map_segment(fd, layout.size)))
+    {
+        close(fd);
+        shm_unlink(name);
+        return 0;
+    }
+    close(fd);
+
+    memcpy(shared, &layout, sizeof(layout));
+    shared->magic = SHARED_MAGIC;
+    shared->version = version;
+
+    // The free map is counted straight into the segment
+    fs->bitmap = (int *)((char *)shared + shared->bitmap_offset);
+    fs->nblocks = super->super.nblocks < disk_size(fs->disk) ? super->super.nblocks : disk_size(fs->disk);
+    fs->num_inode_blocks = shared->num_inode_blocks;
+
+    if (super->super.ext_magic == FS_EXT_MAGIC && super->super.rootdir > 0 &&
+        super->super.rootdir < super->super.ninodes)
+    {
+        fs->rootdir = super->super.rootdir;
+        fs->epoch = super->super.epoch;
+    }
+    else
+    {
+        fs->rootdir = 0;
+        fs->epoch = 0;
+    }
+
+    // Reads from the segment aren't checked against the checksums, but the
+    // free map has to know which blocks hold them
+    set_checksum_region(fs, super);
+
+    if (create_new_bitmap(fs) < 0)
+    {
+        fs->bitmap = 0;
+        munmap(shared, layout.size);
+        shm_unlink(name);
+        errno = EINVAL;
+        return 0;
+    }
+
+    // Inode blocks from before the last format are left as zeroes, which
+    // read back as blocks of no inodes just as the stale ones would
+    for (int i = 0; i <= shared->num_inode_blocks; i++)
+    {
+        char *block = (char *)shared + shared->table_offset + ((long)i << fs->block_shift);
+
+        read_block(fs, i ? STATS_INODE : STATS_SUPERBLOCK, i, block);
+        if (i && !inode_block_current((union fs_block *)block, fs->epoch))
+        {
+            memset(block, 0, fs->block_size);
+        }
+    }
+
+    shared->nblocks = fs->nblocks;
+    shared->checksum_start = fs->checksum_start;
+    shared->checksum_blocks = fs->checksum_blocks;
+    shared->rootdir = fs->rootdir;
+    shared->epoch = fs->epoch;
+    shared->used_blocks = fs->used_blocks;
+    shared->used_inodes = fs->used_inodes;
+
+    fs->bitmap = 0;
+    __atomic_store_n(&shared->ready, 1, __ATOMIC_RELEASE);
+    mprotect(shared, shared->cache_offset, PROT_READ);
+
+    use_segment(fs, shared);
+    fs->shared_built = 1;
+    return 1;
+}
+
+// Attach to a segment someone else built. Returns -1 if it is missing, or if
+// it is stale, half built or doesn't fit this disk, after removing it. A
+// segment that another user owns, or that others could write, is refused with
+// 0 and errno EACCES and left alone, since whoever can write it could forge
+// what every reader sees.
+static int attach_segment(struct fs_ctx *fs, const char *name, long version, union fs_block *super)
+{
+    struct fs_shared *shared;
+    struct stat info;
+
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    if (fstat(fd, &info) < 0 || info.st_uid != geteuid() || (info.st_mode & 077))
+    {
+        close(fd);
+        errno = EACCES;
+        return 0;
+    }
+
+    // The builder sizes the segment first thing
+    info.st_size = 0;
+    for (int waited = 0; waited < SHARED_WAIT_MS; waited++)
+    {
+        if (fstat(fd, &info) < 0 || info.st_size >= (long)sizeof(struct fs_shared))
+        {
+            break;
+        }
+        usleep(1000);
+    }
+
+    shared = info.st_size >= (long)sizeof(struct fs_shared) ? map_segment(fd, info.st_size) : 0;
+    close(fd);
+
+    if (shared)
+    {
+        for (int waited = 0; !__atomic_load_n(&shared->ready, __ATOMIC_ACQUIRE) && waited < SHARED_WAIT_MS; waited++)
+        {
+            usleep(1000);
+        }
+
+        if (__atomic_load_n(&shared->ready, __ATOMIC_ACQUIRE) && shared->magic == SHARED_MAGIC &&
+            shared->version == version && shared->size == info.st_size && shared->block_size == fs->block_size &&
+            shared->disk_blocks == disk_size(fs->disk) && shared->num_inode_blocks == inode_blocks_of(fs, super))
+        {
+            mprotect(shared, shared->cache_offset, PROT_READ);
+            use_segment(fs, shared);
+            return 1;
+        }
+
+        munmap(shared, info.st_size);
+    }
+
+    // Processes still attached keep their mapping; the next mount builds anew
+    shm_unlink(name);
+    return -1;
+}
+
+int fs_mount_shared(struct fs_ctx *fs, const char *name, long version)
+{
+    union fs_block block;
+    long start = op_begin(fs, STATS_MOUNT);
+    int result = 0;
+
+    // Whatever was mounted before is given up first
+    close_checksums(fs);
+    shared_detach(fs);
+    drop_mappings(fs);
+    free(fs->bitmap);
+    fs->bitmap = 0;
+    fs->mounted = 0;
+    fs->shared_built = 0;
+
+    // Two tries: one may lose the race to build the segment to another process
+    if (read_superblock(fs, &block))
+    {
+        for (int tries = 0; tries < 2 && !result; tries++)
+        {
+            int attached = attach_segment(fs, name, version, &block);
+
+            if (!attached)
+            {
+                break;
+            }
+            result = attached > 0 || build_segment(fs, name, version, &block);
+        }
+    }
+
+    op_end(fs, STATS_MOUNT, start, 0);
+    return result;
+}
+
+int fs_shared_info(struct fs_ctx *fs, struct fs_shared_info *info)
+{
+    memset(info, 0, sizeof(struct fs_shared_info));
+
+    if (!fs->shared)
+    {
+        return 0;
+    }
+
+    info->built = fs->shared_built;
+    info->attached = __atomic_load_n(&cache_of(fs->shared)->attached, __ATOMIC_RELAXED);
+    info->size = fs->shared->size;
+    info->cache_hits = __atomic_load_n(&cache_of(fs->shared)->hits, __ATOMIC_RELAXED);
+    info->cache_misses = __atomic_load_n(&cache_of(fs->shared)->misses, __ATOMIC_RELAXED);
+
+    return 1;
+}
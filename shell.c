@@ -1,261 +1,1035 @@
 
 #include "fs.h"
 #include "disk.h"
+#include "stats.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <sys/stat.h>
+
+// Nested 'source' commands stop at this depth
+#define MAX_SCRIPT_DEPTH 16
 
 static int do_copyin(const char *filename, int inumber);
 static int do_copyout(int inumber, const char *filename);
+static int do_copy_many(const char *manifest, int nthreads, int in);
+static int do_mount_shared();
+static int do_ls(const char *name, int inumber, void *arg);
+static int is_inumber(const char *arg);
+static int resolve_arg(const char *arg, int create);
+
+static int run_command(char *line);
+static int run_script(const char *filename);
+static int run_timed(char *line, int iterations);
+
+// The shell works on a single image for its whole lifetime
+static struct disk *disk;
+static struct fs_ctx *fs;
+
+// Set while commands come from a script, which reports the cost of each one
+static int script_depth = 0;
+
+// Image the disk was opened from; a RAM disk is written back here by save
+static const char *disk_path;
+
 
 int main(int argc, char *argv[])
 {
     char line[1024];
+    const char *name = argv[0];
+    const char *script = 0;
+    int flags = 0;
+    int ram = 0;
+
+    while (argc > 1 && argv[1][0] == '-')
+    {
+        if (!strcmp(argv[1], "-b") && argc > 2)
+        {
+            script = argv[2];
+            argv += 2;
+            argc -= 2;
+        }
+        else if (!strcmp(argv[1], "-d"))
+        {
+            flags |= DISK_DIRECT;
+            argv++;
+            argc--;
+        }
+        else if (!strcmp(argv[1], "-m"))
+        {
+            ram = 1;
+            argv++;
+            argc--;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (argc != 3)
+    {
+        printf("use: %s [-b <script>] [-d | -m] <diskfile> <nblocks>\n", name);
+        return 1;
+    }
+
+    // A RAM disk starts as a copy of the image and only changes it on save
+    disk_path = argv[1];
+    disk = ram ? disk_init_ram(argv[1], atoi(argv[2])) : disk_init_with(argv[1], atoi(argv[2]), flags);
+    if (!disk)
+    {
+        printf("couldn't initialize %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+
+    fs = fs_ctx_init(disk);
+    if (!fs)
+    {
+        printf("couldn't allocate filesystem context\n");
+        disk_close(disk);
+        return 1;
+    }
+
+    printf("opened emulated disk image %s with %d blocks (%s)\n", argv[1], disk_size(disk), disk_backend_name(disk));
+
+    if (script)
+    {
+        if (!run_script(script))
+        {
+            fs_ctx_free(fs);
+            disk_close(disk);
+            return 1;
+        }
+    }
+    else
+    {
+        while (1)
+        {
+            printf(" simplefs> ");
+            fflush(stdout);
+
+            if (!fgets(line, sizeof(line), stdin))
+                break;
+
+            if (line[0] == '\n')
+                continue;
+            line[strlen(line) - 1] = 0;
+
+            if (!run_command(line))
+                break;
+        }
+    }
+
+    printf("closing emulated disk.\n");
+    fs_ctx_free(fs);
+    disk_close(disk);
+
+    return 0;
+}
+
+// Return the rest of the line after the first count words
+static char *skip_words(char *line, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        line += strspn(line, " \t");
+        line += strcspn(line, " \t");
+    }
+
+    return line + strspn(line, " \t");
+}
+
+// Run a command the given number of times and report its wall-clock and block I/O cost
+static int run_timed(char *line, int iterations)
+{
+    char command[1024];
+    int reads = disk_read_count(disk);
+    int writes = disk_write_count(disk);
+    int result = 1;
+    double start = stats_seconds();
+
+    for (int i = 0; i < iterations && result; i++)
+    {
+        // Commands may modify the line they are given, so each run gets a fresh copy
+        strcpy(command, line);
+        result = run_command(command);
+    }
+
+    double elapsed = stats_seconds() - start;
+
+    printf("time: %.3f ms", elapsed * 1000);
+    if (iterations > 1)
+    {
+        printf(" (%d runs, %.3f ms each)", iterations, elapsed * 1000 / iterations);
+    }
+    printf(", %d block reads, %d block writes\n", disk_read_count(disk) - reads, disk_write_count(disk) - writes);
+
+    return result;
+}
+
+// Run each line of a command file without prompting. Blank lines and lines
+// starting with '#' are skipped; 'quit' or 'exit' ends the script early.
+static int run_script(const char *filename)
+{
+    FILE *file;
+    char line[1024];
+    int result = 1;
+
+    if (script_depth >= MAX_SCRIPT_DEPTH)
+    {
+        printf("scripts nested too deeply\n");
+        return 0;
+    }
+
+    file = fopen(filename, "r");
+    if (!file)
+    {
+        printf("couldn't open %s: %s\n", filename, strerror(errno));
+        return 0;
+    }
+
+    script_depth++;
+
+    while (result && fgets(line, sizeof(line), file))
+    {
+        line[strcspn(line, "\r\n")] = 0;
+
+        char *command = skip_words(line, 0);
+        if (!command[0] || command[0] == '#')
+            continue;
+
+        printf("%s\n", command);
+
+        // Every scripted command reports its cost unless it times itself
+        if (!strncmp(command, "time ", 5) || !strncmp(command, "repeat ", 7) || !strncmp(command, "source ", 7))
+        {
+            result = run_command(command);
+        }
+        else
+        {
+            result = run_timed(command, 1);
+        }
+    }
+
+    script_depth--;
+
+    // A script that can't be read to the end hasn't run
+    int failed = ferror(file);
+    fclose(file);
+
+    if (failed)
+    {
+        printf("couldn't read %s\n", filename);
+        return 0;
+    }
+    return 1;
+}
+
+static int run_command(char *line)
+{
     char cmd[1024];
     char arg1[1024];
     char arg2[1024];
     int inumber, result, args;
 
-    if (argc != 3)
-    {
-        printf("use: %s <diskfile> <nblocks>\n", argv[0]);
+    args = sscanf(line, "%s %s %s", cmd, arg1, arg2);
+    if (args <= 0)
         return 1;
+
+    if (!strcmp(cmd, "format"))
+    {
+        int block_size = DISK_BLOCK_SIZE, inode_ratio = 0, full = 0, valid = 1;
+        char *option = skip_words(line, 1);
+
+        while (*option && valid)
+        {
+            char *value = skip_words(option, 1);
+
+            if (!strncmp(option, "full", 4) && (!option[4] || option[4] == ' ' || option[4] == '\t'))
+            {
+                full = 1;
+            }
+            else if (!strncmp(option, "-b ", 3) && *value)
+            {
+                block_size = atoi(value);
+                option = value;
+            }
+            else if (!strncmp(option, "-i ", 3) && (inode_ratio = atoi(value)) > 0)
+            {
+                option = value;
+            }
+            else
+            {
+                valid = 0;
+            }
+            option = skip_words(option, 1);
+        }
+
+        if (valid)
+        {
+            if (fs_format_with(fs, block_size, inode_ratio, full))
+            {
+                printf("disk formatted.\n");
+            }
+            else
+            {
+                printf("format failed!\n");
+            }
+        }
+        else
+        {
+            printf("use: format [full] [-b <block size>] [-i <bytes per inode>]\n");
+        }
+    }
+    else if (!strcmp(cmd, "mount"))
+    {
+        if (args == 1)
+        {
+            if (fs_mount(fs))
+            {
+                printf("disk mounted.\n");
+            }
+            else
+            {
+                printf("mount failed!\n");
+            }
+        }
+        else if (args == 2 && !strcmp(arg1, "shared"))
+        {
+            do_mount_shared();
+        }
+        else
+        {
+            printf("use: mount [shared]\n");
+        }
+    }
+    else if (!strcmp(cmd, "debug"))
+    {
+        if (args == 1)
+        {
+            fs_debug(fs);
+        }
+        else
+        {
+            printf("use: debug\n");
+        }
+    }
+    else if (!strcmp(cmd, "df"))
+    {
+        struct fs_statfs info;
+
+        if (args != 1)
+        {
+            printf("use: df\n");
+        }
+        else if (fs_statfs(fs, &info))
+        {
+            printf("%-8s %10s %10s %10s %5s\n", "", "total", "used", "free", "use%");
+            printf("%-8s %10d %10d %10d %4d%%\n", "blocks", info.total_blocks, info.used_blocks, info.free_blocks,
+                   info.total_blocks ? (int)(100L * info.used_blocks / info.total_blocks) : 0);
+            printf("%-8s %10d %10d %10d %4d%%\n", "inodes", info.total_inodes, info.used_inodes, info.free_inodes,
+                   info.total_inodes ? (int)(100L * info.used_inodes / info.total_inodes) : 0);
+            printf("%d byte blocks, %ld bytes free\n", info.block_size, (long)info.free_blocks * info.block_size);
+            printf("image takes %ld bytes on the host\n", disk_allocated_bytes(disk));
+
+            struct fs_shared_info shared;
+            if (fs_shared_info(fs, &shared))
+            {
+                printf("shared read-only: %d attached, %ld cache hits, %ld misses\n", shared.attached,
+                       shared.cache_hits, shared.cache_misses);
+            }
+        }
+        else
+        {
+            printf("df failed!\n");
+        }
+    }
+    else if (!strcmp(cmd, "discard"))
+    {
+        if (args == 2 && (!strcmp(arg1, "on") || !strcmp(arg1, "off")))
+        {
+            fs_set_discard(fs, !strcmp(arg1, "on"));
+            printf("discard %s.\n", arg1);
+        }
+        else
+        {
+            printf("use: discard on | off\n");
+        }
+    }
+    else if (!strcmp(cmd, "checksums"))
+    {
+        if (args == 2 && (!strcmp(arg1, "on") || !strcmp(arg1, "off")))
+        {
+            fs_set_checksums(fs, !strcmp(arg1, "on"));
+            printf("checksums %s from the next format.\n", arg1);
+        }
+        else
+        {
+            printf("use: checksums on | off\n");
+        }
+    }
+    else if (!strcmp(cmd, "dump"))
+    {
+        int format = args == 1 || !strcmp(arg1, "json") ? FS_DUMP_JSON
+                     : !strcmp(arg1, "binary")        ? FS_DUMP_BINARY
+                     : !strcmp(arg1, "summary")       ? FS_DUMP_SUMMARY
+                                                      : -1;
+
+        // Binary output only goes to a file
+        if (format < 0 || (format == FS_DUMP_BINARY && args != 3))
+        {
+            printf("use: dump [json | summary] [file]\n");
+            printf("     dump binary <file>\n");
+        }
+        else if (args == 3)
+        {
+            FILE *file = fopen(arg2, format == FS_DUMP_BINARY ? "wb" : "w");
+            if (!file)
+            {
+                printf("couldn't open %s: %s\n", arg2, strerror(errno));
+            }
+            else
+            {
+                result = fs_dump(fs, format, file);
+                fclose(file);
+                printf(result ? "dump written to %s\n" : "dump failed!\n", arg2);
+            }
+        }
+        else if (!fs_dump(fs, format, stdout))
+        {
+            printf("dump failed!\n");
+        }
+    }
+    else if (!strcmp(cmd, "fsck"))
+    {
+        int repair = args >= 2 && !strcmp(arg1, "repair");
+        int nthreads = args == 2 + repair ? atoi(repair ? arg2 : arg1) : 0;
+        struct fs_fsck_report report;
+
+        if (args - 1 - repair > 1 || (args == 2 + repair && nthreads <= 0))
+        {
+            printf("use: fsck [repair] [threads]\n");
+        }
+        else if (fs_fsck(fs, nthreads, repair, &report, stdout))
+        {
+            int errors = report.range_errors + report.double_claims + report.bad_sizes + report.leaked +
+                         report.unmarked + report.bad_counts;
+
+            printf("%d inodes (%d directories), %d blocks in use, checked by %d threads\n", report.inodes,
+                   report.directories, report.blocks_in_use, report.threads);
+            if (errors)
+            {
+                printf("%d out of range, %d doubly claimed, %d bad sizes, %d leaked, %d unmarked, %d miscounted%s\n",
+                       report.range_errors, report.double_claims, report.bad_sizes, report.leaked, report.unmarked,
+                       report.bad_counts, report.repaired ? ": repaired" : "");
+            }
+            else
+            {
+                printf("filesystem is clean.\n");
+            }
+        }
+        else
+        {
+            printf("fsck failed!\n");
+        }
+    }
+    else if (!strcmp(cmd, "scrub"))
+    {
+        int nthreads = args >= 2 ? atoi(arg1) : 0;
+        double rate = args == 3 ? atof(arg2) : 0;
+        struct fs_scrub_report report;
+
+        if ((args >= 2 && nthreads <= 0) || (args == 3 && rate <= 0))
+        {
+            printf("use: scrub [threads] [MB/s]\n");
+        }
+        else
+        {
+            result = fs_scrub(fs, nthreads, (long)(rate * 1048576), &report, stdout);
+            if (report.threads)
+            {
+                printf("%ld blocks checked by %d threads in %.3f s (%.1f MB/s), %ld bad\n", report.blocks,
+                       report.threads, report.seconds,
+                       report.seconds > 0 ? report.bytes / report.seconds / 1048576 : 0.0, report.bad);
+            }
+            if (!result)
+            {
+                printf("scrub failed!\n");
+            }
+        }
+    }
+    else if (!strcmp(cmd, "getsize"))
+    {
+        if (args == 2)
+        {
+            inumber = resolve_arg(arg1, 0);
+            result = fs_getsize(fs, inumber);
+            if (result >= 0)
+            {
+                printf("inode %d has size %d\n", inumber, result);
+            }
+            else
+            {
+                printf("getsize failed!\n");
+            }
+        }
+        else
+        {
+            printf("use: getsize <inumber|path>\n");
+        }
+    }
+    else if (!strcmp(cmd, "create"))
+    {
+        if (args == 1)
+        {
+            inumber = fs_create(fs);
+            if (inumber > 0)
+            {
+                printf("created inode %d\n", inumber);
+            }
+            else
+            {
+                printf("create failed!\n");
+            }
+        }
+        else
+        {
+            printf("use: create\n");
+        }
+    }
+    else if (!strcmp(cmd, "delete"))
+    {
+        if (args == 2)
+        {
+            char name[FS_NAME_MAX + 1];
+            int dir = 0;
+
+            // A path loses its directory entry before the inode goes, and an
+            // empty directory goes with its entry
+            inumber = resolve_arg(arg1, 0);
+            if (inumber && !is_inumber(arg1))
+            {
+                dir = fs_resolve_parent(fs, arg1, name);
+            }
+
+            int isdir = inumber && fs_isdir(fs, inumber);
+
+            if (inumber && (!dir || fs_unlink(fs, dir, name)) && (isdir ? dir : fs_delete(fs, inumber)))
+            {
+                printf("inode %d deleted.\n", inumber);
+            }
+            else
+            {
+                printf("delete failed!\n");
+            }
+        }
+        else
+        {
+            printf("use: delete <inumber|path>\n");
+        }
+    }
+    else if (!strcmp(cmd, "cat"))
+    {
+        if (args == 2)
+        {
+            // Straight from the mapping, with no copy through a buffer of our own
+            long length;
+            const char *data = fs_mmap(fs, resolve_arg(arg1, 0), &length);
+
+            if (data)
+            {
+                fwrite(data, 1, length, stdout);
+                fs_munmap(fs, data, length);
+            }
+            else
+            {
+                printf("cat failed!\n");
+            }
+        }
+        else
+        {
+            printf("use: cat <inumber|path>\n");
+        }
     }
-
-    if (!disk_init(argv[1], atoi(argv[2])))
+    else if (!strcmp(cmd, "copyin"))
     {
-        printf("couldn't initialize %s: %s\n", argv[1], strerror(errno));
-        return 1;
+        if (args == 3)
+        {
+            inumber = resolve_arg(arg2, 1);
+            if (do_copyin(arg1, inumber))
+            {
+                printf("copied file %s to inode %d\n", arg1, inumber);
+            }
+            else
+            {
+                printf("copy failed!\n");
+            }
+        }
+        else
+        {
+            printf("use: copyin <filename> <inumber|path>\n");
+        }
     }
-
-    printf("opened emulated disk image %s with %d blocks\n", argv[1], disk_size());
-
-    while (1)
+    else if (!strcmp(cmd, "copyin-many") || !strcmp(cmd, "copyout-many"))
     {
-        printf(" simplefs> ");
-        fflush(stdout);
-
-        if (!fgets(line, sizeof(line), stdin))
-            break;
-
-        if (line[0] == '\n')
-            continue;
-        line[strlen(line) - 1] = 0;
+        int in = !strcmp(cmd, "copyin-many");
 
-        args = sscanf(line, "%s %s %s", cmd, arg1, arg2);
-        if (args == 0)
-            continue;
-
-        if (!strcmp(cmd, "format"))
+        if (args == 2 || (args == 3 && atoi(arg2) > 0))
+        {
+            if (!do_copy_many(arg1, args == 3 ? atoi(arg2) : 0, in))
+            {
+                printf("copy failed!\n");
+            }
+        }
+        else
+        {
+            printf("use: %s <manifest> [threads]\n", cmd);
+        }
+    }
+    else if (!strcmp(cmd, "copyout"))
+    {
+        if (args == 3)
         {
-            if (args == 1)
+            inumber = resolve_arg(arg1, 0);
+            if (do_copyout(inumber, arg2))
             {
-                if (fs_format())
-                {
-                    printf("disk formatted.\n");
-                }
-                else
-                {
-                    printf("format failed!\n");
-                }
+                printf("copied inode %d to file %s\n", inumber, arg2);
             }
             else
             {
-                printf("use: format\n");
+                printf("copy failed!\n");
             }
         }
-        else if (!strcmp(cmd, "mount"))
+        else
+        {
+            printf("use: copyout <inumber|path> <filename>\n");
+        }
+    }
+    else if (!strcmp(cmd, "mkdir"))
+    {
+        if (args == 2)
         {
-            if (args == 1)
+            char name[FS_NAME_MAX + 1];
+            int dir = fs_resolve_parent(fs, arg1, name);
+
+            inumber = dir ? fs_mkdir(fs, dir, name) : 0;
+            if (inumber)
             {
-                if (fs_mount())
-                {
-                    printf("disk mounted.\n");
-                }
-                else
-                {
-                    printf("mount failed!\n");
-                }
+                printf("created directory %s as inode %d\n", arg1, inumber);
             }
             else
             {
-                printf("use: mount\n");
+                printf("mkdir failed!\n");
+            }
+        }
+        else
+        {
+            printf("use: mkdir <path>\n");
+        }
+    }
+    else if (!strcmp(cmd, "ls"))
+    {
+        if (args <= 2)
+        {
+            inumber = args == 2 ? resolve_arg(arg1, 0) : fs_root(fs);
+            if (fs_readdir(fs, inumber, do_ls, 0) < 0)
+            {
+                printf("ls failed!\n");
             }
         }
-        else if (!strcmp(cmd, "debug"))
+        else
+        {
+            printf("use: ls [inumber|path]\n");
+        }
+    }
+    else if (!strcmp(cmd, "lookup"))
+    {
+        if (args == 2)
         {
-            if (args == 1)
+            inumber = fs_resolve(fs, arg1);
+            if (inumber)
             {
-                fs_debug();
+                printf("%s is inode %d\n", arg1, inumber);
             }
             else
             {
-                printf("use: debug\n");
+                printf("lookup failed!\n");
             }
         }
-        else if (!strcmp(cmd, "getsize"))
+        else
+        {
+            printf("use: lookup <path>\n");
+        }
+    }
+    else if (!strcmp(cmd, "link"))
+    {
+        if (args == 3)
         {
-            if (args == 2)
+            char name[FS_NAME_MAX + 1];
+            int dir = fs_resolve_parent(fs, arg2, name);
+
+            inumber = resolve_arg(arg1, 0);
+            if (inumber && dir && fs_link(fs, dir, name, inumber))
             {
-                inumber = atoi(arg1);
-                result = fs_getsize(inumber);
-                if (result >= 0)
-                {
-                    printf("inode %d has size %d\n", inumber, result);
-                }
-                else
-                {
-                    printf("getsize failed!\n");
-                }
+                printf("linked inode %d as %s\n", inumber, arg2);
             }
             else
             {
-                printf("use: getsize <inumber>\n");
+                printf("link failed!\n");
             }
         }
-        else if (!strcmp(cmd, "create"))
+        else
+        {
+            printf("use: link <inumber|path> <path>\n");
+        }
+    }
+    else if (!strcmp(cmd, "clone"))
+    {
+        if (args == 2 || args == 3)
         {
-            if (args == 1)
+            char name[FS_NAME_MAX + 1];
+            int dir = args == 3 ? fs_resolve_parent(fs, arg2, name) : 0;
+
+            inumber = resolve_arg(arg1, 0);
+            result = (args == 2 || dir) && inumber ? fs_clone(fs, inumber) : 0;
+
+            // Without a name the clone is only reachable by its inumber
+            if (result && args == 3 && !fs_link(fs, dir, name, result))
             {
-                inumber = fs_create();
-                if (inumber > 0)
-                {
-                    printf("created inode %d\n", inumber);
-                }
-                else
-                {
-                    printf("create failed!\n");
-                }
+                fs_delete(fs, result);
+                result = 0;
+            }
+
+            if (result)
+            {
+                printf("cloned inode %d to inode %d\n", inumber, result);
             }
             else
             {
-                printf("use: create\n");
+                printf("clone failed!\n");
             }
         }
-        else if (!strcmp(cmd, "delete"))
+        else
+        {
+            printf("use: clone <inumber|path> [path]\n");
+        }
+    }
+    else if (!strcmp(cmd, "snapshot"))
+    {
+        if (args == 2)
         {
-            if (args == 2)
+            result = fs_snapshot(fs, arg1);
+            if (result)
             {
-                inumber = atoi(arg1);
-                if (fs_delete(inumber))
-                {
-                    printf("inode %d deleted.\n", inumber);
-                }
-                else
-                {
-                    printf("delete failed!\n");
-                }
+                printf("snapshot %s/%s is inode %d\n", FS_SNAPSHOT_DIR, arg1, result);
             }
             else
             {
-                printf("use: delete <inumber>\n");
+                printf("snapshot failed!\n");
             }
         }
-        else if (!strcmp(cmd, "cat"))
+        else
+        {
+            printf("use: snapshot <name>\n");
+        }
+    }
+    else if (!strcmp(cmd, "unlink"))
+    {
+        if (args == 2)
         {
-            if (args == 2)
+            char name[FS_NAME_MAX + 1];
+            int dir = fs_resolve_parent(fs, arg1, name);
+
+            if (dir && fs_unlink(fs, dir, name))
             {
-                inumber = atoi(arg1);
-                if (!do_copyout(inumber, "/dev/stdout"))
-                {
-                    printf("cat failed!\n");
-                }
+                printf("unlinked %s\n", arg1);
             }
             else
             {
-                printf("use: cat <inumber>\n");
+                printf("unlink failed!\n");
             }
         }
-        else if (!strcmp(cmd, "copyin"))
+        else
+        {
+            printf("use: unlink <path>\n");
+        }
+    }
+    else if (!strcmp(cmd, "stats"))
+    {
+        if (args == 1)
+        {
+            stats_print(fs_get_stats(fs), stdout);
+        }
+        else if (args == 2 && !strcmp(arg1, "reset"))
+        {
+            stats_reset(fs_get_stats(fs));
+            printf("statistics reset.\n");
+        }
+        else if (args == 2 && !strcmp(arg1, "json"))
+        {
+            stats_dump_json(fs_get_stats(fs), stdout);
+        }
+        else if (args == 3 && !strcmp(arg1, "json"))
         {
-            if (args == 3)
+            FILE *file = fopen(arg2, "w");
+            if (file)
             {
-                inumber = atoi(arg2);
-                if (do_copyin(arg1, inumber))
-                {
-                    printf("copied file %s to inode %d\n", arg1, inumber);
-                }
-                else
-                {
-                    printf("copy failed!\n");
-                }
+                stats_dump_json(fs_get_stats(fs), file);
+                fclose(file);
+                printf("statistics written to %s\n", arg2);
             }
             else
             {
-                printf("use: copyin <filename> <inumber>\n");
+                printf("couldn't open %s: %s\n", arg2, strerror(errno));
             }
         }
-        else if (!strcmp(cmd, "copyout"))
+        else
+        {
+            printf("use: stats [reset | json [file]]\n");
+        }
+    }
+    else if (!strcmp(cmd, "trace"))
+    {
+        if (args == 3 && !strcmp(arg1, "start"))
         {
-            if (args == 3)
+            if (disk_trace_open(disk, arg2))
             {
-                inumber = atoi(arg1);
-                if (do_copyout(inumber, arg2))
-                {
-                    printf("copied inode %d to file %s\n", inumber, arg2);
-                }
-                else
-                {
-                    printf("copy failed!\n");
-                }
+                printf("tracing block I/O to %s\n", arg2);
             }
             else
             {
-                printf("use: copyout <inumber> <filename>\n");
+                printf("couldn't open %s: %s\n", arg2, strerror(errno));
             }
         }
-        else if (!strcmp(cmd, "help"))
+        else if (args == 2 && !strcmp(arg1, "stop"))
         {
-            printf("Commands are:\n");
-            printf("    format\n");
-            printf("    mount\n");
-            printf("    debug\n");
-            printf("    create\n");
-            printf("    delete  <inode>\n");
-            printf("    cat     <inode>\n");
-            printf("    copyin  <file> <inode>\n");
-            printf("    copyout <inode> <file>\n");
-            printf("    help\n");
-            printf("    quit\n");
-            printf("    exit\n");
+            disk_trace_close(disk);
+            printf("trace stopped.\n");
         }
-        else if (!strcmp(cmd, "quit"))
+        else
         {
-            break;
+            printf("use: trace start <file> | trace stop\n");
         }
-        else if (!strcmp(cmd, "exit"))
+    }
+    else if (!strcmp(cmd, "source"))
+    {
+        if (args == 2)
         {
-            break;
+            if (!run_script(arg1))
+            {
+                printf("source failed!\n");
+            }
+        }
+        else
+        {
+            printf("use: source <file>\n");
+        }
+    }
+    else if (!strcmp(cmd, "time"))
+    {
+        if (args >= 2)
+        {
+            return run_timed(skip_words(line, 1), 1);
         }
         else
         {
-            printf("unknown command: %s\n", cmd);
-            printf("type 'help' for a list of commands.\n");
-            result = 1;
+            printf("use: time <command>\n");
         }
     }
+    else if (!strcmp(cmd, "repeat"))
+    {
+        if (args >= 3 && atoi(arg1) > 0)
+        {
+            return run_timed(skip_words(line, 2), atoi(arg1));
+        }
+        else
+        {
+            printf("use: repeat <count> <command>\n");
+        }
+    }
+    else if (!strcmp(cmd, "save"))
+    {
+        const char *target = args == 2 ? arg1 : disk_path;
 
-    printf("closing emulated disk.\n");
-    disk_close();
+        if (args > 2)
+        {
+            printf("use: save [file]\n");
+        }
+        else if (disk_save(disk, target))
+        {
+            printf("saved disk to %s.\n", target);
+        }
+        else
+        {
+            printf("couldn't save disk to %s: %s\n", target, strerror(errno));
+        }
+    }
+    else if (!strcmp(cmd, "help"))
+    {
+        printf("Commands are:\n");
+        printf("    format  [full] [-b <block size>] [-i <bytes per inode>]\n");
+        printf("    mount   [shared]\n");
+        printf("    debug\n");
+        printf("    df\n");
+        printf("    discard on | off\n");
+        printf("    checksums on | off\n");
+        printf("    dump    [json | summary] [file] | binary <file>\n");
+        printf("    fsck    [repair] [threads]\n");
+        printf("    scrub   [threads] [MB/s]\n");
+        printf("    create\n");
+        printf("    delete  <inode|path>\n");
+        printf("    cat     <inode|path>\n");
+        printf("    copyin  <file> <inode|path>\n");
+        printf("    copyout <inode|path> <file>\n");
+        printf("    copyin-many  <manifest> [threads]\n");
+        printf("    copyout-many <manifest> [threads]\n");
+        printf("    mkdir   <path>\n");
+        printf("    ls      [inode|path]\n");
+        printf("    lookup  <path>\n");
+        printf("    link    <inode|path> <path>\n");
+        printf("    unlink  <path>\n");
+        printf("    clone   <inode|path> [path]\n");
+        printf("    snapshot <name>\n");
+        printf("    save    [file]\n");
+        printf("    stats   [reset | json [file]]\n");
+        printf("    trace   start <file> | stop\n");
+        printf("    source  <file>\n");
+        printf("    time    <command>\n");
+        printf("    repeat  <count> <command>\n");
+        printf("    help\n");
+        printf("    quit\n");
+        printf("    exit\n");
+    }
+    else if (!strcmp(cmd, "quit"))
+    {
+        return 0;
+    }
+    else if (!strcmp(cmd, "exit"))
+    {
+        return 0;
+    }
+    else
+    {
+        printf("unknown command: %s\n", cmd);
+        printf("type 'help' for a list of commands.\n");
+    }
+
+    return 1;
+}
+
+// Mount read-only through a segment named after the image file, so every shell
+// on the same image shares one; its version changes whenever the image does
+static int do_mount_shared()
+{
+    struct fs_shared_info info;
+    struct stat image;
+    char name[64];
+
+    if (!strcmp(disk_backend_name(disk), "ram"))
+    {
+        printf("a RAM disk can't be mounted shared\n");
+        return 0;
+    }
+
+    if (stat(disk_path, &image) < 0)
+    {
+        printf("couldn't stat %s: %s\n", disk_path, strerror(errno));
+        return 0;
+    }
+
+    snprintf(name, sizeof(name), "/simplefs-%lx-%lx", (unsigned long)image.st_dev, (unsigned long)image.st_ino);
+    long version = (image.st_mtim.tv_sec * 1000000000L + image.st_mtim.tv_nsec) ^ (long)image.st_size << 20;
+
+    double start = stats_seconds();
+    if (!fs_mount_shared(fs, name, version) || !fs_shared_info(fs, &info))
+    {
+        printf("shared mount failed!\n");
+        return 0;
+    }
+
+    printf("disk mounted read-only, %s /dev/shm%s (%ld bytes, %d attached) in %.0f us.\n",
+           info.built ? "built" : "attached to", name, info.size, info.attached, (stats_seconds() - start) * 1e6);
+    return 1;
+}
 
+// Arguments made only of digits are inumbers; anything else is a path
+static int is_inumber(const char *arg)
+{
+    return arg[0] && !arg[strspn(arg, "0123456789")];
+}
+
+// Inumber for a command argument, or 0. With create set, a path that doesn't
+// exist yet gets a new empty file linked under that name.
+static int resolve_arg(const char *arg, int create)
+{
+    char name[FS_NAME_MAX + 1];
+
+    if (is_inumber(arg))
+    {
+        return atoi(arg);
+    }
+
+    int inumber = fs_resolve(fs, arg);
+    if (inumber || !create)
+    {
+        return inumber;
+    }
+
+    int dir = fs_resolve_parent(fs, arg, name);
+    if (!dir)
+    {
+        return 0;
+    }
+
+    inumber = fs_create(fs);
+    if (inumber && !fs_link(fs, dir, name, inumber))
+    {
+        fs_delete(fs, inumber);
+        inumber = 0;
+    }
+
+    return inumber;
+}
+
+static int do_ls(const char *name, int inumber, void *arg)
+{
+    printf("%8d %s%s\n", inumber, name, fs_isdir(fs, inumber) ? "/" : "");
     return 0;
 }
 
 static int do_copyin(const char *filename, int inumber)
 {
     FILE *file;
+    struct fs_file *handle;
     int offset = 0, result, actual;
-    char buffer[16384];
+    char buffer[DISK_MAX_BLOCK_SIZE];
+
+    if (fs_isdir(fs, inumber))
+    {
+        printf("inode %d is a directory\n", inumber);
+        return 0;
+    }
+
+    handle = fs_open(fs, inumber);
+    if (!handle)
+    {
+        printf("couldn't open inode %d\n", inumber);
+        return 0;
+    }
 
     file = fopen(filename, "r");
     if (!file)
     {
         printf("couldn't open %s: %s\n", filename, strerror(errno));
+        fs_close(handle);
         return 0;
     }
 
+    // Replace whatever the inode held before
+    fs_truncate_h(handle, 0);
+
     while (1)
     {
         result = fread(buffer, 1, sizeof(buffer), file);
@@ -263,7 +1037,7 @@ static int do_copyin(const char *filename, int inumber)
             break;
         if (result > 0)
         {
-            actual = fs_write(inumber, buffer, result, offset);
+            actual = fs_write_h(handle, buffer, result);
             if (actual < 0)
             {
                 printf("ERROR: fs_write return invalid result %d\n", actual);
@@ -280,6 +1054,7 @@ static int do_copyin(const char *filename, int inumber)
 
     printf("%d bytes copied\n", offset);
 
+    fs_close(handle);
     fclose(file);
     return 1;
 }
@@ -287,27 +1062,149 @@ static int do_copyin(const char *filename, int inumber)
 static int do_copyout(int inumber, const char *filename)
 {
     FILE *file;
-    int offset = 0, result;
-    char buffer[16384];
+    struct fs_file *handle;
+    int offset = 0, written = 1, result;
+    int size = fs_getsize(fs, inumber);
+    char buffer[DISK_MAX_BLOCK_SIZE];
+
+    if (fs_isdir(fs, inumber))
+    {
+        printf("inode %d is a directory\n", inumber);
+        return 0;
+    }
+
+    handle = fs_open(fs, inumber);
+    if (!handle)
+    {
+        printf("couldn't open inode %d\n", inumber);
+        return 0;
+    }
 
     file = fopen(filename, "w");
     if (!file)
     {
         printf("couldn't open %s: %s\n", filename, strerror(errno));
+        fs_close(handle);
         return 0;
     }
 
-    while (1)
+    // A block that doesn't match its checksum ends the read short of the file's size
+    while (written && (result = fs_read_h(handle, buffer, sizeof(buffer))) > 0)
     {
-        result = fs_read(inumber, buffer, sizeof(buffer), offset);
-        if (result <= 0)
-            break;
-        fwrite(buffer, 1, result, file);
-        offset += result;
+        written = fwrite(buffer, 1, result, file) == result;
+        offset += written ? result : 0;
     }
 
+    fs_close(handle);
+    written = !fclose(file) && written;
+
     printf("%d bytes copied\n", offset);
 
-    fclose(file);
+    if (!written)
+    {
+        printf("couldn't write %s: %s\n", filename, strerror(errno));
+        return 0;
+    }
+    if (offset < size)
+    {
+        printf("couldn't read inode %d past byte %d\n", inumber, offset);
+        return 0;
+    }
     return 1;
 }
+
+// A manifest has one copy per line: a host file, then a tab or space, then an
+// inode or path. Paths that don't exist yet are created for copyin-many.
+// Lines that are empty or start with '#' are skipped.
+static int do_copy_many(const char *manifest, int nthreads, int in)
+{
+    struct fs_copy_report report;
+    struct fs_copy_item *items = 0;
+    char line[2048];
+    int count = 0, capacity = 0, result = 1;
+
+    FILE *file = fopen(manifest, "r");
+    if (!file)
+    {
+        printf("couldn't open %s: %s\n", manifest, strerror(errno));
+        return 0;
+    }
+
+    while (result && fgets(line, sizeof(line), file))
+    {
+        line[strcspn(line, "\r\n")] = 0;
+        if (!line[0] || line[0] == '#')
+        {
+            continue;
+        }
+
+        // Host names may hold spaces when a tab separates the two
+        char *target = strchr(line, '\t');
+        if (!target)
+        {
+            target = strchr(line, ' ');
+        }
+        if (!target)
+        {
+            printf("%s: no inode or path in \"%s\"\n", manifest, line);
+            result = 0;
+            break;
+        }
+
+        *target++ = 0;
+        target += strspn(target, " \t");
+
+        int inumber = resolve_arg(target, in);
+        if (!inumber)
+        {
+            printf("%s: couldn't find %s\n", manifest, target);
+            result = 0;
+            break;
+        }
+
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            struct fs_copy_item *grown = realloc(items, capacity * sizeof(struct fs_copy_item));
+            if (!grown)
+            {
+                printf("out of memory\n");
+                result = 0;
+                break;
+            }
+            items = grown;
+        }
+
+        items[count].path = strdup(line);
+        items[count].inumber = inumber;
+        result = items[count++].path != 0;
+    }
+
+    fclose(file);
+
+    if (result)
+    {
+        result = in ? fs_copyin_many(fs, items, count, nthreads, &report)
+                    : fs_copyout_many(fs, items, count, nthreads, &report);
+
+        for (int i = 0; i < count; i++)
+        {
+            if (!items[i].result)
+            {
+                printf("couldn't copy %s %s inode %d\n", items[i].path, in ? "to" : "from", items[i].inumber);
+            }
+        }
+
+        printf("%d files, %ld bytes copied by %d threads in %.3f s: %.1f MB/s\n", report.files - report.failed,
+               report.bytes, report.threads, report.seconds,
+               report.seconds > 0 ? report.bytes / report.seconds / (1024 * 1024) : 0);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        free((char *)items[i].path);
+    }
+    free(items);
+
+    return result;
+}
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+static const char *op_names[STATS_NUM_OPS] = {"fs_read", "fs_write", "fs_create", "fs_delete", "fs_mount", "fs_format",
+                                             "fs_lookup", "fs_link", "fs_fsck", "fs_clone", "fs_scrub"};
+static const char *block_names[STATS_NUM_BLOCK_TYPES] = {"superblock", "inode", "indirect", "data", "directory",
+                                                         "checksum"};
+
+static long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Index of the highest set bit, so each bucket covers one power of two
+static int bucket_for(long ns)
+{
+    int bucket = 0;
+
+    while (ns > 1 && bucket < STATS_BUCKETS - 1)
+    {
+        ns >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
+
+// Estimate a percentile as the upper bound of the bucket that contains it,
+// capped at the slowest call seen
+static long percentile_ns(struct stats_op *op, double p)
+{
+    long target = (long)(p * op->calls + 0.5);
+    long seen = 0;
+
+    if (target < 1)
+    {
+        target = 1;
+    }
+
+    for (int i = 0; i < STATS_BUCKETS; i++)
+    {
+        seen += op->buckets[i];
+        if (seen >= target)
+        {
+            return (2L << i) < op->max_ns ? (2L << i) : op->max_ns;
+        }
+    }
+
+    return op->max_ns;
+}
+
+long stats_begin()
+{
+    return now_ns();
+}
+
+double stats_seconds()
+{
+    return now_ns() / 1e9;
+}
+
+void stats_end(struct fs_stats *stats, int op, long start, int bytes)
+{
+    long elapsed = now_ns() - start;
+
+    stats->ops[op].calls++;
+    stats->ops[op].total_ns += elapsed;
+    stats->ops[op].buckets[bucket_for(elapsed)]++;
+
+    if (bytes > 0)
+    {
+        stats->ops[op].bytes += bytes;
+    }
+
+    if (elapsed > stats->ops[op].max_ns)
+    {
+        stats->ops[op].max_ns = elapsed;
+    }
+}
+
+void stats_block_io(struct fs_stats *stats, int type, int is_write)
+{
+    if (is_write)
+    {
+        stats->block_writes[type]++;
+    }
+    else
+    {
+        stats->block_reads[type]++;
+    }
+}
+
+const char *stats_op_name(int op)
+{
+    return op_names[op];
+}
+
+void stats_reset(struct fs_stats *stats)
+{
+    memset(stats, 0, sizeof(struct fs_stats));
+}
+
+void stats_print(struct fs_stats *stats, FILE *file)
+{
+    fprintf(file, "%-10s %10s %12s %10s %10s %10s %10s\n", "operation", "calls", "bytes",
+            "avg us", "p50 us", "p99 us", "max us");
+
+    for (int i = 0; i < STATS_NUM_OPS; i++)
+    {
+        struct stats_op *op = &stats->ops[i];
+
+        fprintf(file, "%-10s %10ld %12ld %10.1f %10.1f %10.1f %10.1f\n", op_names[i], op->calls,
+                op->bytes, op->calls ? op->total_ns / 1000.0 / op->calls : 0,
+                op->calls ? percentile_ns(op, 0.50) / 1000.0 : 0,
+                op->calls ? percentile_ns(op, 0.99) / 1000.0 : 0, op->max_ns / 1000.0);
+    }
+
+    fprintf(file, "\n%-10s %10s %12s\n", "block", "reads", "writes");
+
+    for (int i = 0; i < STATS_NUM_BLOCK_TYPES; i++)
+    {
+        fprintf(file, "%-10s %10ld %12ld\n", block_names[i], stats->block_reads[i], stats->block_writes[i]);
+    }
+
+    // Latency histograms, skipping operations that were never called
+    for (int i = 0; i < STATS_NUM_OPS; i++)
+    {
+        if (!stats->ops[i].calls)
+        {
+            continue;
+        }
+
+        fprintf(file, "\n%s latency:\n", op_names[i]);
+
+        for (int j = 0; j < STATS_BUCKETS; j++)
+        {
+            if (stats->ops[i].buckets[j])
+            {
+                fprintf(file, "    %10.3f - %10.3f us: %ld\n", (1L << j) / 1000.0, (2L << j) / 1000.0,
+                        stats->ops[i].buckets[j]);
+            }
+        }
+    }
+}
+
+void stats_dump_json(struct fs_stats *stats, FILE *file)
+{
+    fprintf(file, "{\"operations\": {");
+
+    for (int i = 0; i < STATS_NUM_OPS; i++)
+    {
+        struct stats_op *op = &stats->ops[i];
+        int first = 1;
+
+        fprintf(file, "%s\"%s\": {\"calls\": %ld, \"bytes\": %ld, \"total_ns\": %ld, \"max_ns\": %ld, "
+                      "\"p50_ns\": %ld, \"p99_ns\": %ld, \"histogram\": [",
+                i ? ", " : "", op_names[i], op->calls, op->bytes, op->total_ns, op->max_ns,
+                op->calls ? percentile_ns(op, 0.50) : 0, op->calls ? percentile_ns(op, 0.99) : 0);
+
+        // Only non-empty buckets, each with its upper bound
+        for (int j = 0; j < STATS_BUCKETS; j++)
+        {
+            if (op->buckets[j])
+            {
+                fprintf(file, "%s{\"lt_ns\": %ld, \"count\": %ld}", first ? "" : ", ", 2L << j,
+                        op->buckets[j]);
+                first = 0;
+            }
+        }
+
+        fprintf(file, "]}");
+    }
+
+    fprintf(file, "}, \"blocks\": {");
+
+    for (int i = 0; i < STATS_NUM_BLOCK_TYPES; i++)
+    {
+        fprintf(file, "%s\"%s\": {\"reads\": %ld, \"writes\": %ld}", i ? ", " : "", block_names[i],
+                stats->block_reads[i], stats->block_writes[i]);
+    }
+
+    fprintf(file, "}}\n");
+}
\ No newline at end of file
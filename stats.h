@@ -0,0 +1,61 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+// Filesystem operations that are timed
+#define STATS_READ 0
+#define STATS_WRITE 1
+#define STATS_CREATE 2
+#define STATS_DELETE 3
+#define STATS_MOUNT 4
+#define STATS_FORMAT 5
+#define STATS_LOOKUP 6
+#define STATS_LINK 7
+#define STATS_FSCK 8
+#define STATS_CLONE 9
+#define STATS_SCRUB 10
+#define STATS_NUM_OPS 11
+
+// Kinds of block the filesystem reads and writes
+#define STATS_SUPERBLOCK 0
+#define STATS_INODE 1
+#define STATS_INDIRECT 2
+#define STATS_DATA 3
+#define STATS_DIRECTORY 4
+#define STATS_CHECKSUM 5
+#define STATS_NUM_BLOCK_TYPES 6
+
+// Latency histogram buckets; bucket i counts calls taking [2^i, 2^(i+1)) ns
+#define STATS_BUCKETS 40
+
+struct stats_op
+{
+    long calls;
+    long bytes;
+    long total_ns;
+    long max_ns;
+    long buckets[STATS_BUCKETS];
+};
+
+// Counters for one filesystem context
+struct fs_stats
+{
+    struct stats_op ops[STATS_NUM_OPS];
+    long block_reads[STATS_NUM_BLOCK_TYPES];
+    long block_writes[STATS_NUM_BLOCK_TYPES];
+};
+
+long stats_begin();
+// Seconds on the same clock, for timing whole runs rather than single calls
+double stats_seconds();
+void stats_end(struct fs_stats *stats, int op, long start, int bytes);
+void stats_block_io(struct fs_stats *stats, int type, int is_write);
+
+const char *stats_op_name(int op);
+
+void stats_reset(struct fs_stats *stats);
+void stats_print(struct fs_stats *stats, FILE *file);
+void stats_dump_json(struct fs_stats *stats, FILE *file);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,1081 @@
+
+#include "fs.h"
+#include "fs_internal.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Regression checks for bugs that slipped through. Each test runs against a
+// freshly formatted and mounted filesystem on a RAM disk, so nothing touches
+// the host's storage, apart from the few that need a disk that can map its
+// blocks and move to an image file.
+#define TEST_BLOCKS 2000
+
+static struct disk *disk;
+static struct fs_ctx *fs;
+static int failures;
+
+#define CHECK(condition)                                                                                               \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if (!(condition))                                                                                              \
+        {                                                                                                              \
+            printf("    %s:%d: %s\n", __FILE__, __LINE__, #condition);                                                 \
+            failures++;                                                                                                \
+        }                                                                                                              \
+    } while (0)
+
+// Whether every byte of the file from first up to last reads back as value
+static int reads_as(int inumber, int first, int last, char value)
+{
+    char *data = malloc(last - first);
+    int result = data && fs_read(fs, inumber, data, last - first, first) == last - first;
+
+    for (int i = 0; result && i < last - first; i++)
+    {
+        result = data[i] == value;
+    }
+
+    free(data);
+    return result;
+}
+
+// A file of length bytes of value
+static int make_file(int length, char value)
+{
+    char *data = malloc(length);
+    int inumber = fs_create(fs);
+
+    if (data && inumber > 0)
+    {
+        memset(data, value, length);
+        if (fs_write(fs, inumber, data, length, 0) != length)
+        {
+            inumber = 0;
+        }
+    }
+
+    free(data);
+    return inumber;
+}
+
+// Replace the RAM disk with a fresh filesystem on an image file opened with
+// flags. The file is unlinked at once, so it goes when the disk is closed.
+static int use_image_file_with(int flags)
+{
+    char path[] = "/tmp/simplefs-test-XXXXXX";
+    int fd = mkstemp(path);
+    struct disk *image = fd >= 0 ? disk_init_with(path, TEST_BLOCKS, flags) : 0;
+
+    if (fd >= 0)
+    {
+        unlink(path);
+        close(fd);
+    }
+    if (!image)
+    {
+        return 0;
+    }
+
+    fs_ctx_free(fs);
+    disk_close(disk);
+    disk = image;
+    fs = fs_ctx_init(disk);
+
+    return fs && fs_format(fs) && fs_mount(fs);
+}
+
+static int use_image_file()
+{
+    return use_image_file_with(0);
+}
+
+// Move the test's filesystem to another disk and mount what is on it
+static int use_disk(struct disk *other)
+{
+    if (!other)
+    {
+        return 0;
+    }
+
+    fs_ctx_free(fs);
+    disk_close(disk);
+    disk = other;
+    fs = fs_ctx_init(disk);
+
+    return fs && fs_mount(fs);
+}
+
+// Each context keeps to its own disk and state, so two images can be used
+// side by side in one process
+static void test_contexts_independent()
+{
+    struct disk *other_disk = disk_init_ram(0, TEST_BLOCKS / 2);
+    struct fs_ctx *other = other_disk ? fs_ctx_init(other_disk) : 0;
+    struct fs_statfs mine, theirs;
+
+    CHECK(other && fs_format(other) && fs_mount(other));
+    if (!other || !fs_statfs(other, &theirs))
+    {
+        fs_ctx_free(other);
+        disk_close(other_disk);
+        return;
+    }
+
+    int first = make_file(8192, 'A');
+    int second = fs_create(other);
+
+    CHECK(first > 0 && second > 0);
+    CHECK(fs_write(other, second, "BBBB", 4, 0) == 4);
+    CHECK(fs_getsize(fs, first) == 8192 && fs_getsize(other, second) == 4);
+    CHECK(reads_as(first, 0, 8192, 'A'));
+
+    fs_statfs(fs, &mine);
+    fs_statfs(other, &theirs);
+    CHECK(mine.total_blocks == TEST_BLOCKS && theirs.total_blocks == TEST_BLOCKS / 2);
+    CHECK(mine.used_blocks > theirs.used_blocks);
+
+    // Deleting in one leaves the other alone
+    CHECK(fs_delete(other, second));
+    CHECK(fs_getsize(fs, first) == 8192 && reads_as(first, 0, 8192, 'A'));
+
+    fs_ctx_free(other);
+    disk_close(other_disk);
+}
+
+// Bytes cut off partway through a block must not come back when the file grows
+static void test_truncate_zeroes_tail()
+{
+    int inumber = make_file(8192, 'A');
+    int clone = fs_clone(fs, inumber);
+    struct fs_file *file = fs_open(fs, inumber);
+
+    CHECK(inumber > 0 && clone > 0 && file);
+    CHECK(fs_truncate_h(file, 100));
+    CHECK(fs_seek(file, 5000));
+    CHECK(fs_write_h(file, "B", 1) == 1);
+    fs_close(file);
+
+    CHECK(fs_getsize(fs, inumber) == 5001);
+    CHECK(reads_as(inumber, 0, 100, 'A'));
+    CHECK(reads_as(inumber, 100, 5000, 0));
+    CHECK(reads_as(inumber, 5000, 5001, 'B'));
+
+    // The clone shared the block that was cut, and keeps all of it
+    CHECK(reads_as(clone, 0, 8192, 'A'));
+}
+
+// fs_write drops the file past what it wrote, and a later write beyond the
+// new end must find zeroes in between rather than what was dropped
+static void test_write_then_writev_past_end()
+{
+    int inumber = make_file(8192, 'A');
+    char b[4] = "BBBB";
+    struct iovec iov[2] = {{b, 2}, {b + 2, 2}};
+
+    CHECK(inumber > 0);
+    CHECK(fs_write(fs, inumber, "x", 1, 10) == 1);
+    CHECK(fs_getsize(fs, inumber) == 11);
+    CHECK(fs_writev(fs, inumber, iov, 2, 20) == 4);
+
+    CHECK(fs_getsize(fs, inumber) == 24);
+    CHECK(reads_as(inumber, 0, 10, 'A'));
+    CHECK(reads_as(inumber, 10, 11, 'x'));
+    CHECK(reads_as(inumber, 11, 20, 0));
+    CHECK(reads_as(inumber, 20, 24, 'B'));
+}
+
+// Gathered writes and scattered reads move bytes as they are, NULs included,
+// however the buffers split the blocks, and whole blocks never written read
+// back as zeroes without taking space
+static void test_vectors_across_holes()
+{
+    struct fs_statfs before, after;
+    char head[5000], tail[3000], back[2 * 4096 + 8000];
+    struct iovec out[3] = {{head, sizeof(head)}, {0, 0}, {tail, sizeof(tail)}};
+    struct iovec in[3] = {{back, 100}, {back + 100, 8000}, {back + 8100, sizeof(back) - 8100}};
+    int inumber = fs_create(fs);
+
+    for (int i = 0; i < sizeof(head); i++)
+    {
+        head[i] = i % 3 ? 0 : i;
+    }
+    memset(tail, 0xff, sizeof(tail));
+
+    // Blocks 0 and 1 stay holes
+    fs_statfs(fs, &before);
+    CHECK(inumber > 0 && fs_writev(fs, inumber, out, 3, 2 * 4096) == 8000);
+    fs_statfs(fs, &after);
+    CHECK(fs_getsize(fs, inumber) == 2 * 4096 + 8000);
+    CHECK(after.used_blocks == before.used_blocks + 2);
+
+    memset(back, 'x', sizeof(back));
+    CHECK(fs_readv(fs, inumber, in, 3, 0) == 2 * 4096 + 8000);
+    CHECK(back[0] == 0 && !memcmp(back, back + 1, 2 * 4096 - 1));
+    CHECK(!memcmp(back + 2 * 4096, head, sizeof(head)));
+    CHECK(!memcmp(back + 2 * 4096 + sizeof(head), tail, sizeof(tail)));
+
+    // Reads stop at the end of the file, whatever room is left in the buffers
+    CHECK(fs_readv(fs, inumber, in, 3, 4096 + 8000) == 4096);
+}
+
+// Directories only leave through fs_unlink, and only when empty; the root
+// never does
+static void test_directories_not_deleted()
+{
+    struct fs_statfs before, after;
+    int root = fs_root(fs);
+    int dir = fs_mkdir(fs, root, "d");
+    int child = fs_create(fs);
+
+    CHECK(dir > 0 && child > 0 && fs_link(fs, dir, "f", child));
+    CHECK(!fs_delete(fs, root));
+    CHECK(!fs_delete(fs, dir));
+    CHECK(!fs_link(fs, root, "again", dir));
+    CHECK(!fs_unlink(fs, root, "d"));
+    CHECK(fs_lookup(fs, root, "d") == dir && fs_isdir(fs, dir));
+
+    // Emptied, it goes with its name
+    CHECK(fs_unlink(fs, dir, "f") && fs_delete(fs, child));
+    fs_statfs(fs, &before);
+    CHECK(fs_unlink(fs, root, "d"));
+    fs_statfs(fs, &after);
+    CHECK(!fs_lookup(fs, root, "d") && !fs_isdir(fs, dir));
+    CHECK(after.used_inodes == before.used_inodes - 1);
+
+    // The root stays a directory however it is asked to go
+    CHECK(!fs_delete(fs, root) && fs_isdir(fs, root));
+    CHECK(fs_create(fs) != root);
+}
+
+// A file goes only once no name leads to it, so a name can't outlive it
+static void test_linked_files_not_deleted()
+{
+    int root = fs_root(fs);
+    int dir = fs_mkdir(fs, root, "d");
+    int file = fs_create(fs);
+    struct fs_file *handle;
+
+    CHECK(dir > 0 && file > 0);
+    CHECK(fs_link(fs, root, "a", file) && fs_link(fs, dir, "b", file));
+
+    // A name given while the file is open survives the handle's writeback
+    handle = fs_open(fs, file);
+    CHECK(handle && fs_write_h(handle, "xxxx", 4) == 4);
+    CHECK(fs_link(fs, root, "c", file));
+    if (handle)
+    {
+        CHECK(fs_truncate_h(handle, 2));
+        fs_close(handle);
+    }
+
+    errno = 0;
+    CHECK(!fs_delete(fs, file) && errno == EBUSY);
+    CHECK(fs_unlink(fs, root, "a") && fs_unlink(fs, dir, "b"));
+    CHECK(!fs_delete(fs, file) && fs_lookup(fs, root, "c") == file);
+    CHECK(fs_getsize(fs, file) == 2 && reads_as(file, 0, 2, 'x'));
+
+    CHECK(fs_unlink(fs, root, "c") && fs_delete(fs, file));
+
+    // A free inode takes no names
+    CHECK(!fs_link(fs, root, "a", file));
+    CHECK(!fs_lookup(fs, root, "a"));
+
+    // Nor does a clone start with its original's
+    file = fs_create(fs);
+    CHECK(file > 0 && fs_link(fs, root, "a", file));
+    int clone = fs_clone(fs, file);
+    CHECK(clone > 0 && fs_delete(fs, clone));
+}
+
+// Nothing reaches a directory's blocks except the directory calls
+static void test_directories_not_written()
+{
+    int root = fs_root(fs);
+    int dir = fs_mkdir(fs, root, "d");
+    struct iovec iov = {"x", 1};
+    char data[16];
+    long length;
+
+    CHECK(dir > 0);
+
+    errno = 0;
+    CHECK(!fs_open(fs, dir) && errno == EISDIR);
+    errno = 0;
+    CHECK(fs_write(fs, dir, "garbage", 7, 0) == 0 && errno == EISDIR);
+    CHECK(fs_writev(fs, root, &iov, 1, 0) == 0);
+    CHECK(fs_read(fs, dir, data, sizeof(data), 0) == 0);
+    CHECK(!fs_mmap(fs, root, &length));
+
+    CHECK(fs_lookup(fs, root, "d") == dir && fs_isdir(fs, dir));
+    CHECK(fs_mkdir(fs, dir, "e") > 0);
+}
+
+static int count_inode(const struct fs_dump_inode *inode, void *arg)
+{
+    return ++*(int *)arg == 2;
+}
+
+static int count_inode_all(const struct fs_dump_inode *inode, void *arg)
+{
+    ++*(int *)arg;
+    return 0;
+}
+
+static int count_entry(const char *name, int inumber, void *arg)
+{
+    return ++*(int *)arg == 2;
+}
+
+static int count_all(const char *name, int inumber, void *arg)
+{
+    ++*(int *)arg;
+    return 0;
+}
+
+// A format writes a handful of blocks however many inode blocks there are,
+// and nothing from before it comes back after the next mount
+static void test_format_forgets_old_inodes()
+{
+    struct fs_fsck_report report;
+    int inodes = 0;
+    int first = make_file(8192, 'A');
+    int second = make_file(4096, 'B');
+    int inode_blocks = fs->num_inode_blocks;
+
+    CHECK(first > 0 && second > 0 && inode_blocks > 8);
+
+    // Formatting needs a context that hasn't mounted the disk
+    fs_ctx_free(fs);
+    fs = fs_ctx_init(disk);
+
+    int writes = disk_write_count(disk);
+    CHECK(fs && fs_format(fs));
+    CHECK(disk_write_count(disk) - writes < 8);
+    if (!fs || !fs_mount(fs))
+    {
+        CHECK(0);
+        return;
+    }
+
+    CHECK(fs_getsize(fs, first) < 0 && fs_getsize(fs, second) < 0);
+    CHECK(fs_iterate_inodes(fs, count_inode_all, &inodes) && inodes == 1);
+    CHECK(fs_create(fs) == first);
+    CHECK(fs_fsck(fs, 1, 0, &report, 0) && report.inodes == 2 && report.leaked == 0 && report.bad_sizes == 0);
+
+    // A full format is the old way, rewriting every inode block
+    fs_ctx_free(fs);
+    fs = fs_ctx_init(disk);
+    writes = disk_write_count(disk);
+    CHECK(fs && fs_format_with(fs, DISK_BLOCK_SIZE, 0, 1));
+    CHECK(disk_write_count(disk) - writes >= inode_blocks);
+}
+
+// Both walks go on while the callback returns 0 and stop at non-zero
+static void test_walks_stop_on_nonzero()
+{
+    int root = fs_root(fs);
+    int inodes = 0, entries = 0;
+
+    for (int i = 0; i < 4; i++)
+    {
+        char name[8];
+        int inumber = fs_create(fs);
+
+        snprintf(name, sizeof(name), "f%d", i);
+        CHECK(inumber > 0 && fs_link(fs, root, name, inumber));
+    }
+
+    CHECK(fs_iterate_inodes(fs, count_inode, &inodes));
+    CHECK(inodes == 2);
+    CHECK(fs_readdir(fs, root, count_entry, &entries) == 2);
+    CHECK(entries == 2);
+}
+
+// With the largest blocks the whole table fits in one block and a leaf holds
+// 64 KB of entries, which splitting has to cope with off the stack
+static void test_large_block_directories()
+{
+    char name[FS_NAME_MAX + 1];
+    int files[4];
+    int root, entries = 0;
+
+    fs_ctx_free(fs);
+    fs = fs_ctx_init(disk);
+    CHECK(fs && fs_format_with(fs, DISK_MAX_BLOCK_SIZE, 0, 0) && fs_mount(fs));
+    if (!fs || !fs->mounted)
+    {
+        return;
+    }
+
+    root = fs_root(fs);
+    for (int i = 0; i < 4; i++)
+    {
+        files[i] = fs_create(fs);
+    }
+
+    // Long names fill a leaf in a couple of hundred entries
+    memset(name, 'n', 200);
+    for (int i = 0; i < 1000; i++)
+    {
+        snprintf(name + 200, sizeof(name) - 200, "%d", i);
+        CHECK(fs_link(fs, root, name, files[i % 4]));
+    }
+
+    CHECK(fs_getsize(fs, root) > 3 * DISK_MAX_BLOCK_SIZE);
+    for (int i = 0; i < 1000; i++)
+    {
+        snprintf(name + 200, sizeof(name) - 200, "%d", i);
+        CHECK(fs_lookup(fs, root, name) == files[i % 4]);
+    }
+
+    CHECK(fs_readdir(fs, root, count_all, &entries) == 1000 && entries == 1000);
+}
+
+// A write through a pointer that leads off the data blocks comes up short
+// instead of landing on metadata or off the disk, and fsck still sees it
+static void test_bad_pointers_not_written()
+{
+    struct fs_fsck_report report;
+    union fs_block block;
+    char data[4096];
+    int small = make_file(8192, 'A');
+    int large = make_file(8 * 4096, 'B');
+
+    CHECK(small > 0 && large > 0);
+    memset(data, 'C', sizeof(data));
+
+    read_block(fs, STATS_INODE, inode_block_of(fs, small), block.data);
+    block.inode[inode_slot(fs, small)].direct[0] = inode_block_of(fs, small);
+    block.inode[inode_slot(fs, small)].direct[1] = disk_size(disk) + 5;
+    block.inode[inode_slot(fs, large)].indirect = disk_size(disk) + 1;
+    write_block(fs, STATS_INODE, inode_block_of(fs, small), block.data);
+
+    CHECK(fs_writev(fs, small, &(struct iovec){data, 4096}, 1, 0) == 0);
+    CHECK(fs_writev(fs, small, &(struct iovec){data, 4096}, 1, 4096) == 0);
+    CHECK(fs_writev(fs, large, &(struct iovec){data, 4096}, 1, 6 * 4096) == 0);
+    CHECK(reads_as(large, 0, 4096, 'B'));
+
+    // The inode block the first pointer led to is as it was
+    read_block(fs, STATS_INODE, inode_block_of(fs, small), block.data);
+    CHECK(block.inode[inode_slot(fs, small)].direct[0] == inode_block_of(fs, small));
+    CHECK(fs_fsck(fs, 1, 0, &report, 0) && report.range_errors == 3);
+}
+
+// Workers split the inode blocks between them, and however many there are
+// they must find the same inodes and the same problems
+static void test_fsck_threads_agree()
+{
+    struct fs_fsck_report one, many;
+
+    // Enough files to spread over several inode blocks
+    for (int i = 0; i < 3 * fs->inodes_per_block; i++)
+    {
+        CHECK(make_file(i % 3 ? 100 : 5000, 'A') > 0);
+    }
+
+    CHECK(fs_fsck(fs, 1, 0, &one, 0) && fs_fsck(fs, 4, 0, &many, 0));
+    CHECK(one.threads == 1 && many.threads == 4);
+    CHECK(one.inodes == many.inodes && one.inodes == 3 * fs->inodes_per_block + 1);
+    CHECK(one.blocks_in_use == many.blocks_in_use);
+    CHECK(many.leaked == 0 && many.unmarked == 0 && many.bad_counts == 0 && many.range_errors == 0);
+
+    // A block taken from the allocator that nothing points to
+    int leaked = allocate_new_block(fs);
+
+    CHECK(leaked > 0);
+    CHECK(fs_fsck(fs, 1, 0, &one, 0) && fs_fsck(fs, 4, 0, &many, 0));
+    CHECK(one.leaked == 1 && many.leaked == 1 && !many.repaired);
+
+    CHECK(fs_fsck(fs, 4, 1, &many, 0) && many.repaired);
+    CHECK(fs_fsck(fs, 4, 0, &many, 0) && many.leaked == 0 && !many.repaired);
+}
+
+// Either side of a clone can be written without the other seeing it, and a
+// snapshot keeps the tree as it was
+static void test_clone_copies_on_write()
+{
+    struct fs_fsck_report report;
+    int root = fs_root(fs);
+    int original = make_file(7 * 4096, 'A');
+    int clone = fs_clone(fs, original);
+
+    CHECK(original > 0 && clone > 0 && fs_link(fs, root, "f", original));
+    CHECK(fs_getsize(fs, clone) == 7 * 4096 && reads_as(clone, 0, 7 * 4096, 'A'));
+
+    // One block each way, one direct and one through the indirect block
+    CHECK(fs_writev(fs, clone, &(struct iovec){"BBBB", 4}, 1, 0) == 4);
+    CHECK(fs_writev(fs, original, &(struct iovec){"CCCC", 4}, 1, 6 * 4096) == 4);
+    CHECK(reads_as(original, 0, 6 * 4096, 'A') && reads_as(original, 6 * 4096, 6 * 4096 + 4, 'C'));
+    CHECK(reads_as(clone, 0, 4, 'B') && reads_as(clone, 4, 7 * 4096, 'A'));
+
+    int snapshot = fs_snapshot(fs, "s");
+    int copy = snapshot ? fs_lookup(fs, snapshot, "f") : 0;
+
+    CHECK(copy > 0 && copy != original);
+    CHECK(fs_write(fs, original, "DDDD", 4, 0) == 4 && fs_getsize(fs, original) == 4);
+    CHECK(fs_getsize(fs, copy) == 7 * 4096 && reads_as(copy, 0, 6 * 4096, 'A'));
+
+    // The clone's blocks outlive the original
+    CHECK(fs_unlink(fs, root, "f") && fs_delete(fs, original));
+    CHECK(reads_as(clone, 0, 4, 'B') && reads_as(clone, 4, 7 * 4096, 'A'));
+    CHECK(reads_as(copy, 6 * 4096, 6 * 4096 + 4, 'C'));
+    CHECK(fs_fsck(fs, 1, 0, &report, 0) && report.double_claims == 0 && report.bad_counts == 0);
+}
+
+// Deleting a file gives its blocks back to the host, so the image only takes
+// up space for blocks in use, and a discarded block reads back as zeroes
+static void test_delete_punches_image()
+{
+    union fs_block block;
+
+    CHECK(use_image_file());
+
+    int inumber = make_file(64 * 4096, 'A');
+
+    read_block(fs, STATS_INODE, inode_block_of(fs, inumber), block.data);
+    int blocknum = block.inode[inode_slot(fs, inumber)].direct[0];
+    long before = disk_allocated_bytes(disk);
+    int discards = disk_discard_count(disk);
+
+    CHECK(inumber > 0 && before >= 64 * 4096);
+    CHECK(fs_delete(fs, inumber));
+    fs_flush_discards(fs);
+
+    CHECK(disk_allocated_bytes(disk) <= before - 64 * 4096);
+    CHECK(disk_discard_count(disk) - discards >= 64);
+
+    disk_read(disk, blocknum, block.data);
+    CHECK(block.data[0] == 0 && !memcmp(block.data, block.data + 1, 4095));
+
+    // With discards off the blocks stay put
+    fs_set_discard(fs, 0);
+    inumber = make_file(64 * 4096, 'B');
+    before = disk_allocated_bytes(disk);
+    CHECK(inumber > 0 && fs_delete(fs, inumber));
+    CHECK(disk_allocated_bytes(disk) == before);
+}
+
+// A direct disk bounces buffers that aren't aligned through its pool, so
+// callers can hand it any buffer at any offset
+static void test_direct_disk_unaligned_buffers()
+{
+    int length = 5 * 4096 + 100;
+    char *data = malloc(length + 1);
+    char *back = malloc(length + 1);
+
+    // Hosts without O_DIRECT refuse the open; there's nothing to check there
+    if (!data || !back || !use_image_file_with(DISK_DIRECT))
+    {
+        CHECK(data && back && errno == EINVAL);
+        free(data);
+        free(back);
+        return;
+    }
+
+    for (int i = 0; i < length; i++)
+    {
+        data[i + 1] = i * 7;
+    }
+
+    int inumber = fs_create(fs);
+
+    CHECK(inumber > 0 && fs_write(fs, inumber, data + 1, length, 0) == length);
+    CHECK(fs_read(fs, inumber, back + 1, length, 0) == length && !memcmp(back + 1, data + 1, length));
+    CHECK(fs_read(fs, inumber, back + 1, 1000, 3 * 4096 - 500) == 1000);
+    CHECK(!memcmp(back + 1, data + 1 + 3 * 4096 - 500, 1000));
+
+    // What went past the page cache is on the disk for a fresh mount
+    CHECK(fs_mount(fs) && fs_read(fs, inumber, back + 1, length, 0) == length);
+    CHECK(!memcmp(back + 1, data + 1, length));
+
+    free(data);
+    free(back);
+}
+
+// A RAM disk loads its image once and only writes it back when saved
+static void test_ram_disk_saves_on_request()
+{
+    char path[] = "/tmp/simplefs-test-XXXXXX";
+    int fd = mkstemp(path);
+    int inumber = make_file(8192, 'A');
+
+    CHECK(fd >= 0 && inumber > 0);
+    if (fd < 0)
+    {
+        return;
+    }
+    close(fd);
+
+    CHECK(disk_save(disk, path));
+    CHECK(use_disk(disk_init_ram(path, 0)));
+    CHECK(disk_size(disk) == TEST_BLOCKS && reads_as(inumber, 0, 8192, 'A'));
+
+    // Dropped with the disk, as it was never saved
+    CHECK(fs_writev(fs, inumber, &(struct iovec){"BBBB", 4}, 1, 0) == 4);
+    CHECK(use_disk(disk_init_ram(path, 0)));
+    CHECK(reads_as(inumber, 0, 8192, 'A'));
+
+    CHECK(fs_writev(fs, inumber, &(struct iovec){"BBBB", 4}, 1, 0) == 4);
+    CHECK(disk_save(disk, path));
+    CHECK(use_disk(disk_init(path, TEST_BLOCKS)));
+    CHECK(reads_as(inumber, 0, 4, 'B') && reads_as(inumber, 4, 8192, 'A'));
+
+    unlink(path);
+}
+
+// A delta holds the blocks changed since a checkpoint, and applied to a copy
+// taken then it brings the copy level with the image
+static void test_delta_round_trip()
+{
+    char path[] = "/tmp/simplefs-test-XXXXXX";
+    char changes[sizeof(path) + sizeof(DISK_CHANGES_SUFFIX)];
+    union fs_block block, other;
+    struct disk_delta_header header;
+    FILE *delta = tmpfile();
+    long nblocks;
+    int fd = mkstemp(path);
+    int kept = make_file(3 * 4096, 'A');
+    int dropped = make_file(4096, 'B');
+
+    CHECK(fd >= 0 && delta && kept > 0 && dropped > 0);
+    if (fd < 0 || !delta)
+    {
+        return;
+    }
+    close(fd);
+    snprintf(changes, sizeof(changes), "%s%s", path, DISK_CHANGES_SUFFIX);
+
+    CHECK(disk_save(disk, path));
+    struct disk *copy = disk_init_ram(path, 0);
+
+    CHECK(copy && use_disk(disk_init(path, TEST_BLOCKS)));
+    CHECK(disk_open_changes(disk, path, 1));
+    int since = disk_checkpoint(disk);
+
+    CHECK(fs_writev(fs, kept, &(struct iovec){"CCCC", 4}, 1, 4096) == 4);
+    CHECK(fs_delete(fs, dropped));
+    int added = make_file(2 * 4096, 'D');
+    fs_flush_discards(fs);
+
+    CHECK(since > 0 && added > 0 && disk_delta_export(disk, since, delta, &nblocks) > since);
+    CHECK(nblocks > 0 && nblocks < TEST_BLOCKS / 10);
+
+    rewind(delta);
+    CHECK(fread(&header, sizeof(header), 1, delta) == 1 && header.since == since);
+    CHECK(copy && disk_delta_apply(copy, &header, delta, &nblocks));
+
+    for (int i = 0; copy && i < TEST_BLOCKS; i++)
+    {
+        disk_read(disk, i, block.data);
+        disk_read(copy, i, other.data);
+        if (memcmp(block.data, other.data, 4096))
+        {
+            CHECK(!"block differs after the delta");
+            break;
+        }
+    }
+
+    // The copy mounts with every change in it
+    CHECK(use_disk(copy));
+    CHECK(reads_as(kept, 0, 4096, 'A') && reads_as(kept, 4096, 4100, 'C') && reads_as(kept, 4100, 3 * 4096, 'A'));
+    CHECK(fs_getsize(fs, added) == 2 * 4096 && reads_as(added, 0, 2 * 4096, 'D'));
+
+    fclose(delta);
+    unlink(path);
+    unlink(changes);
+}
+
+// Clones may share data blocks, but two unrelated files claiming one block
+// is corruption that fsck has to find
+static void test_cross_link_detected()
+{
+    struct fs_fsck_report report;
+    union fs_block block;
+    int first = make_file(8192, 'A');
+    int second = make_file(8192, 'B');
+    int clone = fs_clone(fs, first);
+    int again = fs_clone(fs, clone);
+
+    CHECK(first > 0 && second > 0 && clone > 0 && again > 0);
+    CHECK(fs_fsck(fs, 1, 0, &report, 0));
+    CHECK(report.double_claims == 0);
+
+    // Point the second file's last block at the first file's
+    read_block(fs, STATS_INODE, inode_block_of(fs, first), block.data);
+    int shared = block.inode[inode_slot(fs, first)].direct[1];
+    read_block(fs, STATS_INODE, inode_block_of(fs, second), block.data);
+    block.inode[inode_slot(fs, second)].direct[1] = shared;
+    write_block(fs, STATS_INODE, inode_block_of(fs, second), block.data);
+
+    CHECK(fs_fsck(fs, 1, 0, &report, 0));
+    CHECK(report.double_claims == 1);
+
+    // Repair takes the block from the file outside the clones' family
+    CHECK(fs_fsck(fs, 1, 1, &report, 0));
+    CHECK(fs_fsck(fs, 1, 0, &report, 0));
+    CHECK(report.double_claims == 0 && report.bad_counts == 0);
+    CHECK(reads_as(first, 0, 8192, 'A') && reads_as(again, 0, 8192, 'A'));
+    CHECK(reads_as(second, 0, 4096, 'B') && reads_as(second, 4096, 8192, 0));
+}
+
+// A copy list naming one inode twice is refused whole, before either copy
+// opens a handle on it
+static void test_copy_refuses_duplicates()
+{
+    struct fs_copy_report report;
+    int first = make_file(100, 'A');
+    int second = make_file(100, 'B');
+    struct fs_copy_item items[3] = {{"/dev/null", first}, {"/dev/null", second}, {"/dev/null", first}};
+
+    CHECK(first > 0 && second > 0);
+    CHECK(!fs_copyin_many(fs, items, 3, 2, &report));
+    CHECK(report.files == 3 && report.failed == 3 && report.bytes == 0);
+    CHECK(!items[0].result && !items[1].result && !items[2].result);
+    CHECK(fs_getsize(fs, first) == 100 && fs_getsize(fs, second) == 100);
+    CHECK(!fs_copyout_many(fs, items, 3, 2, &report));
+
+    CHECK(fs_copyout_many(fs, items, 2, 2, &report));
+    CHECK(report.failed == 0 && report.bytes == 200);
+}
+
+// A block changed behind the filesystem's back stops reads short with EIO
+// and is found by a scrub, until the file writes it again
+static void test_reads_check_checksums()
+{
+    struct fs_scrub_report report;
+    union fs_block block;
+    char data[3 * 4096];
+    int inumber = make_file(3 * 4096, 'A');
+
+    CHECK(inumber > 0 && fs_scrub(fs, 2, 0, &report, 0) && report.bad == 0 && report.blocks > 3);
+
+    read_block(fs, STATS_INODE, inode_block_of(fs, inumber), block.data);
+    int blocknum = block.inode[inode_slot(fs, inumber)].direct[1];
+    disk_read(disk, blocknum, block.data);
+    block.data[100] ^= 1;
+    disk_write(disk, blocknum, block.data);
+
+    errno = 0;
+    CHECK(fs_read(fs, inumber, data, sizeof(data), 0) == 4096 && errno == EIO);
+    CHECK(fs_read(fs, inumber, data, 4096, 2 * 4096) == 4096);
+    CHECK(!fs_scrub(fs, 2, 0, &report, 0) && report.bad == 1);
+
+    // Writing the block whole gives it a new checksum
+    memset(data, 'B', 4096);
+    CHECK(fs_writev(fs, inumber, &(struct iovec){data, 4096}, 1, 4096) == 4096);
+    CHECK(reads_as(inumber, 0, 4096, 'A') && reads_as(inumber, 4096, 2 * 4096, 'B'));
+    CHECK(fs_scrub(fs, 2, 0, &report, 0) && report.bad == 0);
+}
+
+// Blocks mapped straight from the image are checked against their checksums
+// like any other read
+static void test_mmap_checks_checksums()
+{
+    union fs_block block;
+    long length;
+
+    CHECK(use_image_file());
+
+    int inumber = make_file(8192, 'A');
+    const char *data = fs_mmap(fs, inumber, &length);
+
+    CHECK(inumber > 0 && data && length == 8192);
+    for (int i = 0; data && i < length; i++)
+    {
+        CHECK(data[i] == 'A');
+        if (data[i] != 'A')
+            break;
+    }
+    fs_munmap(fs, data, length);
+
+    // Change the second block behind the filesystem's back
+    read_block(fs, STATS_INODE, inode_block_of(fs, inumber), block.data);
+    int blocknum = block.inode[inode_slot(fs, inumber)].direct[1];
+    disk_read(disk, blocknum, block.data);
+    block.data[0] ^= 1;
+    disk_write(disk, blocknum, block.data);
+
+    errno = 0;
+    CHECK(!fs_mmap(fs, inumber, &length));
+    CHECK(errno == EIO && length == 0);
+}
+
+// Whether every byte of a mapping is value
+static int mapped_as(const char *data, long length, char value)
+{
+    for (long i = 0; data && i < length; i++)
+    {
+        if (data[i] != value)
+        {
+            return 0;
+        }
+    }
+
+    return data != 0;
+}
+
+// A mapping keeps showing the file as it was mapped, through writes to it
+// and after it is deleted and its blocks could have gone to another file
+static void test_mmap_holds_blocks()
+{
+    struct fs_fsck_report report;
+    long length;
+
+    CHECK(use_image_file());
+
+    int inumber = make_file(8192, 'A');
+    const char *data = fs_mmap(fs, inumber, &length);
+
+    CHECK(inumber > 0 && length == 8192 && mapped_as(data, length, 'A'));
+
+    char *b = malloc(8192);
+    memset(b, 'B', 8192);
+    CHECK(fs_write(fs, inumber, b, 8192, 0) == 8192);
+    free(b);
+    CHECK(reads_as(inumber, 0, 8192, 'B') && mapped_as(data, length, 'A'));
+
+    // Fill the disk, so any block let go of would be taken
+    int others[TEST_BLOCKS / 256], nothers = 0;
+    CHECK(fs_delete(fs, inumber));
+    while (nothers < TEST_BLOCKS / 256 && (others[nothers] = make_file(256 * 4096, 'C')))
+    {
+        nothers++;
+    }
+    CHECK(nothers < TEST_BLOCKS / 256 && mapped_as(data, length, 'A'));
+
+    // The mapping's references count as pointers, and stop repairs
+    CHECK(fs_fsck(fs, 1, 0, &report, 0));
+    CHECK(report.leaked == 0 && report.bad_counts == 0);
+    CHECK(!fs_fsck(fs, 1, 1, &report, 0));
+
+    for (int i = 0; i < nothers; i++)
+    {
+        CHECK(fs_delete(fs, others[i]));
+    }
+
+    // Once unmapped, nothing is left holding the blocks
+    fs_munmap(fs, data, length);
+    CHECK(fs_fsck(fs, 1, 0, &report, 0) && report.leaked == 0 && report.bad_counts == 0);
+}
+
+// Writers that free blocks and reserve them again at once: each block a
+// writer holds must keep what it wrote, whatever the discards of blocks freed
+// by the others do
+#define CHURN_THREADS 4
+#define CHURN_HELD 8
+
+static void *churn_blocks(void *arg)
+{
+    char value = *(char *)arg;
+    union fs_block *block = malloc(sizeof(union fs_block));
+    int held[CHURN_HELD] = {0};
+    int bad = 0;
+
+    for (int i = 0; block && i < 4000 + CHURN_HELD; i++)
+    {
+        int slot = i % CHURN_HELD;
+
+        if (held[slot])
+        {
+            read_block(fs, STATS_DATA, held[slot], block->data);
+            bad += block->data[0] != value || block->data[fs->block_size - 1] != value;
+            release_block(fs, held[slot]);
+            held[slot] = 0;
+        }
+
+        if (i < 4000 && (held[slot] = allocate_new_block(fs)))
+        {
+            memset(block->data, value, fs->block_size);
+            write_block(fs, STATS_DATA, held[slot], block->data);
+        }
+    }
+
+    free(block);
+    *(char *)arg = bad ? 0 : value;
+    return 0;
+}
+
+static void test_discard_never_hits_reused_block()
+{
+    pthread_t threads[CHURN_THREADS];
+    char values[CHURN_THREADS];
+
+    for (int i = 0; i < CHURN_THREADS; i++)
+    {
+        values[i] = 'a' + i;
+        CHECK(pthread_create(&threads[i], 0, churn_blocks, &values[i]) == 0);
+    }
+
+    for (int i = 0; i < CHURN_THREADS; i++)
+    {
+        pthread_join(threads[i], 0);
+        CHECK(values[i] == 'a' + i);
+    }
+}
+
+// fs_statfs follows every change without a scan, and agrees with the count
+// a mount makes from scratch
+static void test_statfs_follows_changes()
+{
+    struct fs_statfs start, now, mounted;
+
+    CHECK(fs_statfs(fs, &start));
+    CHECK(start.used_inodes == 1 && start.used_blocks + start.free_blocks == start.total_blocks);
+
+    int small = make_file(3 * 4096, 'A');
+    fs_statfs(fs, &now);
+    CHECK(now.used_inodes == start.used_inodes + 1 && now.used_blocks == start.used_blocks + 3);
+
+    // Seven blocks take the indirect block too
+    int large = make_file(7 * 4096, 'B');
+    fs_statfs(fs, &now);
+    CHECK(now.used_inodes == start.used_inodes + 2 && now.used_blocks == start.used_blocks + 11);
+
+    // A clone shares its data blocks until it writes one, but needs an
+    // indirect block of its own
+    int clone = fs_clone(fs, large);
+    fs_statfs(fs, &now);
+    CHECK(clone > 0 && now.used_inodes == start.used_inodes + 3 && now.used_blocks == start.used_blocks + 12);
+    CHECK(fs_writev(fs, clone, &(struct iovec){"C", 1}, 1, 0) == 1);
+    fs_statfs(fs, &now);
+    CHECK(now.used_blocks == start.used_blocks + 13);
+
+    CHECK(small > 0 && fs_delete(fs, small));
+    fs_statfs(fs, &now);
+    CHECK(now.used_inodes == start.used_inodes + 2 && now.used_blocks == start.used_blocks + 10);
+    CHECK(now.free_blocks == now.total_blocks - now.used_blocks && now.free_inodes == now.total_inodes - now.used_inodes);
+
+    CHECK(fs_mount(fs) && fs_statfs(fs, &mounted));
+    CHECK(mounted.used_blocks == now.used_blocks && mounted.used_inodes == now.used_inodes);
+}
+
+// The dump's totals agree with the counters fs_statfs keeps
+static int summary_matches_statfs()
+{
+    struct fs_dump_summary summary;
+    struct fs_statfs statfs;
+
+    return fs_dump_summary(fs, &summary) && fs_statfs(fs, &statfs) && summary.free_blocks == statfs.free_blocks;
+}
+
+static void test_dump_summary_counts()
+{
+    CHECK(summary_matches_statfs());
+    CHECK(make_file(3 * 4096, 'A') > 0);
+    CHECK(make_file(40 * 4096, 'B') > 0);
+    CHECK(summary_matches_statfs());
+}
+
+// Blocks shared by clones are used once, however many files point at them
+static void test_dump_summary_counts_clones_once()
+{
+    int inumber = make_file(40 * 4096, 'A');
+
+    CHECK(inumber > 0 && fs_clone(fs, inumber) > 0 && fs_clone(fs, inumber) > 0);
+    CHECK(summary_matches_statfs());
+    CHECK(fs_write(fs, inumber, "B", 1, 0) == 1);
+    CHECK(summary_matches_statfs());
+}
+
+// A shared mount's segment is private to its owner, and a later mount
+// attaches to it rather than building another, but not once others can write it
+static void test_shared_segment_private()
+{
+    struct fs_shared_info info;
+    struct stat st;
+    char name[64];
+    int inumber = make_file(8192, 'A');
+    struct fs_ctx *other = fs_ctx_init(disk);
+
+    snprintf(name, sizeof(name), "/simplefs-test-%d", (int)getpid());
+    shm_unlink(name);
+
+    CHECK(inumber > 0 && other);
+    CHECK(fs_mount_shared(fs, name, 1) && fs_shared_info(fs, &info) && info.built);
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    CHECK(fd >= 0 && fstat(fd, &st) == 0 && (st.st_mode & 0777) == 0600);
+
+    CHECK(fs_mount_shared(other, name, 1) && fs_shared_info(other, &info) && !info.built && info.attached == 2);
+    CHECK(reads_as(inumber, 0, 8192, 'A'));
+    fs_ctx_free(other);
+
+    other = fs_ctx_init(disk);
+    CHECK(fd >= 0 && fchmod(fd, 0666) == 0);
+    errno = 0;
+    CHECK(!fs_mount_shared(other, name, 1) && errno == EACCES);
+
+    close(fd);
+    fs_ctx_free(other);
+    shm_unlink(name);
+}
+
+struct test
+{
+    const char *name;
+    void (*run)();
+};
+
+static struct test tests[] = {
+    {"contexts_independent", test_contexts_independent},
+    {"truncate_zeroes_tail", test_truncate_zeroes_tail},
+    {"write_then_writev_past_end", test_write_then_writev_past_end},
+    {"vectors_across_holes", test_vectors_across_holes},
+    {"directories_not_deleted", test_directories_not_deleted},
+    {"linked_files_not_deleted", test_linked_files_not_deleted},
+    {"directories_not_written", test_directories_not_written},
+    {"format_forgets_old_inodes", test_format_forgets_old_inodes},
+    {"walks_stop_on_nonzero", test_walks_stop_on_nonzero},
+    {"dump_summary_counts", test_dump_summary_counts},
+    {"dump_summary_counts_clones_once", test_dump_summary_counts_clones_once},
+    {"large_block_directories", test_large_block_directories},
+    {"bad_pointers_not_written", test_bad_pointers_not_written},
+    {"fsck_threads_agree", test_fsck_threads_agree},
+    {"clone_copies_on_write", test_clone_copies_on_write},
+    {"statfs_follows_changes", test_statfs_follows_changes},
+    {"delete_punches_image", test_delete_punches_image},
+    {"direct_disk_unaligned_buffers", test_direct_disk_unaligned_buffers},
+    {"ram_disk_saves_on_request", test_ram_disk_saves_on_request},
+    {"delta_round_trip", test_delta_round_trip},
+    {"cross_link_detected", test_cross_link_detected},
+    {"copy_refuses_duplicates", test_copy_refuses_duplicates},
+    {"reads_check_checksums", test_reads_check_checksums},
+    {"mmap_checks_checksums", test_mmap_checks_checksums},
+    {"mmap_holds_blocks", test_mmap_holds_blocks},
+    {"discard_never_hits_reused_block", test_discard_never_hits_reused_block},
+    {"shared_segment_private", test_shared_segment_private},
+};
+
+int main(int argc, char *argv[])
+{
+    for (int i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+    {
+        int before = failures;
+
+        disk = disk_init_ram(0, TEST_BLOCKS);
+        fs = disk ? fs_ctx_init(disk) : 0;
+        if (!fs || !fs_format(fs) || !fs_mount(fs))
+        {
+            printf("%s: couldn't set up a filesystem\n", tests[i].name);
+            return 1;
+        }
+
+        tests[i].run();
+        printf("%-32s %s\n", tests[i].name, failures == before ? "ok" : "FAILED");
+
+        fs_ctx_free(fs);
+        disk_close(disk);
+    }
+
+    printf("%d checks failed\n", failures);
+    return failures != 0;
+}